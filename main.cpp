@@ -37,6 +37,17 @@ extern "C"{
     #include <libavutil/timestamp.h>
     #include <libavformat/avformat.h>
     #include <libavutil/fifo.h>
+    #include <libavutil/cpu.h>
+    #include <libavutil/pixdesc.h>
+    #include <libavutil/hwcontext.h>
+    #include <libswresample/swresample.h>
+    #include <libswscale/swscale.h>
+    #include <libavutil/opt.h>
+    #include <libavutil/time.h>
+    #include <libavutil/hash.h>
+    #include <libavfilter/avfilter.h>
+    #include <libavfilter/buffersrc.h>
+    #include <libavfilter/buffersink.h>
 }
 
 
@@ -44,586 +55,7040 @@ extern "C"{
 #include <iostream>
 #include <exception>
 #include <fstream>
-static AVFormatContext *fmt_ctx = NULL;
-static AVCodecContext *video_dec_ctx = NULL, *audio_dec_ctx;
-static int width, height;
-static enum AVPixelFormat pix_fmt;
-static AVStream *video_stream = NULL, *audio_stream = NULL;
-static const char *src_filename = NULL;
-static const char *video_dst_filename = NULL;
-static const char *audio_dst_filename = NULL;
-static FILE *video_dst_file = NULL;
-static FILE *audio_dst_file = NULL;
-
-static uint8_t *video_dst_data[4] = {NULL};
-static int      video_dst_linesize[4];
-static int video_dst_bufsize;
-
-static int video_stream_idx = -1, audio_stream_idx = -1;
-static AVFrame *frame = NULL;
-static AVPacket *pkt = NULL;
-static int video_frame_count = 0;
-static int audio_frame_count = 0;
-
-static int output_video_frame(AVFrame *frame)
-{
-    if (frame->width != width || frame->height != height ||
-        frame->format != pix_fmt) {
-        /* To handle this change, one could call av_image_alloc again and
-         * decode the following frames into another rawvideo file. */
-        fprintf(stderr, "Error: Width, height and pixel format have to be "
-                "constant in a rawvideo file, but the width, height or "
-                "pixel format of the input video changed:\n"
-                "old: width = %d, height = %d, format = %s\n"
-                "new: width = %d, height = %d, format = %s\n",
-                width, height, av_get_pix_fmt_name(pix_fmt),
-                frame->width, frame->height,
-                av_get_pix_fmt_name(AVPixelFormat(frame->format)));
-        return -1;
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <condition_variable>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+/* Hit/miss counters for the recycling pools below. A miss is a real
+ * allocation, a hit is an object or buffer handed out again. */
+struct PoolStats {
+    std::atomic<uint64_t> hits{0};
+    std::atomic<uint64_t> misses{0};
+};
+
+/* Free list of pre-allocated AVFrame/AVPacket shells. release() unrefs the
+ * object and keeps it for the next acquire() instead of freeing it, so
+ * frames in flight between pipeline stages do not cost a malloc each. */
+template <typename T, T *(*Alloc)(void), void (*Unref)(T *), void (*Free)(T **)>
+class AVObjectPool {
+public:
+    explicit AVObjectPool(size_t max_cached = 64) : max_cached_(max_cached) {}
+    AVObjectPool(const AVObjectPool &) = delete;
+    AVObjectPool &operator=(const AVObjectPool &) = delete;
+
+    ~AVObjectPool()
+    {
+        for (T *obj : free_)
+            Free(&obj);
+    }
+
+    void reserve(size_t n)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        while (free_.size() < n) {
+            T *obj = Alloc();
+            if (!obj)
+                break;
+            free_.push_back(obj);
+        }
+    }
+
+    T *acquire()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (!free_.empty()) {
+                T *obj = free_.back();
+                free_.pop_back();
+                stats.hits++;
+                return obj;
+            }
+        }
+        stats.misses++;
+        return Alloc();
+    }
+
+    void release(T *obj)
+    {
+        if (!obj)
+            return;
+        Unref(obj);
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (free_.size() < max_cached_) {
+                free_.push_back(obj);
+                return;
+            }
+        }
+        Free(&obj);
+    }
+
+    PoolStats stats;
+
+private:
+    std::mutex mutex_;
+    std::vector<T*> free_;
+    size_t max_cached_;
+};
+
+typedef AVObjectPool<AVFrame, av_frame_alloc, av_frame_unref, av_frame_free> FramePool;
+typedef AVObjectPool<AVPacket, av_packet_alloc, av_packet_unref, av_packet_free> PacketPool;
+
+static FramePool frame_pool;
+static PacketPool packet_pool;
+
+/* Stage timing. Every thread accumulates into its own ThreadMetrics, so
+ * the hot path is a clock read and a few uncontended relaxed stores; the
+ * reporter sums all threads when it prints. Durations go into log-linear
+ * histograms (8 buckets per power of two, about 6% resolution) from which
+ * the percentiles are read. */
+enum MetricsStage {
+    STAGE_READ,      /* av_read_frame */
+    STAGE_SEND,      /* avcodec_send_packet */
+    STAGE_RECEIVE,   /* avcodec_receive_frame */
+    STAGE_ENCODE,    /* avcodec_send_frame + avcodec_receive_packet */
+    STAGE_COPY,      /* av_image_copy and frame packing */
+    STAGE_WRITE,     /* fwrite, writev and BlockWriter flushes */
+    STAGE_MUX,       /* av_write_frame */
+    STAGE_LATENCY,   /* live ingest, capture to written */
+    STAGE_THROTTLE,  /* producers waiting on the memory budget */
+    STAGE_NB
+};
+
+static const char *const metrics_stage_names[STAGE_NB] = {
+    "read", "send_packet", "receive_frame", "encode", "copy", "write", "mux", "live_latency",
+    "memory_throttle",
+};
+
+struct MetricsConfig {
+    bool enabled = false;
+    /* JSON summary destination, NULL = stderr */
+    const char *json_path = NULL;
+    /* also rewrite the summary every interval seconds, 0 = only at exit */
+    double interval = 0;
+    /* the old per-frame "video_frame n:..." lines, for debugging */
+    bool frame_log = false;
+};
+static MetricsConfig metrics_cfg;
+
+struct StageCounters {
+    static const int kBuckets = 16 + 60 * 8;
+
+    std::atomic<uint64_t> count{0};
+    std::atomic<uint64_t> total_ns{0};
+    std::atomic<uint64_t> max_ns{0};
+    std::atomic<uint64_t> buckets[kBuckets] = {};
+
+    static int bucket(uint64_t ns)
+    {
+        if (ns < 16)
+            return ns;
+        int e = 63 - __builtin_clzll(ns);
+        return 16 + (e - 4) * 8 + ((ns >> (e - 3)) & 7);
+    }
+
+    static uint64_t bucket_start(int b)
+    {
+        if (b < 16)
+            return b;
+        int e = (b - 16) / 8 + 4;
+        return (uint64_t)(8 + (b - 16) % 8) << (e - 3);
+    }
+
+    /* only ever called by the owning thread */
+    void add(uint64_t ns)
+    {
+        bump(count, 1);
+        bump(total_ns, ns);
+        if (ns > max_ns.load(std::memory_order_relaxed))
+            max_ns.store(ns, std::memory_order_relaxed);
+        bump(buckets[bucket(ns)], 1);
+    }
+
+    static void bump(std::atomic<uint64_t> &c, uint64_t v)
+    {
+        c.store(c.load(std::memory_order_relaxed) + v, std::memory_order_relaxed);
+    }
+};
+
+/* Plain sums of StageCounters, for reporting. */
+struct StageTotals {
+    uint64_t count = 0, total_ns = 0, max_ns = 0;
+    uint64_t buckets[StageCounters::kBuckets] = {};
+
+    void merge(const StageCounters &c)
+    {
+        count += c.count.load(std::memory_order_relaxed);
+        total_ns += c.total_ns.load(std::memory_order_relaxed);
+        max_ns = FFMAX(max_ns, c.max_ns.load(std::memory_order_relaxed));
+        for (int i = 0; i < StageCounters::kBuckets; i++)
+            buckets[i] += c.buckets[i].load(std::memory_order_relaxed);
+    }
+
+    void merge(const StageTotals &t)
+    {
+        count += t.count;
+        total_ns += t.total_ns;
+        max_ns = FFMAX(max_ns, t.max_ns);
+        for (int i = 0; i < StageCounters::kBuckets; i++)
+            buckets[i] += t.buckets[i];
+    }
+
+    /* midpoint of the bucket holding the p-th percentile */
+    uint64_t percentile(double p) const
+    {
+        uint64_t rank = (uint64_t)(p * count), seen = 0;
+        for (int i = 0; i < StageCounters::kBuckets; i++) {
+            seen += buckets[i];
+            if (seen > rank) {
+                uint64_t lo = StageCounters::bucket_start(i);
+                uint64_t hi = i + 1 < StageCounters::kBuckets ?
+                              StageCounters::bucket_start(i + 1) : lo;
+                return FFMIN(lo + (hi - lo) / 2, max_ns);
+            }
+        }
+        return max_ns;
+    }
+};
+
+struct ThreadMetrics;
+
+static struct MetricsRegistry {
+    std::mutex mutex;
+    std::vector<ThreadMetrics *> live;
+    /* what threads that have exited left behind */
+    StageTotals retired[STAGE_NB];
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+} metrics_registry;
+
+struct ThreadMetrics {
+    StageCounters stages[STAGE_NB];
+
+    ThreadMetrics()
+    {
+        std::lock_guard<std::mutex> lock(metrics_registry.mutex);
+        metrics_registry.live.push_back(this);
+    }
+
+    ~ThreadMetrics()
+    {
+        std::lock_guard<std::mutex> lock(metrics_registry.mutex);
+        std::vector<ThreadMetrics *> &live = metrics_registry.live;
+        live.erase(std::remove(live.begin(), live.end(), this), live.end());
+        for (int i = 0; i < STAGE_NB; i++)
+            metrics_registry.retired[i].merge(stages[i]);
+    }
+
+    static ThreadMetrics &current()
+    {
+        static thread_local ThreadMetrics metrics;
+        return metrics;
+    }
+};
+
+/* Record a duration measured by other means, e.g. across threads. */
+static void metrics_record(MetricsStage stage, uint64_t ns)
+{
+    if (metrics_cfg.enabled)
+        ThreadMetrics::current().stages[stage].add(ns);
+}
+
+/* Times its scope into stage; free when metrics are off. */
+class StageTimer {
+public:
+    explicit StageTimer(MetricsStage stage) : stage_(stage), on_(metrics_cfg.enabled)
+    {
+        if (on_)
+            start_ = std::chrono::steady_clock::now();
+    }
+
+    ~StageTimer()
+    {
+        if (!on_)
+            return;
+        auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - start_).count();
+        metrics_record(stage_, ns);
+    }
+
+private:
+    MetricsStage stage_;
+    bool on_;
+    std::chrono::steady_clock::time_point start_;
+};
+
+/* Accounting of the frame and packet buffers parked in queues between
+ * threads, which is where memory piles up when one stage is slower than
+ * the one feeding it (a 1080p yuv420p picture is 3 MB, 4K 12 MB). With a
+ * limit set, producers of the threaded paths wait in memory_throttle()
+ * while the budget is used up, as long as something downstream of them
+ * can still drain. Buffers shared by several queued references (fan-out,
+ * ABR rungs) are counted once per reference, which errs on the safe side
+ * of a hard RSS cap. Current and peak usage go into the metrics report. */
+enum MemoryStage {
+    MEM_PACKET_QUEUE,   /* demuxer -> decoder threads */
+    MEM_FRAME_QUEUE,    /* decoder -> writer/encoder threads */
+    MEM_FANOUT,         /* FrameFanout ring */
+    MEM_MUX_QUEUE,      /* PacketInterleaver */
+    MEM_LIVE_QUEUE,     /* LiveFrameQueue */
+    MEM_NB
+};
+
+static const char *const memory_stage_names[MEM_NB] = {
+    "packet_queue", "frame_queue", "fanout", "mux_queue", "live_queue",
+};
+
+struct MemoryConfig {
+    /* bytes, 0 = unlimited */
+    int64_t limit = 0;
+};
+static MemoryConfig memory_cfg;
+
+static struct MemoryAccountant {
+    std::atomic<int64_t> current[MEM_NB] = {};
+    std::atomic<int64_t> peak[MEM_NB] = {};
+    std::atomic<int64_t> total{0}, total_peak{0};
+    std::atomic<uint64_t> throttled{0};
+    std::atomic<int> waiters{0};
+    std::mutex mutex;
+    std::condition_variable cv;
+} memory_budget;
+
+static void memory_raise_peak(std::atomic<int64_t> &peak, int64_t v)
+{
+    int64_t p = peak.load(std::memory_order_relaxed);
+    while (v > p && !peak.compare_exchange_weak(p, v, std::memory_order_relaxed))
+        ;
+}
+
+static void memory_charge(MemoryStage stage, int64_t bytes)
+{
+    memory_raise_peak(memory_budget.peak[stage], memory_budget.current[stage].fetch_add(bytes) + bytes);
+    memory_raise_peak(memory_budget.total_peak, memory_budget.total.fetch_add(bytes) + bytes);
+}
+
+static void memory_release(MemoryStage stage, int64_t bytes)
+{
+    memory_budget.current[stage].fetch_sub(bytes);
+    memory_budget.total.fetch_sub(bytes);
+    if (memory_budget.waiters.load()) {
+        std::lock_guard<std::mutex> lock(memory_budget.mutex);
+        memory_budget.cv.notify_all();
+    }
+}
+
+static int64_t frame_bytes(const AVFrame *frame)
+{
+    int64_t bytes = 0;
+    for (int i = 0; i < AV_NUM_DATA_POINTERS && frame->buf[i]; i++)
+        bytes += frame->buf[i]->size;
+    for (int i = 0; i < frame->nb_extended_buf; i++)
+        bytes += frame->extended_buf[i]->size;
+    return bytes;
+}
+
+static int64_t packet_bytes(const AVPacket *pkt)
+{
+    return pkt->buf ? (int64_t)pkt->buf->size : pkt->size;
+}
+
+/* Wait while the budget is exhausted and one of the stages in drain_mask
+ * (1 << MemoryStage) still holds buffers whose consumer will free them;
+ * waiting on anything else could never end. */
+static void memory_throttle(unsigned drain_mask, const std::atomic<bool> &abort)
+{
+    auto must_wait = [drain_mask, &abort] {
+        if (memory_cfg.limit <= 0 || memory_budget.total.load() < memory_cfg.limit || abort)
+            return false;
+        for (int i = 0; i < MEM_NB; i++)
+            if ((drain_mask & (1u << i)) && memory_budget.current[i].load() > 0)
+                return true;
+        return false;
+    };
+    if (!must_wait())
+        return;
+
+    StageTimer timer(STAGE_THROTTLE);
+    std::unique_lock<std::mutex> lock(memory_budget.mutex);
+    memory_budget.throttled++;
+    memory_budget.waiters++;
+    /* the timeout only covers a missed abort, releases notify */
+    while (must_wait())
+        memory_budget.cv.wait_for(lock, std::chrono::milliseconds(10));
+    memory_budget.waiters--;
+}
+
+static void memory_write_json(FILE *out)
+{
+    fprintf(out, ",\n  \"memory\": { \"limit\": %lld, \"current\": %lld, \"peak\": %lld, "
+            "\"throttled\": %llu, \"stages\": {",
+            (long long)memory_cfg.limit, (long long)memory_budget.total.load(),
+            (long long)memory_budget.total_peak.load(), (unsigned long long)memory_budget.throttled.load());
+    for (int i = 0; i < MEM_NB; i++)
+        fprintf(out, "%s\n    \"%s\": { \"current\": %lld, \"peak\": %lld }", i ? "," : "",
+                memory_stage_names[i], (long long)memory_budget.current[i].load(),
+                (long long)memory_budget.peak[i].load());
+    fprintf(out, "\n  } }");
+}
+
+static void metrics_write_json(FILE *out)
+{
+    StageTotals totals[STAGE_NB];
+    double elapsed;
+    size_t threads;
+
+    {
+        std::lock_guard<std::mutex> lock(metrics_registry.mutex);
+        for (int i = 0; i < STAGE_NB; i++) {
+            totals[i].merge(metrics_registry.retired[i]);
+            for (ThreadMetrics *t : metrics_registry.live)
+                totals[i].merge(t->stages[i]);
+        }
+        threads = metrics_registry.live.size();
+        elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                                metrics_registry.start).count();
+    }
+
+    fprintf(out, "{\n  \"elapsed_s\": %.3f,\n  \"live_threads\": %zu,\n  \"stages\": {", elapsed, threads);
+    const char *sep = "";
+    for (int i = 0; i < STAGE_NB; i++) {
+        const StageTotals &t = totals[i];
+        if (!t.count)
+            continue;
+        fprintf(out, "%s\n    \"%s\": { \"count\": %llu, \"total_ms\": %.3f, \"mean_us\": %.3f, "
+                "\"p50_us\": %.3f, \"p99_us\": %.3f, \"max_us\": %.3f }",
+                sep, metrics_stage_names[i], (unsigned long long)t.count, t.total_ns / 1e6,
+                t.total_ns / 1e3 / t.count, t.percentile(0.50) / 1e3,
+                t.percentile(0.99) / 1e3, t.max_ns / 1e3);
+        sep = ",";
+    }
+    fprintf(out, "\n  }");
+    memory_write_json(out);
+    fprintf(out, "\n}\n");
+}
+
+/* Writes the summary to metrics_cfg.json_path, or stderr. The file is
+ * replaced atomically so a periodic reader never sees half a report. */
+static int metrics_report()
+{
+    if (!metrics_cfg.json_path) {
+        metrics_write_json(stderr);
+        return 0;
+    }
+    std::string tmp = std::string(metrics_cfg.json_path) + ".tmp";
+    FILE *f = fopen(tmp.c_str(), "w");
+    if (!f)
+        return AVERROR(errno);
+    metrics_write_json(f);
+    if (fclose(f) != 0 || rename(tmp.c_str(), metrics_cfg.json_path) < 0) {
+        unlink(tmp.c_str());
+        return AVERROR(errno);
+    }
+    return 0;
+}
+
+/* Periodic reporting thread, started when metrics_cfg.interval is set. */
+static struct MetricsReporter {
+    std::thread thread;
+    std::mutex mutex;
+    std::condition_variable cv;
+    bool stop = false;
+} metrics_reporter;
+
+static void metrics_start()
+{
+    if (!metrics_cfg.enabled || metrics_cfg.interval <= 0)
+        return;
+    metrics_reporter.thread = std::thread([] {
+        std::unique_lock<std::mutex> lock(metrics_reporter.mutex);
+        auto period = std::chrono::duration<double>(metrics_cfg.interval);
+        while (!metrics_reporter.cv.wait_for(lock, period, [] { return metrics_reporter.stop; }))
+            metrics_report();
+    });
+}
+
+/* Stops the reporter and writes the final summary. */
+static void metrics_finish()
+{
+    if (!metrics_cfg.enabled)
+        return;
+    if (metrics_reporter.thread.joinable()) {
+        {
+            std::lock_guard<std::mutex> lock(metrics_reporter.mutex);
+            metrics_reporter.stop = true;
+        }
+        metrics_reporter.cv.notify_all();
+        metrics_reporter.thread.join();
+    }
+    if (metrics_report() < 0)
+        fprintf(stderr, "Could not write metrics to %s\n", metrics_cfg.json_path);
+}
+
+static int timed_read_frame(AVFormatContext *ic, AVPacket *pkt)
+{
+    StageTimer timer(STAGE_READ);
+    return av_read_frame(ic, pkt);
+}
+
+static int timed_send_packet(AVCodecContext *dec, const AVPacket *pkt)
+{
+    StageTimer timer(STAGE_SEND);
+    return avcodec_send_packet(dec, pkt);
+}
+
+static int timed_receive_frame(AVCodecContext *dec, AVFrame *frame)
+{
+    StageTimer timer(STAGE_RECEIVE);
+    return avcodec_receive_frame(dec, frame);
+}
+
+static int timed_send_frame(AVCodecContext *enc, const AVFrame *frame)
+{
+    StageTimer timer(STAGE_ENCODE);
+    return avcodec_send_frame(enc, frame);
+}
+
+static int timed_receive_packet(AVCodecContext *enc, AVPacket *pkt)
+{
+    StageTimer timer(STAGE_ENCODE);
+    return avcodec_receive_packet(enc, pkt);
+}
+
+/* Output settings for BlockWriter. buffer_size is rounded up to a multiple
+ * of the page size; with direct_io every write except the last one is then
+ * a whole number of aligned blocks, as O_DIRECT requires. */
+struct WriterConfig {
+    bool enabled = false;
+    size_t buffer_size = 8 << 20;
+    bool direct_io = false;
+    /* flush full buffers on a background thread while the other one fills */
+    bool async = true;
+};
+static WriterConfig raw_writer_cfg;
+
+/* Sequential file writer with two large page-aligned buffers. Callers fill
+ * one buffer while the previous one is written out by the flush thread, so
+ * the disk only ever sees buffer_size writes. */
+class BlockWriter {
+public:
+    static const size_t kAlign = 4096;
+
+    BlockWriter() = default;
+    BlockWriter(const BlockWriter &) = delete;
+    BlockWriter &operator=(const BlockWriter &) = delete;
+    ~BlockWriter() { close(); }
+
+    bool is_open() const { return fd_ >= 0; }
+
+    int open(const char *path, const WriterConfig &cfg)
+    {
+        int flags = O_WRONLY | O_CREAT | O_TRUNC;
+
+        cap_ = FFMAX(FFALIGN(cfg.buffer_size, kAlign), kAlign);
+        direct_ = cfg.direct_io;
+        async_ = cfg.async;
+        fd_ = ::open(path, flags | (direct_ ? O_DIRECT : 0), 0644);
+        if (fd_ < 0 && direct_ && errno == EINVAL) {
+            /* tmpfs and some network filesystems refuse O_DIRECT */
+            direct_ = false;
+            fd_ = ::open(path, flags, 0644);
+        }
+        if (fd_ < 0)
+            return AVERROR(errno);
+
+        for (int i = 0; i < 2; i++) {
+            if (posix_memalign((void **)&buf_[i], kAlign, cap_)) {
+                buf_[i] = NULL;
+                close();
+                return AVERROR(ENOMEM);
+            }
+        }
+        cur_ = 0;
+        used_ = 0;
+        offset_ = 0;
+        error_ = 0;
+        stop_ = false;
+        if (async_)
+            thread_ = std::thread(&BlockWriter::flush_thread, this);
+        return 0;
+    }
+
+    int write(const void *data, size_t size)
+    {
+        const uint8_t *p = (const uint8_t *)data;
+        while (size > 0) {
+            size_t n = FFMIN(size, cap_ - used_);
+            memcpy(buf_[cur_] + used_, p, n);
+            used_ += n;
+            p += n;
+            size -= n;
+            if (used_ == cap_) {
+                int ret = submit();
+                if (ret < 0)
+                    return ret;
+            }
+        }
+        return 0;
+    }
+
+    /* Writes out whatever is buffered and closes the file. Returns the first
+     * error seen by any write since open(). */
+    int close()
+    {
+        if (fd_ < 0)
+            return 0;
+
+        if (thread_.joinable()) {
+            std::unique_lock<std::mutex> lock(mutex_);
+            cv_.wait(lock, [this] { return !pending_; });
+            stop_ = true;
+            cv_.notify_all();
+            lock.unlock();
+            thread_.join();
+        }
+        if (used_ && !error_) {
+            /* the tail is not block sized, finish it without O_DIRECT */
+            if (direct_)
+                fcntl(fd_, F_SETFL, fcntl(fd_, F_GETFL) & ~O_DIRECT);
+            error_ = write_block(buf_[cur_], used_);
+        }
+        used_ = 0;
+        ::close(fd_);
+        fd_ = -1;
+        for (int i = 0; i < 2; i++) {
+            free(buf_[i]);
+            buf_[i] = NULL;
+        }
+        return error_;
+    }
+
+private:
+    int submit()
+    {
+        if (!async_) {
+            int ret = write_block(buf_[cur_], used_);
+            used_ = 0;
+            return ret;
+        }
+
+        std::unique_lock<std::mutex> lock(mutex_);
+        cv_.wait(lock, [this] { return !pending_; });
+        if (error_)
+            return error_;
+        pending_ = true;
+        pending_idx_ = cur_;
+        pending_len_ = used_;
+        cv_.notify_all();
+        lock.unlock();
+
+        cur_ ^= 1;
+        used_ = 0;
+        return 0;
+    }
+
+    int write_block(const uint8_t *p, size_t len)
+    {
+        StageTimer timer(STAGE_WRITE);
+        while (len > 0) {
+            ssize_t n = pwrite(fd_, p, len, offset_);
+            if (n < 0) {
+                if (errno == EINTR)
+                    continue;
+                return AVERROR(errno);
+            }
+            p += n;
+            len -= n;
+            offset_ += n;
+        }
+        return 0;
+    }
+
+    void flush_thread()
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        for (;;) {
+            cv_.wait(lock, [this] { return pending_ || stop_; });
+            if (!pending_)
+                return;
+            int idx = pending_idx_;
+            size_t len = pending_len_;
+            lock.unlock();
+            int ret = write_block(buf_[idx], len);
+            lock.lock();
+            if (ret < 0 && !error_)
+                error_ = ret;
+            pending_ = false;
+            cv_.notify_all();
+        }
+    }
+
+    int fd_ = -1;
+    bool direct_ = false;
+    bool async_ = true;
+    size_t cap_ = 0;
+    uint8_t *buf_[2] = { NULL, NULL };
+    int cur_ = 0;
+    size_t used_ = 0;
+    off_t offset_ = 0;
+
+    std::thread thread_;
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    bool pending_ = false;
+    int pending_idx_ = 0;
+    size_t pending_len_ = 0;
+    bool stop_ = false;
+    int error_ = 0;
+};
+
+/* Small cache of initialized scalers keyed by the full conversion, so that
+ * streams switching back and forth between a few resolutions (adaptive
+ * streaming) never rebuild a SwsContext per frame. Not thread-safe; every
+ * consumer owns its cache. threads > 1 enables libswscale's slice
+ * threading, 0 lets it use every core. */
+class SwsCache {
+public:
+    explicit SwsCache(int threads = 1, size_t capacity = 8)
+        : threads_(threads), capacity_(capacity) {}
+    SwsCache(const SwsCache &) = delete;
+    SwsCache &operator=(const SwsCache &) = delete;
+
+    ~SwsCache()
+    {
+        for (Entry &e : entries_)
+            sws_freeContext(e.ctx);
+    }
+
+    void set_threads(int threads) { threads_ = threads; }
+
+    SwsContext *get(int src_w, int src_h, enum AVPixelFormat src_fmt,
+                    int dst_w, int dst_h, enum AVPixelFormat dst_fmt, int flags)
+    {
+        Key key = { src_w, src_h, src_fmt, dst_w, dst_h, dst_fmt, flags };
+
+        for (size_t i = 0; i < entries_.size(); i++) {
+            if (!memcmp(&entries_[i].key, &key, sizeof(key))) {
+                /* keep the most recently used one in front */
+                std::rotate(entries_.begin(), entries_.begin() + i, entries_.begin() + i + 1);
+                return entries_[0].ctx;
+            }
+        }
+
+        SwsContext *ctx = sws_alloc_context();
+        if (!ctx)
+            return NULL;
+        av_opt_set_int(ctx, "srcw", src_w, 0);
+        av_opt_set_int(ctx, "srch", src_h, 0);
+        av_opt_set_int(ctx, "src_format", src_fmt, 0);
+        av_opt_set_int(ctx, "dstw", dst_w, 0);
+        av_opt_set_int(ctx, "dsth", dst_h, 0);
+        av_opt_set_int(ctx, "dst_format", dst_fmt, 0);
+        av_opt_set_int(ctx, "sws_flags", flags, 0);
+        av_opt_set_int(ctx, "threads", threads_, 0);
+        if (sws_init_context(ctx, NULL, NULL) < 0) {
+            fprintf(stderr, "Cannot convert %dx%d %s to %dx%d %s\n",
+                    src_w, src_h, av_get_pix_fmt_name(src_fmt),
+                    dst_w, dst_h, av_get_pix_fmt_name(dst_fmt));
+            sws_freeContext(ctx);
+            return NULL;
+        }
+
+        if (entries_.size() >= capacity_) {
+            sws_freeContext(entries_.back().ctx);
+            entries_.pop_back();
+        }
+        entries_.insert(entries_.begin(), { key, ctx });
+        return ctx;
+    }
+
+    /* Scale src into dst, whose width, height and format must be set;
+     * buffers are allocated if dst has none. */
+    int scale(AVFrame *dst, const AVFrame *src, int flags)
+    {
+        SwsContext *ctx = get(src->width, src->height, AVPixelFormat(src->format),
+                              dst->width, dst->height, AVPixelFormat(dst->format), flags);
+        int ret;
+        if (!ctx)
+            return AVERROR(EINVAL);
+        if ((ret = sws_scale_frame(ctx, dst, src)) < 0)
+            return ret;
+        return av_frame_copy_props(dst, src);
+    }
+
+private:
+    struct Key {
+        int src_w, src_h, src_fmt;
+        int dst_w, dst_h, dst_fmt;
+        int flags;
+    };
+    struct Entry {
+        Key key;
+        SwsContext *ctx;
+    };
+
+    int threads_;
+    size_t capacity_;
+    std::vector<Entry> entries_;
+};
+
+/* Settings of the filtergraphs run between decoding and output. NULL
+ * descriptions ("yadif,scale=1280:-2", "fps=30", "aresample=48000") leave
+ * the stream unfiltered. libavfilter only threads within a frame: with
+ * thread_type AVFILTER_THREAD_SLICE, filters that support it (scale,
+ * yadif, colorspace, ...) split every frame across nb_threads threads, 0
+ * meaning one per core; thread_type 0 keeps each graph single-threaded. */
+struct FilterConfig {
+    const char *video = NULL;
+    const char *audio = NULL;
+    int nb_threads = 0;
+    int thread_type = AVFILTER_THREAD_SLICE;
+};
+static FilterConfig filter_cfg;
+
+/* A single-input, single-output filtergraph, configured from the first
+ * frame pushed into it and rebuilt only when the input format changes.
+ * Frames pass by reference, so an unfiltered plane is never copied. With
+ * hardware frames the buffer source takes the frames' hw_frames_ctx, so
+ * device filters (scale_cuda, scale_vaapi) work on the surfaces in place.
+ * Not thread-safe; every consumer owns its filter. */
+class FrameFilter {
+public:
+    FrameFilter() = default;
+    FrameFilter(const FrameFilter &) = delete;
+    FrameFilter &operator=(const FrameFilter &) = delete;
+
+    ~FrameFilter() { reset(); }
+
+    void reset()
+    {
+        avfilter_graph_free(&graph_);
+        av_buffer_unref(&hw_frames_);
+        av_channel_layout_uninit(&ch_layout_);
+        src_ = sink_ = NULL;
+    }
+
+    bool configured() const { return graph_ != NULL; }
+
+    /* the buffersink, for what the graph outputs */
+    const AVFilterContext *sink() const { return sink_; }
+
+    /* whether frames like this one can be pushed without a new graph */
+    bool matches(const AVFrame *frame) const
+    {
+        if (!graph_ || frame->format != format_)
+            return false;
+        if (type_ == AVMEDIA_TYPE_AUDIO)
+            return frame->sample_rate == sample_rate_ &&
+                   !av_channel_layout_compare(&frame->ch_layout, &ch_layout_);
+        return frame->width == width_ && frame->height == height_ &&
+               (frame->hw_frames_ctx ? hw_frames_ && frame->hw_frames_ctx->data == hw_frames_->data
+                                     : !hw_frames_);
+    }
+
+    int init(enum AVMediaType type, const AVFrame *frame, AVRational time_base, const char *desc,
+             int nb_threads = 0, int thread_type = AVFILTER_THREAD_SLICE)
+    {
+        AVFilterInOut *outputs = NULL, *inputs = NULL;
+        AVBufferSrcParameters *par = NULL;
+        char args[512], layout[256];
+        int ret;
+
+        reset();
+        if (!(graph_ = avfilter_graph_alloc()))
+            return AVERROR(ENOMEM);
+        /* must be set before the first filter is created */
+        graph_->nb_threads = nb_threads;
+        graph_->thread_type = thread_type;
+        type_ = type;
+        if (type == AVMEDIA_TYPE_AUDIO) {
+            av_channel_layout_describe(&frame->ch_layout, layout, sizeof(layout));
+            snprintf(args, sizeof(args), "time_base=%d/%d:sample_rate=%d:sample_fmt=%s:channel_layout=%s",
+                     time_base.num, time_base.den, frame->sample_rate,
+                     av_get_sample_fmt_name(AVSampleFormat(frame->format)), layout);
+        } else {
+            snprintf(args, sizeof(args), "video_size=%dx%d:pix_fmt=%d:time_base=%d/%d:pixel_aspect=%d/%d",
+                     frame->width, frame->height, frame->format, time_base.num, time_base.den,
+                     frame->sample_aspect_ratio.num, FFMAX(frame->sample_aspect_ratio.den, 1));
+        }
+        if ((ret = avfilter_graph_create_filter(&src_, avfilter_get_by_name(
+                                                    type == AVMEDIA_TYPE_AUDIO ? "abuffer" : "buffer"),
+                                                "in", args, NULL, graph_)) < 0 ||
+            (ret = avfilter_graph_create_filter(&sink_, avfilter_get_by_name(
+                                                    type == AVMEDIA_TYPE_AUDIO ? "abuffersink" : "buffersink"),
+                                                "out", NULL, NULL, graph_)) < 0)
+            goto end;
+        if (frame->hw_frames_ctx) {
+            if (!(par = av_buffersrc_parameters_alloc()) ||
+                !(hw_frames_ = av_buffer_ref(frame->hw_frames_ctx))) {
+                ret = AVERROR(ENOMEM);
+                goto end;
+            }
+            par->format = frame->format;
+            par->hw_frames_ctx = hw_frames_;
+            if ((ret = av_buffersrc_parameters_set(src_, par)) < 0)
+                goto end;
+        }
+
+        outputs = avfilter_inout_alloc();
+        inputs = avfilter_inout_alloc();
+        if (!outputs || !inputs) {
+            ret = AVERROR(ENOMEM);
+            goto end;
+        }
+        outputs->name = av_strdup("in");
+        outputs->filter_ctx = src_;
+        inputs->name = av_strdup("out");
+        inputs->filter_ctx = sink_;
+        if ((ret = avfilter_graph_parse_ptr(graph_, desc, &inputs, &outputs, NULL)) < 0)
+            goto end;
+        /* filters creating surfaces of their own (hwupload) need the device */
+        if (hw_frames_) {
+            AVBufferRef *device = ((AVHWFramesContext *)hw_frames_->data)->device_ref;
+            for (unsigned i = 0; i < graph_->nb_filters; i++)
+                if (!graph_->filters[i]->hw_device_ctx &&
+                    !(graph_->filters[i]->hw_device_ctx = av_buffer_ref(device))) {
+                    ret = AVERROR(ENOMEM);
+                    goto end;
+                }
+        }
+        if ((ret = avfilter_graph_config(graph_, NULL)) < 0)
+            goto end;
+        width_ = frame->width;
+        height_ = frame->height;
+        format_ = frame->format;
+        sample_rate_ = frame->sample_rate;
+        if ((ret = av_channel_layout_copy(&ch_layout_, &frame->ch_layout)) < 0)
+            goto end;
+
+    end:
+        avfilter_inout_free(&inputs);
+        avfilter_inout_free(&outputs);
+        av_free(par);
+        if (ret < 0) {
+            fprintf(stderr, "Cannot set up filtergraph '%s'\n", desc);
+            reset();
+        }
+        return ret;
+    }
+
+    /* frame keeps its reference; NULL signals the end of the input */
+    int push(AVFrame *frame)
+    {
+        return av_buffersrc_add_frame_flags(src_, frame, AV_BUFFERSRC_FLAG_KEEP_REF);
+    }
+
+    /* AVERROR(EAGAIN) once everything pushed so far has come out,
+     * AVERROR_EOF after the end of the input */
+    int pull(AVFrame *frame) { return av_buffersink_get_frame(sink_, frame); }
+
+private:
+    AVFilterGraph *graph_ = NULL;
+    AVFilterContext *src_ = NULL, *sink_ = NULL;
+    AVBufferRef *hw_frames_ = NULL;
+    enum AVMediaType type_ = AVMEDIA_TYPE_VIDEO;
+    int width_ = 0, height_ = 0, format_ = -1;
+    int sample_rate_ = 0;
+    AVChannelLayout ch_layout_{};
+};
+
+/* Geometry of the rawvideo written by demuxer_decode(). Zero/NONE keeps
+ * what the decoder produces at the start; frames that differ, including
+ * after a mid-stream resolution change, are scaled to it. */
+struct RawVideoConfig {
+    int width = 0, height = 0;
+    enum AVPixelFormat pix_fmt = AV_PIX_FMT_NONE;
+    int sws_flags = SWS_BICUBIC;
+    int sws_threads = 1;
+};
+static RawVideoConfig raw_video_cfg;
+
+/* Sidecar index of a rawvideo dump, written next to it as <path>.idx: a
+ * header describing the frames, then one fixed-size record per frame, so
+ * frame n is at header_size + n * record_size. Readers mmap it, bisect on
+ * pts and pread() the frames they want, from as many threads as they like.
+ * Every frame of a dump has the header's geometry, the writer scales
+ * anything else to it. Host byte order. */
+struct RawIndexHeader {
+    char magic[8];
+    uint32_t header_size;
+    uint32_t record_size;
+    int32_t width, height;
+    /* av_get_pix_fmt_name(), the enum values differ between versions */
+    char pix_fmt[32];
+    /* of pts and duration */
+    AVRational time_base;
+    /* 0/1 when unknown */
+    AVRational frame_rate;
+    int64_t frame_size;
+    /* filled in when the dump is closed: readers of one still being
+     * written go by the size of the file */
+    uint64_t count;
+};
+
+enum {
+    RAW_INDEX_KEY             = 1 << 0,
+    RAW_INDEX_INTERLACED      = 1 << 1,
+    RAW_INDEX_TOP_FIELD_FIRST = 1 << 2,
+};
+
+struct RawIndexRecord {
+    int64_t pts;
+    int64_t duration;
+    /* of the frame in the dump */
+    int64_t offset;
+    uint32_t size;
+    uint32_t flags;
+};
+
+static_assert(sizeof(RawIndexHeader) % 8 == 0 && sizeof(RawIndexRecord) == 32,
+              "raw index records must stay 8 byte aligned in the mapping");
+
+static const char kRawIndexMagic[8] = { 'R', 'A', 'W', 'I', 'D', 'X', '1', 0 };
+
+struct RawIndexConfig {
+    bool enabled = true;
+};
+static RawIndexConfig raw_index_cfg;
+
+static std::string raw_index_path(const char *path)
+{
+    return std::string(path) + ".idx";
+}
+
+class RawIndexWriter {
+public:
+    RawIndexWriter() = default;
+    RawIndexWriter(const RawIndexWriter &) = delete;
+    RawIndexWriter &operator=(const RawIndexWriter &) = delete;
+    ~RawIndexWriter() { close(); }
+
+    bool is_open() const { return f_ != NULL; }
+
+    int open(const char *data_path, int width, int height, enum AVPixelFormat fmt,
+             AVRational time_base, AVRational frame_rate, int64_t frame_size)
+    {
+        const char *name = av_get_pix_fmt_name(fmt);
+
+        memset(&hdr_, 0, sizeof(hdr_));
+        memcpy(hdr_.magic, kRawIndexMagic, sizeof(hdr_.magic));
+        hdr_.header_size = sizeof(hdr_);
+        hdr_.record_size = sizeof(RawIndexRecord);
+        hdr_.width = width;
+        hdr_.height = height;
+        snprintf(hdr_.pix_fmt, sizeof(hdr_.pix_fmt), "%s", name ? name : "");
+        hdr_.time_base = time_base;
+        hdr_.frame_rate = frame_rate.num > 0 && frame_rate.den > 0 ? frame_rate : AVRational{ 0, 1 };
+        hdr_.frame_size = frame_size;
+
+        path_ = raw_index_path(data_path);
+        if (!(f_ = fopen(path_.c_str(), "wb")))
+            return AVERROR(errno);
+        if (fwrite(&hdr_, sizeof(hdr_), 1, f_) != 1) {
+            discard();
+            return AVERROR(EIO);
+        }
+        return 0;
+    }
+
+    int add(const RawIndexRecord &rec)
+    {
+        if (fwrite(&rec, sizeof(rec), 1, f_) != 1)
+            return AVERROR(EIO);
+        hdr_.count++;
+        return 0;
+    }
+
+    /* Writes the record count into the header. */
+    int close()
+    {
+        bool ok;
+
+        if (!f_)
+            return 0;
+        ok = fseek(f_, 0, SEEK_SET) == 0 && fwrite(&hdr_, sizeof(hdr_), 1, f_) == 1;
+        ok = fclose(f_) == 0 && ok;
+        f_ = NULL;
+        if (!ok) {
+            unlink(path_.c_str());
+            return AVERROR(EIO);
+        }
+        return 0;
+    }
+
+    /* Drop an index that could not be written, a partial one would send
+     * readers to the wrong frames. */
+    void discard()
+    {
+        if (!f_)
+            return;
+        fclose(f_);
+        f_ = NULL;
+        unlink(path_.c_str());
+    }
+
+private:
+    FILE *f_ = NULL;
+    RawIndexHeader hdr_;
+    std::string path_;
+};
+
+/* Which video frames decode_to_raw() writes, for thumbnail and analysis
+ * jobs. KEYFRAMES never decodes anything else: non-key packets are dropped
+ * by the demuxer where it honours AVDISCARD_NONKEY and before the decoder
+ * otherwise. EVERY_NTH writes the first decoded frame at or after every
+ * nth frame position, and lets the decoder skip non-reference frames,
+ * which no other frame depends on. */
+struct FrameSelectConfig {
+    enum Mode { ALL, KEYFRAMES, EVERY_NTH } mode = ALL;
+    int n = 1;
+};
+static FrameSelectConfig frame_select_cfg;
+
+/* "all", "key" or "every=N". */
+static int parse_frame_select(const char *arg, FrameSelectConfig *cfg)
+{
+    if (!strcmp(arg, "all")) {
+        cfg->mode = FrameSelectConfig::ALL;
+    } else if (!strcmp(arg, "key")) {
+        cfg->mode = FrameSelectConfig::KEYFRAMES;
+    } else if (!strncmp(arg, "every=", 6) && atoi(arg + 6) > 0) {
+        cfg->mode = FrameSelectConfig::EVERY_NTH;
+        cfg->n = atoi(arg + 6);
+    } else {
+        return AVERROR(EINVAL);
+    }
+    return 0;
+}
+
+class PackedAudioWriter;
+
+/* Everything one decode_to_raw() job owns: the input, its decoders, the
+ * output files and the buffers in between. Sessions are independent, so
+ * any number of them can run at once. Move-only; whatever is still open
+ * is released by the destructor, on every path out of a job. */
+class DecodeSession {
+public:
+    DecodeSession();
+    DecodeSession(const DecodeSession &) = delete;
+    DecodeSession &operator=(const DecodeSession &) = delete;
+    DecodeSession(DecodeSession &&other) noexcept : DecodeSession() { swap(other); }
+    DecodeSession &operator=(DecodeSession &&other) noexcept
+    {
+        DecodeSession tmp(std::move(other));
+        swap(tmp);
+        return *this;
+    }
+    ~DecodeSession();
+
+    void close();
+
+    AVFormatContext *fmt_ctx = NULL;
+    AVCodecContext *video_dec_ctx = NULL, *audio_dec_ctx = NULL;
+    int width = 0, height = 0;
+    enum AVPixelFormat pix_fmt = AV_PIX_FMT_NONE;
+    AVStream *video_stream = NULL, *audio_stream = NULL;
+    std::string src_filename;
+    std::string video_dst_filename;
+    std::string audio_dst_filename;
+    FILE *video_dst_file = NULL;
+    FILE *audio_dst_file = NULL;
+
+    uint8_t *video_dst_data[4] = {NULL};
+    int      video_dst_linesize[4] = {0};
+    int video_dst_bufsize = 0;
+
+    int video_stream_idx = -1, audio_stream_idx = -1;
+    AVFrame *frame = NULL;
+    AVPacket *pkt = NULL;
+    int video_frame_count = 0;
+    int audio_frame_count = 0;
+
+    /* held by pointer: the writers' threads and audio_writer's sink refer
+     * to them by address, which has to survive a move */
+    std::unique_ptr<BlockWriter> video_writer;
+    std::unique_ptr<BlockWriter> audio_block_writer;
+    std::unique_ptr<PackedAudioWriter> audio_writer;
+    std::unique_ptr<SwsCache> scalers;
+    /* filter_cfg graphs, built on the first frame of their stream */
+    std::unique_ptr<FrameFilter> video_filter, audio_filter;
+    /* raw_index_cfg sidecar of the video dump, and where its next frame goes */
+    std::unique_ptr<RawIndexWriter> video_index;
+    int64_t video_dst_offset = 0;
+    /* last input geometry reported as scaled */
+    int scaled_w = 0, scaled_h = 0, scaled_fmt = AV_PIX_FMT_NONE;
+    /* which video frames are written, and the state of that selection:
+     * video frames seen, next position to write */
+    FrameSelectConfig frame_select;
+    int64_t decoded_frames = 0;
+    int64_t next_selected = 0;
+    /* DecodeRange on the input's own timeline, in AV_TIME_BASE. The done
+     * flags are raised by whoever writes the frames and read by the
+     * demuxing loop, which may be another thread. */
+    int64_t range_start = AV_NOPTS_VALUE, range_end = AV_NOPTS_VALUE;
+    int64_t max_video_frames = -1;
+    std::atomic<bool> video_done{false}, audio_done{false};
+
+    bool range_done() const
+    {
+        return (!video_stream || video_done) && (!audio_stream || audio_done);
+    }
+
+private:
+    void swap(DecodeSession &o) noexcept
+    {
+        std::swap(fmt_ctx, o.fmt_ctx);
+        std::swap(video_dec_ctx, o.video_dec_ctx);
+        std::swap(audio_dec_ctx, o.audio_dec_ctx);
+        std::swap(width, o.width);
+        std::swap(height, o.height);
+        std::swap(pix_fmt, o.pix_fmt);
+        std::swap(video_stream, o.video_stream);
+        std::swap(audio_stream, o.audio_stream);
+        src_filename.swap(o.src_filename);
+        video_dst_filename.swap(o.video_dst_filename);
+        audio_dst_filename.swap(o.audio_dst_filename);
+        std::swap(video_dst_file, o.video_dst_file);
+        std::swap(audio_dst_file, o.audio_dst_file);
+        std::swap(video_dst_data, o.video_dst_data);
+        std::swap(video_dst_linesize, o.video_dst_linesize);
+        std::swap(video_dst_bufsize, o.video_dst_bufsize);
+        std::swap(video_stream_idx, o.video_stream_idx);
+        std::swap(audio_stream_idx, o.audio_stream_idx);
+        std::swap(frame, o.frame);
+        std::swap(pkt, o.pkt);
+        std::swap(video_frame_count, o.video_frame_count);
+        std::swap(audio_frame_count, o.audio_frame_count);
+        video_writer.swap(o.video_writer);
+        audio_block_writer.swap(o.audio_block_writer);
+        audio_writer.swap(o.audio_writer);
+        scalers.swap(o.scalers);
+        video_filter.swap(o.video_filter);
+        audio_filter.swap(o.audio_filter);
+        video_index.swap(o.video_index);
+        std::swap(video_dst_offset, o.video_dst_offset);
+        std::swap(scaled_w, o.scaled_w);
+        std::swap(scaled_h, o.scaled_h);
+        std::swap(scaled_fmt, o.scaled_fmt);
+        std::swap(frame_select, o.frame_select);
+        std::swap(decoded_frames, o.decoded_frames);
+        std::swap(next_selected, o.next_selected);
+        std::swap(range_start, o.range_start);
+        std::swap(range_end, o.range_end);
+        std::swap(max_video_frames, o.max_video_frames);
+        video_done = o.video_done.exchange(video_done);
+        audio_done = o.audio_done.exchange(audio_done);
+    }
+};
+
+/* When set, output_video_frame() hands the decoder's planes straight to
+ * writev() instead of packing them into video_dst_data first. Only applies
+ * to stdio output; a BlockWriter has to copy into its buffers anyway. */
+static bool video_zero_copy = false;
+
+/* Part of the input decode_to_raw() decodes. start and end are in
+ * AV_TIME_BASE units from the start of the input, AV_NOPTS_VALUE leaves
+ * that side open; max_frames >= 0 also stops after that many video frames
+ * have been written. Decoding stops as soon as every stream is past the
+ * end, instead of running to the end of the file. */
+struct DecodeRange {
+    int64_t start = AV_NOPTS_VALUE;
+    int64_t end = AV_NOPTS_VALUE;
+    int64_t max_frames = -1;
+};
+
+static int writev_all(int fd, struct iovec *iov, int iovcnt)
+{
+    while (iovcnt > 0) {
+        ssize_t n = writev(fd, iov, FFMIN(iovcnt, IOV_MAX));
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return AVERROR(errno);
+        }
+        /* skip what was written, a short write may end inside an iovec */
+        while (iovcnt > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            ++iov;
+            --iovcnt;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (uint8_t *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return 0;
+}
+
+/* Write the visible part of every plane of frame without copying it.
+ * A plane whose linesize equals its byte width is one contiguous iovec,
+ * otherwise each row gets its own. Paletted formats are not handled. */
+static int write_video_frame_planes(int fd, const AVFrame *frame)
+{
+    const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(AVPixelFormat(frame->format));
+    static thread_local std::vector<struct iovec> iov;
+    int nb_planes = av_pix_fmt_count_planes(AVPixelFormat(frame->format));
+
+    if (!desc || nb_planes < 0 || (desc->flags & AV_PIX_FMT_FLAG_PAL))
+        return AVERROR(EINVAL);
+
+    iov.clear();
+    for (int plane = 0; plane < nb_planes; plane++) {
+        int bytewidth = av_image_get_linesize(AVPixelFormat(frame->format), frame->width, plane);
+        int h = frame->height;
+        if (plane == 1 || plane == 2)
+            h = AV_CEIL_RSHIFT(h, desc->log2_chroma_h);
+        if (bytewidth < 0)
+            return bytewidth;
+
+        if (frame->linesize[plane] == bytewidth) {
+            iov.push_back({ frame->data[plane], (size_t)bytewidth * h });
+            continue;
+        }
+        for (int y = 0; y < h; y++)
+            iov.push_back({ frame->data[plane] + (ptrdiff_t)y * frame->linesize[plane],
+                            (size_t)bytewidth });
+    }
+
+    return writev_all(fd, iov.data(), iov.size());
+}
+
+/* Same layout as write_video_frame_planes(), but copied straight into the
+ * writer's buffers, which replaces the av_image_copy into video_dst_data. */
+static int write_video_frame_rows(BlockWriter *writer, const AVFrame *frame)
+{
+    const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(AVPixelFormat(frame->format));
+    int nb_planes = av_pix_fmt_count_planes(AVPixelFormat(frame->format));
+    int ret;
+
+    if (!desc || nb_planes < 0 || (desc->flags & AV_PIX_FMT_FLAG_PAL))
+        return AVERROR(EINVAL);
+
+    for (int plane = 0; plane < nb_planes; plane++) {
+        int bytewidth = av_image_get_linesize(AVPixelFormat(frame->format), frame->width, plane);
+        int h = frame->height;
+        if (plane == 1 || plane == 2)
+            h = AV_CEIL_RSHIFT(h, desc->log2_chroma_h);
+        if (bytewidth < 0)
+            return bytewidth;
+
+        if (frame->linesize[plane] == bytewidth) {
+            if ((ret = writer->write(frame->data[plane], (size_t)bytewidth * h)) < 0)
+                return ret;
+            continue;
+        }
+        for (int y = 0; y < h; y++)
+            if ((ret = writer->write(frame->data[plane] + (ptrdiff_t)y * frame->linesize[plane],
+                                     bytewidth)) < 0)
+                return ret;
+    }
+    return 0;
+}
+
+static int alloc_video_dst(DecodeSession *s, int w, int h, enum AVPixelFormat fmt)
+{
+    int ret = av_image_alloc(s->video_dst_data, s->video_dst_linesize, w, h, fmt, 1);
+    if (ret < 0) {
+        fprintf(stderr, "Could not allocate raw video buffer\n");
+        return ret;
+    }
+    s->width = w;
+    s->height = h;
+    s->pix_fmt = fmt;
+    s->video_dst_bufsize = ret;
+    return 0;
+}
+
+/* Output geometry for a stream starting with w x h fmt frames. */
+static int alloc_raw_video_dst(DecodeSession *s, int w, int h, enum AVPixelFormat fmt)
+{
+    return alloc_video_dst(s, raw_video_cfg.width ? raw_video_cfg.width : w,
+                           raw_video_cfg.height ? raw_video_cfg.height : h,
+                           raw_video_cfg.pix_fmt != AV_PIX_FMT_NONE ? raw_video_cfg.pix_fmt : fmt);
+}
+
+static int write_video_dst_frame(DecodeSession *s, AVFrame *frame);
+
+static int write_raw_video_frame(DecodeSession *s, AVFrame *frame)
+{
+    int ret;
+
+    /* with hwaccel the software format is only known once the first
+     * surface has been downloaded */
+    if (s->pix_fmt == AV_PIX_FMT_NONE &&
+        (ret = alloc_raw_video_dst(s, frame->width, frame->height, AVPixelFormat(frame->format))) < 0)
+        return ret;
+
+    if (frame->width == s->width && frame->height == s->height && frame->format == s->pix_fmt)
+        return write_video_dst_frame(s, frame);
+
+    /* a rawvideo file has a single geometry, scale everything else to it */
+    if (frame->width != s->scaled_w || frame->height != s->scaled_h || frame->format != s->scaled_fmt) {
+        fprintf(stderr, "Scaling %dx%d %s input to the %dx%d %s output\n",
+                frame->width, frame->height, av_get_pix_fmt_name(AVPixelFormat(frame->format)),
+                s->width, s->height, av_get_pix_fmt_name(s->pix_fmt));
+        s->scaled_w = frame->width;
+        s->scaled_h = frame->height;
+        s->scaled_fmt = frame->format;
+    }
+
+    AVFrame *scaled = frame_pool.acquire();
+    if (!scaled)
+        return AVERROR(ENOMEM);
+    scaled->width = s->width;
+    scaled->height = s->height;
+    scaled->format = s->pix_fmt;
+    s->scalers->set_threads(raw_video_cfg.sws_threads);
+    if ((ret = s->scalers->scale(scaled, frame, raw_video_cfg.sws_flags)) >= 0)
+        ret = write_video_dst_frame(s, scaled);
+    frame_pool.release(scaled);
+    return ret;
+}
+
+/* Record the frame just written in the dump's index, which is opened on
+ * the first one. An index that fails is dropped and the dump carries on
+ * without it. */
+static void index_video_dst_frame(DecodeSession *s, const AVFrame *frame)
+{
+    RawIndexWriter *idx = s->video_index.get();
+    bool filtered = s->video_filter->configured();
+
+    if (!raw_index_cfg.enabled)
+        return;
+    if (!s->video_dst_offset) {
+        AVRational tb = filtered ? av_buffersink_get_time_base(s->video_filter->sink())
+                                 : s->video_stream->time_base;
+        AVRational rate = filtered ? av_buffersink_get_frame_rate(s->video_filter->sink())
+                                   : s->video_stream->avg_frame_rate;
+        if (idx->open(s->video_dst_filename.c_str(), s->width, s->height, s->pix_fmt,
+                      tb, rate, s->video_dst_bufsize) < 0)
+            fprintf(stderr, "Could not open frame index %s\n",
+                    raw_index_path(s->video_dst_filename.c_str()).c_str());
+    }
+    if (idx->is_open()) {
+        RawIndexRecord rec;
+        /* filters set pts and leave the decoder's timestamps behind */
+        rec.pts = filtered || frame->best_effort_timestamp == AV_NOPTS_VALUE ?
+                  frame->pts : frame->best_effort_timestamp;
+        rec.duration = frame->duration;
+        rec.offset = s->video_dst_offset;
+        rec.size = s->video_dst_bufsize;
+#if LIBAVUTIL_VERSION_INT >= AV_VERSION_INT(58, 7, 100)
+        rec.flags = (frame->flags & AV_FRAME_FLAG_KEY ? RAW_INDEX_KEY : 0) |
+                    (frame->flags & AV_FRAME_FLAG_INTERLACED ? RAW_INDEX_INTERLACED : 0) |
+                    (frame->flags & AV_FRAME_FLAG_TOP_FIELD_FIRST ? RAW_INDEX_TOP_FIELD_FIRST : 0);
+#else
+        rec.flags = (frame->key_frame ? RAW_INDEX_KEY : 0) |
+                    (frame->interlaced_frame ? RAW_INDEX_INTERLACED : 0) |
+                    (frame->top_field_first ? RAW_INDEX_TOP_FIELD_FIRST : 0);
+#endif
+        if (idx->add(rec) < 0) {
+            fprintf(stderr, "Could not write frame index %s, dropping it\n",
+                    raw_index_path(s->video_dst_filename.c_str()).c_str());
+            idx->discard();
+        }
+    }
+    s->video_dst_offset += s->video_dst_bufsize;
+}
+
+static int write_video_dst_frame(DecodeSession *s, AVFrame *frame)
+{
+    int ret;
+
+    if (metrics_cfg.frame_log)
+        printf("video_frame n:%d coded_n:%d\n",
+               s->video_frame_count, frame->coded_picture_number);
+    s->video_frame_count++;
+
+    if (s->video_writer->is_open()) {
+        StageTimer timer(STAGE_COPY);
+        if ((ret = write_video_frame_rows(s->video_writer.get(), frame)) < 0) {
+            fprintf(stderr, "Could not write video frame to %s\n", s->video_dst_filename.c_str());
+            return ret;
+        }
+        index_video_dst_frame(s, frame);
+        return 0;
+    }
+
+    if (video_zero_copy) {
+        StageTimer timer(STAGE_WRITE);
+        if ((ret = write_video_frame_planes(fileno(s->video_dst_file), frame)) < 0) {
+            fprintf(stderr, "Could not write video frame to %s\n", s->video_dst_filename.c_str());
+            return ret;
+        }
+        index_video_dst_frame(s, frame);
+        return 0;
+    }
+
+    /* copy decoded frame to destination buffer:
+     * this is required since rawvideo expects non aligned data */
+    {
+        StageTimer timer(STAGE_COPY);
+        av_image_copy(s->video_dst_data, s->video_dst_linesize,
+                      (const uint8_t **)(frame->data), frame->linesize,
+                      s->pix_fmt, s->width, s->height);
+    }
+
+    /* write to rawvideo file */
+    {
+        StageTimer timer(STAGE_WRITE);
+        fwrite(s->video_dst_data[0], 1, s->video_dst_bufsize, s->video_dst_file);
+    }
+    index_video_dst_frame(s, frame);
+    return 0;
+}
+
+/* Frame position of frame in the stream, from its timestamp when the frame
+ * rate is known, since skipped frames never reach us. */
+static int64_t video_frame_position(DecodeSession *s, const AVFrame *frame)
+{
+    AVRational rate = s->video_stream->avg_frame_rate;
+    int64_t ts = frame->best_effort_timestamp;
+    int64_t start = s->video_stream->start_time;
+
+    if (ts == AV_NOPTS_VALUE || !rate.num || !rate.den)
+        return s->decoded_frames - 1;
+    if (start == AV_NOPTS_VALUE)
+        start = 0;
+    return av_rescale_q(ts - start, s->video_stream->time_base, av_inv_q(rate));
+}
+
+static bool select_video_frame(DecodeSession *s, const AVFrame *frame)
+{
+    s->decoded_frames++;
+    if (s->frame_select.mode != FrameSelectConfig::EVERY_NTH)
+        return true;
+
+    int64_t pos = video_frame_position(s, frame);
+    if (pos < s->next_selected)
+        return false;
+    s->next_selected = pos + FFMAX(s->frame_select.n, 1);
+    return true;
+}
+
+/* Packets nobody needs: non-key video packets in keyframe mode, and
+ * anything of a stream that is already past the end of its range. */
+static bool skip_packet(const DecodeSession *s, const AVPacket *pkt)
+{
+    if (pkt->stream_index == s->video_stream_idx)
+        return s->video_done || (s->frame_select.mode == FrameSelectConfig::KEYFRAMES &&
+                                 !(pkt->flags & AV_PKT_FLAG_KEY));
+    return pkt->stream_index == s->audio_stream_idx && s->audio_done;
+}
+
+static int64_t frame_time(const AVFrame *frame, const AVStream *st)
+{
+    int64_t ts = frame->best_effort_timestamp;
+    return ts == AV_NOPTS_VALUE ? ts : av_rescale_q(ts, st->time_base, AV_TIME_BASE_Q);
+}
+
+/* Whether frame of st lies in the session's decode range; raises done once
+ * the stream has gone past its end. Frames without timestamps pass. */
+static bool frame_in_range(DecodeSession *s, const AVFrame *frame, const AVStream *st,
+                           std::atomic<bool> *done)
+{
+    int64_t t = frame_time(frame, st);
+
+    if (*done)
+        return false;
+    if (t == AV_NOPTS_VALUE)
+        return true;
+    if (s->range_end != AV_NOPTS_VALUE && t >= s->range_end) {
+        *done = true;
+        return false;
+    }
+    return s->range_start == AV_NOPTS_VALUE || t >= s->range_start;
+}
+
+/* Push frame, or NULL at the end of the stream, through the filtergraph
+ * desc of stream st and pass everything that comes out to write(AVFrame *).
+ * A change of the input format drains the graph and builds a new one. */
+template <typename Write>
+static int filter_frames(FrameFilter *filter, const AVStream *st, const char *desc,
+                         AVFrame *frame, Write write)
+{
+    AVFrame *out;
+    int ret;
+
+    if (frame && !filter->matches(frame)) {
+        if (filter->configured() && (ret = filter_frames(filter, st, desc, NULL, write)) < 0)
+            return ret;
+        if ((ret = filter->init(st->codecpar->codec_type, frame, st->time_base, desc,
+                                filter_cfg.nb_threads, filter_cfg.thread_type)) < 0)
+            return ret;
+    }
+    if (!filter->configured())
+        return 0;
+
+    if ((ret = filter->push(frame)) < 0) {
+        fprintf(stderr, "Error feeding the filtergraph\n");
+        return ret;
+    }
+    if (!(out = frame_pool.acquire()))
+        return AVERROR(ENOMEM);
+    while ((ret = filter->pull(out)) >= 0) {
+        ret = write(out);
+        av_frame_unref(out);
+        if (ret < 0)
+            break;
+    }
+    frame_pool.release(out);
+    return ret == AVERROR(EAGAIN) || ret == AVERROR_EOF ? 0 : ret;
+}
+
+static int write_video_output(DecodeSession *s, AVFrame *frame)
+{
+    int ret;
+
+    if (!frame->hw_frames_ctx) {
+        ret = write_raw_video_frame(s, frame);
+    } else {
+        /* the raw writer needs the pixels in system memory */
+        AVFrame *sw_frame = frame_pool.acquire();
+        if (!sw_frame)
+            return AVERROR(ENOMEM);
+        if ((ret = av_hwframe_transfer_data(sw_frame, frame, 0)) < 0 ||
+            (ret = av_frame_copy_props(sw_frame, frame)) < 0) {
+            fprintf(stderr, "Error transferring the frame to system memory\n");
+            frame_pool.release(sw_frame);
+            return ret;
+        }
+        ret = write_raw_video_frame(s, sw_frame);
+        frame_pool.release(sw_frame);
+    }
+    return ret;
+}
+
+/* End the video at t (AV_TIME_BASE) and the audio with it, or right away
+ * when t is unknown. */
+static void end_video_output(DecodeSession *s, int64_t t)
+{
+    s->video_done = true;
+    if (t == AV_NOPTS_VALUE)
+        s->audio_done = true;
+    else if (s->range_end == AV_NOPTS_VALUE || t < s->range_end)
+        s->range_end = t;
+}
+
+/* write_video_output() up to max_video_frames, checked before every frame
+ * written since a filtergraph may turn one decoded frame into several. The
+ * audio runs up to the end of the last video frame written. */
+static int write_limited_video_output(DecodeSession *s, AVFrame *frame)
+{
+    bool filtered = s->video_filter->configured();
+    AVRational tb = filtered ? av_buffersink_get_time_base(s->video_filter->sink())
+                             : s->video_stream->time_base;
+    int64_t ts = filtered ? frame->pts : frame->best_effort_timestamp;
+    int64_t t = ts == AV_NOPTS_VALUE ? ts : av_rescale_q(ts, tb, AV_TIME_BASE_Q);
+    int ret;
+
+    if (s->max_video_frames < 0)
+        return write_video_output(s, frame);
+    if (s->video_frame_count >= s->max_video_frames) {
+        /* only with a limit of 0, otherwise the last write ended it */
+        if (!s->video_done)
+            end_video_output(s, t);
+        return 0;
+    }
+    if ((ret = write_video_output(s, frame)) >= 0 && s->video_frame_count >= s->max_video_frames)
+        end_video_output(s, t == AV_NOPTS_VALUE ? t : t + av_rescale_q(frame->duration, tb, AV_TIME_BASE_Q));
+    return ret;
+}
+
+static int output_video_frame(DecodeSession *s, AVFrame *frame)
+{
+    if (!frame_in_range(s, frame, s->video_stream, &s->video_done) ||
+        !select_video_frame(s, frame))
+        return 0;
+
+    if (filter_cfg.video)
+        return filter_frames(s->video_filter.get(), s->video_stream, filter_cfg.video, frame,
+                             [s](AVFrame *out) { return write_limited_video_output(s, out); });
+    return write_limited_video_output(s, frame);
+}
+
+/* Interleaving kernels for planar audio. The stereo cases, which are most
+ * of what decoders produce, get SIMD versions; everything else goes through
+ * the scalar loop. dst receives nb_samples * channels samples. */
+template <typename T>
+static void interleave_scalar(uint8_t *dst, const uint8_t *const *src,
+                              int channels, int nb_samples)
+{
+    T *d = (T *)dst;
+    for (int i = 0; i < nb_samples; i++)
+        for (int ch = 0; ch < channels; ch++)
+            *d++ = ((const T *)src[ch])[i];
+}
+
+static void interleave2_16(uint8_t *dst, const uint8_t *l8, const uint8_t *r8, int n)
+{
+    const int16_t *l = (const int16_t *)l8, *r = (const int16_t *)r8;
+    int16_t *d = (int16_t *)dst;
+    int i = 0;
+#if defined(__AVX2__)
+    for (; i + 16 <= n; i += 16) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(l + i));
+        __m256i b = _mm256_loadu_si256((const __m256i *)(r + i));
+        __m256i lo = _mm256_unpacklo_epi16(a, b);
+        __m256i hi = _mm256_unpackhi_epi16(a, b);
+        _mm256_storeu_si256((__m256i *)(d + 2 * i),      _mm256_permute2x128_si256(lo, hi, 0x20));
+        _mm256_storeu_si256((__m256i *)(d + 2 * i + 16), _mm256_permute2x128_si256(lo, hi, 0x31));
+    }
+#elif defined(__SSE2__)
+    for (; i + 8 <= n; i += 8) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(l + i));
+        __m128i b = _mm_loadu_si128((const __m128i *)(r + i));
+        _mm_storeu_si128((__m128i *)(d + 2 * i),     _mm_unpacklo_epi16(a, b));
+        _mm_storeu_si128((__m128i *)(d + 2 * i + 8), _mm_unpackhi_epi16(a, b));
+    }
+#elif defined(__ARM_NEON)
+    for (; i + 8 <= n; i += 8) {
+        int16x8x2_t v = { { vld1q_s16(l + i), vld1q_s16(r + i) } };
+        vst2q_s16(d + 2 * i, v);
+    }
+#endif
+    for (; i < n; i++) {
+        d[2 * i]     = l[i];
+        d[2 * i + 1] = r[i];
+    }
+}
+
+/* also used for fltp, only the bit pattern matters */
+static void interleave2_32(uint8_t *dst, const uint8_t *l8, const uint8_t *r8, int n)
+{
+    const int32_t *l = (const int32_t *)l8, *r = (const int32_t *)r8;
+    int32_t *d = (int32_t *)dst;
+    int i = 0;
+#if defined(__AVX2__)
+    for (; i + 8 <= n; i += 8) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(l + i));
+        __m256i b = _mm256_loadu_si256((const __m256i *)(r + i));
+        __m256i lo = _mm256_unpacklo_epi32(a, b);
+        __m256i hi = _mm256_unpackhi_epi32(a, b);
+        _mm256_storeu_si256((__m256i *)(d + 2 * i),     _mm256_permute2x128_si256(lo, hi, 0x20));
+        _mm256_storeu_si256((__m256i *)(d + 2 * i + 8), _mm256_permute2x128_si256(lo, hi, 0x31));
+    }
+#elif defined(__SSE2__)
+    for (; i + 4 <= n; i += 4) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(l + i));
+        __m128i b = _mm_loadu_si128((const __m128i *)(r + i));
+        _mm_storeu_si128((__m128i *)(d + 2 * i),     _mm_unpacklo_epi32(a, b));
+        _mm_storeu_si128((__m128i *)(d + 2 * i + 4), _mm_unpackhi_epi32(a, b));
+    }
+#elif defined(__ARM_NEON)
+    for (; i + 4 <= n; i += 4) {
+        int32x4x2_t v = { { vld1q_s32(l + i), vld1q_s32(r + i) } };
+        vst2q_s32(d + 2 * i, v);
+    }
+#endif
+    for (; i < n; i++) {
+        d[2 * i]     = l[i];
+        d[2 * i + 1] = r[i];
+    }
+}
+
+static void interleave_planes(uint8_t *dst, const uint8_t *const *src,
+                              int channels, int nb_samples, int bps)
+{
+    if (channels == 2 && bps == 2)
+        return interleave2_16(dst, src[0], src[1], nb_samples);
+    if (channels == 2 && bps == 4)
+        return interleave2_32(dst, src[0], src[1], nb_samples);
+
+    switch (bps) {
+    case 1: interleave_scalar<uint8_t>(dst, src, channels, nb_samples); break;
+    case 2: interleave_scalar<uint16_t>(dst, src, channels, nb_samples); break;
+    case 4: interleave_scalar<uint32_t>(dst, src, channels, nb_samples); break;
+    case 8: interleave_scalar<uint64_t>(dst, src, channels, nb_samples); break;
+    }
+}
+
+struct AudioWriterConfig {
+    /* convert through libswresample instead of the interleaving kernels */
+    bool use_swresample = false;
+    /* bytes of packed samples collected before each fwrite */
+    size_t batch_size = 1 << 20;
+};
+static AudioWriterConfig audio_writer_cfg;
+
+/* Writes decoded audio as packed samples of the decoder's sample format,
+ * all channels, in batch_size blocks. */
+class PackedAudioWriter {
+public:
+    PackedAudioWriter() = default;
+    PackedAudioWriter(const PackedAudioWriter &) = delete;
+    PackedAudioWriter &operator=(const PackedAudioWriter &) = delete;
+    ~PackedAudioWriter() { close(); }
+
+    void open(FILE *out, const AudioWriterConfig &cfg)
+    {
+        open(out, NULL, cfg);
+    }
+
+    void open(BlockWriter *sink, const AudioWriterConfig &cfg)
+    {
+        open(NULL, sink, cfg);
+    }
+
+    void open(FILE *out, BlockWriter *sink, const AudioWriterConfig &cfg)
+    {
+        out_ = out;
+        sink_ = sink;
+        cfg_ = cfg;
+        batch_.resize(cfg.batch_size);
+        used_ = 0;
+    }
+
+    int write(const AVFrame *frame)
+    {
+        enum AVSampleFormat fmt = AVSampleFormat(frame->format);
+        int channels = frame->ch_layout.nb_channels;
+        int bps = av_get_bytes_per_sample(fmt);
+        size_t size = (size_t)frame->nb_samples * channels * bps;
+        uint8_t *dst;
+        int ret;
+
+        if ((ret = reserve(size, &dst)) < 0)
+            return ret;
+
+        StageTimer timer(STAGE_COPY);
+        if (!av_sample_fmt_is_planar(fmt) || channels == 1) {
+            memcpy(dst, frame->extended_data[0], size);
+        } else if (cfg_.use_swresample) {
+            if ((ret = setup_swr(frame)) < 0)
+                return ret;
+            ret = swr_convert(swr_, &dst, frame->nb_samples,
+                              (const uint8_t **)frame->extended_data, frame->nb_samples);
+            if (ret < 0)
+                return ret;
+            size = (size_t)ret * channels * bps;
+        } else {
+            interleave_planes(dst, frame->extended_data, channels, frame->nb_samples, bps);
+        }
+        used_ += size;
+        return 0;
+    }
+
+    int flush()
+    {
+        StageTimer timer(STAGE_WRITE);
+        int ret = 0;
+        if (used_ && sink_)
+            ret = sink_->write(batch_.data(), used_);
+        else if (used_ && fwrite(batch_.data(), 1, used_, out_) != used_)
+            ret = AVERROR(errno);
+        used_ = 0;
+        return ret;
+    }
+
+    void close()
+    {
+        if (out_ || sink_)
+            flush();
+        out_ = NULL;
+        sink_ = NULL;
+        swr_free(&swr_);
+        av_channel_layout_uninit(&swr_layout_);
+    }
+
+private:
+    int reserve(size_t size, uint8_t **dst)
+    {
+        int ret;
+        if (used_ + size > batch_.size() && (ret = flush()) < 0)
+            return ret;
+        /* a single frame larger than the batch, grow rather than split it */
+        if (size > batch_.size())
+            batch_.resize(size);
+        *dst = batch_.data() + used_;
+        return 0;
+    }
+
+    /* same rate and layout, planar to packed only; no delay is introduced */
+    int setup_swr(const AVFrame *frame)
+    {
+        if (swr_ && frame->format == swr_fmt_ && frame->sample_rate == swr_rate_ &&
+            !av_channel_layout_compare(&frame->ch_layout, &swr_layout_))
+            return 0;
+
+        enum AVSampleFormat fmt = AVSampleFormat(frame->format);
+        int ret;
+        swr_free(&swr_);
+        av_channel_layout_uninit(&swr_layout_);
+        if ((ret = swr_alloc_set_opts2(&swr_, &frame->ch_layout, av_get_packed_sample_fmt(fmt),
+                                       frame->sample_rate, &frame->ch_layout, fmt,
+                                       frame->sample_rate, 0, NULL)) < 0 ||
+            (ret = swr_init(swr_)) < 0) {
+            fprintf(stderr, "Failed to set up the audio converter\n");
+            swr_free(&swr_);
+            return ret;
+        }
+        swr_fmt_ = frame->format;
+        swr_rate_ = frame->sample_rate;
+        return av_channel_layout_copy(&swr_layout_, &frame->ch_layout);
+    }
+
+    FILE *out_ = NULL;
+    BlockWriter *sink_ = NULL;
+    AudioWriterConfig cfg_;
+    std::vector<uint8_t> batch_;
+    size_t used_ = 0;
+    SwrContext *swr_ = NULL;
+    AVChannelLayout swr_layout_{};
+    int swr_fmt_ = AV_SAMPLE_FMT_NONE;
+    int swr_rate_ = 0;
+};
+
+static int write_audio_output(DecodeSession *s, AVFrame *frame)
+{
+    char buffer[AV_TS_MAX_STRING_SIZE]{0};
+    if (metrics_cfg.frame_log)
+        printf("audio_frame n:%d nb_samples:%d pts:%s\n",
+               s->audio_frame_count, frame->nb_samples,
+               av_ts_make_time_string(buffer, frame->pts, &s->audio_dec_ctx->time_base));
+    s->audio_frame_count++;
+
+    /* Planar audio, which most decoders output, is interleaved into the
+     * packed variant of the same sample format so that all channels end up
+     * in the file. */
+    int ret = s->audio_writer->write(frame);
+    if (ret < 0)
+        fprintf(stderr, "Could not write audio frame to %s\n", s->audio_dst_filename.c_str());
+    return ret;
+}
+
+static int output_audio_frame(DecodeSession *s, AVFrame *frame)
+{
+    if (!frame_in_range(s, frame, s->audio_stream, &s->audio_done))
+        return 0;
+    if (filter_cfg.audio)
+        return filter_frames(s->audio_filter.get(), s->audio_stream, filter_cfg.audio, frame,
+                             [s](AVFrame *out) { return write_audio_output(s, out); });
+    return write_audio_output(s, frame);
+}
+
+/* Write out what the filtergraphs still hold (fps, yadif and aresample
+ * all buffer a little) once decoding has finished. */
+static int flush_filters(DecodeSession *s)
+{
+    int ret = 0;
+    if (s->video_stream && filter_cfg.video)
+        ret = filter_frames(s->video_filter.get(), s->video_stream, filter_cfg.video, NULL,
+                            [s](AVFrame *out) { return write_limited_video_output(s, out); });
+    if (ret >= 0 && s->audio_stream && filter_cfg.audio)
+        ret = filter_frames(s->audio_filter.get(), s->audio_stream, filter_cfg.audio, NULL,
+                            [s](AVFrame *out) { return write_audio_output(s, out); });
+    return ret;
+}
+
+static int decode_packet(DecodeSession *s, AVCodecContext *dec, const AVPacket *pkt)
+{
+    AVFrame *frame = s->frame;
+    int ret = 0;
+
+    // submit the packet to the decoder
+    ret = timed_send_packet(dec, pkt);
+    if (ret < 0) {
+        char buffer[AV_ERROR_MAX_STRING_SIZE]{0};
+        av_make_error_string(buffer, AV_ERROR_MAX_STRING_SIZE, ret);
+        fprintf(stderr, "Error submitting a packet for decoding (%s)\n", buffer);
+        return ret;
+    }
+
+    // get all the available frames from the decoder
+    while (ret >= 0) {
+        ret = timed_receive_frame(dec, frame);
+        if (ret < 0) {
+            // those two return values are special and mean there is no output
+            // frame available, but there were no errors during decoding
+            if (ret == AVERROR_EOF || ret == AVERROR(EAGAIN))
+                return 0;
+
+            char buffer[AV_ERROR_MAX_STRING_SIZE]{0};
+            av_make_error_string(buffer, AV_ERROR_MAX_STRING_SIZE, ret);
+            fprintf(stderr, "Error during decoding (%s)\n", buffer);
+            return ret;
+        }
+
+        // write the frame data to output file
+        if (dec->codec->type == AVMEDIA_TYPE_VIDEO)
+            ret = output_video_frame(s, frame);
+        else
+            ret = output_audio_frame(s, frame);
+
+        av_frame_unref(frame);
+        if (ret < 0)
+            return ret;
+    }
+
+    return 0;
+}
+
+/* Linesize and plane alignment of the pooled buffers, enough for the
+ * widest SIMD the decoders use (AVX-512). libavcodec's own STRIDE_ALIGN
+ * is not public. */
+static const int kDecoderBufferAlign = 64;
+
+/* Per-decoder AVBufferPool backing the picture buffers, installed as
+ * get_buffer2 with the context as opaque. One pool per plane, rebuilt when
+ * the frame geometry changes; buffers of the old pools stay valid until the
+ * last frame referencing them is unreffed. */
+struct DecoderBufferPool {
+    std::mutex mutex;
+    AVBufferPool *pools[4] = { NULL };
+    size_t pool_size[4] = { 0 };
+    int linesize[4] = { 0 };
+    int width = 0, height = 0;
+    int format = AV_PIX_FMT_NONE;
+    PoolStats stats;
+
+    ~DecoderBufferPool()
+    {
+        for (int i = 0; i < 4; i++)
+            av_buffer_pool_uninit(&pools[i]);
+    }
+};
+
+static AVBufferRef *decoder_pool_alloc(void *opaque, size_t size)
+{
+    DecoderBufferPool *pool = (DecoderBufferPool *)opaque;
+    pool->stats.misses++;
+    return av_buffer_alloc(size);
+}
+
+static int decoder_pool_reconfigure(DecoderBufferPool *pool, AVCodecContext *s,
+                                    const AVFrame *frame)
+{
+    enum AVPixelFormat fmt = AVPixelFormat(frame->format);
+    int w = frame->width, h = frame->height;
+    int linesize_align[AV_NUM_DATA_POINTERS];
+    ptrdiff_t linesize[4];
+    size_t size[4];
+    int ret;
+
+    avcodec_align_dimensions2(s, &w, &h, linesize_align);
+    if ((ret = av_image_fill_linesizes(pool->linesize, fmt, w)) < 0)
+        return ret;
+    for (int i = 0; i < 4; i++) {
+        pool->linesize[i] = FFALIGN(pool->linesize[i], kDecoderBufferAlign);
+        linesize[i] = pool->linesize[i];
+    }
+    if ((ret = av_image_fill_plane_sizes(size, fmt, h, linesize)) < 0)
+        return ret;
+
+    for (int i = 0; i < 4; i++) {
+        av_buffer_pool_uninit(&pool->pools[i]);
+        pool->pool_size[i] = 0;
+        if (!size[i])
+            continue;
+        /* same slack libavcodec's default allocator leaves for SIMD overreads */
+        pool->pool_size[i] = size[i] + 16 + kDecoderBufferAlign - 1;
+        pool->pools[i] = av_buffer_pool_init2(pool->pool_size[i], pool,
+                                              decoder_pool_alloc, NULL);
+        if (!pool->pools[i])
+            return AVERROR(ENOMEM);
+    }
+    pool->width = frame->width;
+    pool->height = frame->height;
+    pool->format = frame->format;
+    return 0;
+}
+
+static int decoder_pool_get_buffer2(AVCodecContext *s, AVFrame *frame, int flags)
+{
+    DecoderBufferPool *pool = (DecoderBufferPool *)s->opaque;
+    const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(AVPixelFormat(frame->format));
+    int ret;
+
+    if (!pool || !desc || (desc->flags & (AV_PIX_FMT_FLAG_HWACCEL | AV_PIX_FMT_FLAG_PAL)))
+        return avcodec_default_get_buffer2(s, frame, flags);
+
+    std::lock_guard<std::mutex> lock(pool->mutex);
+    if (frame->width != pool->width || frame->height != pool->height ||
+        frame->format != pool->format) {
+        if ((ret = decoder_pool_reconfigure(pool, s, frame)) < 0)
+            return ret;
+    }
+
+    for (int i = 0; i < 4 && pool->pools[i]; i++) {
+        uint64_t misses = pool->stats.misses;
+        frame->buf[i] = av_buffer_pool_get(pool->pools[i]);
+        if (!frame->buf[i]) {
+            for (int j = 0; j < i; j++)
+                av_buffer_unref(&frame->buf[j]);
+            return AVERROR(ENOMEM);
+        }
+        if (misses == pool->stats.misses)
+            pool->stats.hits++;
+        frame->data[i] = (uint8_t *)FFALIGN((uintptr_t)frame->buf[i]->data, kDecoderBufferAlign);
+        frame->linesize[i] = pool->linesize[i];
+    }
+    frame->extended_data = frame->data;
+    return 0;
+}
+
+static void print_pool_stats(FILE *out, const char *name, const PoolStats &stats)
+{
+    fprintf(out, "%s pool: %llu hits, %llu misses\n", name,
+            (unsigned long long)stats.hits.load(),
+            (unsigned long long)stats.misses.load());
+}
+
+/* Frees a decoder opened by open_codec_context() together with its buffer
+ * pool, if it got one. */
+static void free_decoder_context(AVCodecContext **dec_ctx)
+{
+    if (!*dec_ctx)
+        return;
+    DecoderBufferPool *pool = (*dec_ctx)->get_buffer2 == decoder_pool_get_buffer2 ?
+                              (DecoderBufferPool *)(*dec_ctx)->opaque : NULL;
+    avcodec_free_context(dec_ctx);
+    delete pool;
+}
+
+/* Decoder tuning applied by open_codec_context() before avcodec_open2().
+ * thread_count == 0 lets libavcodec pick, unless cores_per_job() is used to
+ * size it from a core budget shared by several concurrent jobs. */
+struct DecoderConfig {
+    int thread_count = 0;
+    int thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
+    bool low_delay = false;
+    enum AVDiscard skip_loop_filter = AVDISCARD_DEFAULT;
+    enum AVDiscard skip_frame = AVDISCARD_DEFAULT;
+    /* serve video picture buffers from a DecoderBufferPool */
+    bool buffer_pool = false;
+    /* try hardware decoding of video on this device type (NULL device =
+     * the default one), silently decoding in software when unavailable */
+    enum AVHWDeviceType hw_device_type = AV_HWDEVICE_TYPE_NONE;
+    const char *hw_device = NULL;
+    /* surfaces held downstream (queued frames), on top of what the
+     * decoder itself needs */
+    int extra_hw_frames = 0;
+};
+static DecoderConfig decoder_cfg;
+
+/* Split core_budget cores (0 = all online cores) evenly between
+ * concurrent_jobs jobs, so that running many files at once does not start
+ * jobs * ncpu decoder threads. */
+static int cores_per_job(int core_budget, int concurrent_jobs)
+{
+    if (core_budget <= 0)
+        core_budget = av_cpu_count();
+    if (concurrent_jobs <= 0)
+        concurrent_jobs = 1;
+    return FFMAX(1, core_budget / concurrent_jobs);
+}
+
+static const AVCodecHWConfig *find_hw_config(const AVCodec *dec, enum AVHWDeviceType type)
+{
+    for (int i = 0;; i++) {
+        const AVCodecHWConfig *config = avcodec_get_hw_config(dec, i);
+        if (!config)
+            return NULL;
+        if ((config->methods & AV_CODEC_HW_CONFIG_METHOD_HW_DEVICE_CTX) &&
+            config->device_type == type)
+            return config;
+    }
+}
+
+/* Pick the surface format of our device if the decoder offers it, i.e. the
+ * stream profile is supported; otherwise take the first software format.
+ * libavcodec calls this again without the hardware format when the hwaccel
+ * fails to initialize, which is what makes the fallback automatic. */
+static enum AVPixelFormat get_hw_format(AVCodecContext *s, const enum AVPixelFormat *fmts)
+{
+    enum AVHWDeviceType type = ((AVHWDeviceContext *)s->hw_device_ctx->data)->type;
+    const AVCodecHWConfig *config = find_hw_config(s->codec, type);
+    const enum AVPixelFormat *p;
+
+    for (p = fmts; config && *p != AV_PIX_FMT_NONE; p++)
+        if (*p == config->pix_fmt)
+            return *p;
+
+    for (p = fmts; *p != AV_PIX_FMT_NONE; p++) {
+        const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(*p);
+        if (desc && !(desc->flags & AV_PIX_FMT_FLAG_HWACCEL)) {
+            fprintf(stderr, "%s hwaccel cannot decode this stream, "
+                    "falling back to software decoding\n", av_hwdevice_get_type_name(type));
+            return *p;
+        }
+    }
+    return AV_PIX_FMT_NONE;
+}
+
+static int setup_hw_decoder(AVCodecContext *dec_ctx, const AVCodec *dec,
+                            const DecoderConfig *cfg)
+{
+    const char *name = av_hwdevice_get_type_name(cfg->hw_device_type);
+    int ret;
+
+    if (!find_hw_config(dec, cfg->hw_device_type)) {
+        fprintf(stderr, "Decoder %s does not support %s, using software decoding\n",
+                dec->name, name);
+        return AVERROR(ENOSYS);
+    }
+    if ((ret = av_hwdevice_ctx_create(&dec_ctx->hw_device_ctx, cfg->hw_device_type,
+                                      cfg->hw_device, NULL, 0)) < 0) {
+        fprintf(stderr, "Failed to create %s device, using software decoding\n", name);
+        return ret;
+    }
+    dec_ctx->get_format = get_hw_format;
+    dec_ctx->extra_hw_frames = cfg->extra_hw_frames;
+    return 0;
+}
+
+/* Which path a decoder actually took; only meaningful once it has output
+ * a frame, since the hwaccel can still be refused at that point. */
+static const char *decoder_path_name(const AVCodecContext *dec_ctx)
+{
+    if (dec_ctx->hw_frames_ctx)
+        return av_hwdevice_get_type_name(
+            ((AVHWDeviceContext *)dec_ctx->hw_device_ctx->data)->type);
+    return "software";
+}
+
+static void apply_decoder_config(AVCodecContext *dec_ctx, const AVCodec *dec,
+                                 const DecoderConfig *cfg)
+{
+    int thread_type = cfg->thread_type;
+
+    /* only ask for threading modes the decoder implements, otherwise
+     * libavcodec silently falls back to a single thread */
+    if (!(dec->capabilities & AV_CODEC_CAP_FRAME_THREADS))
+        thread_type &= ~FF_THREAD_FRAME;
+    if (!(dec->capabilities & AV_CODEC_CAP_SLICE_THREADS))
+        thread_type &= ~FF_THREAD_SLICE;
+
+    dec_ctx->thread_count = cfg->thread_count;
+    if (thread_type)
+        dec_ctx->thread_type = thread_type;
+
+    /* low delay disables frame threading inside libavcodec anyway */
+    if (cfg->low_delay)
+        dec_ctx->flags |= AV_CODEC_FLAG_LOW_DELAY;
+
+    dec_ctx->skip_loop_filter = cfg->skip_loop_filter;
+    dec_ctx->skip_frame = cfg->skip_frame;
+
+    if (cfg->buffer_pool && dec->type == AVMEDIA_TYPE_VIDEO &&
+        (dec->capabilities & AV_CODEC_CAP_DR1)) {
+        dec_ctx->opaque = new DecoderBufferPool;
+        dec_ctx->get_buffer2 = decoder_pool_get_buffer2;
+    }
+
+    if (cfg->hw_device_type != AV_HWDEVICE_TYPE_NONE && dec->type == AVMEDIA_TYPE_VIDEO)
+        setup_hw_decoder(dec_ctx, dec, cfg);
+}
+
+static int open_codec_context(int *stream_idx, AVCodecContext **dec_ctx, AVFormatContext *fmt_ctx, enum AVMediaType type,
+                              const DecoderConfig *cfg = &decoder_cfg)
+{
+    int ret, stream_index;
+    AVStream *st;
+    const AVCodec *dec = NULL;
+
+    ret = av_find_best_stream(fmt_ctx, type, -1, -1, NULL, 0);
+    if (ret < 0) {
+        fprintf(stderr, "Could not find %s stream in input file '%s'\n",
+                av_get_media_type_string(type), fmt_ctx->url);
+        return ret;
+    } else {
+        stream_index = ret;
+        st = fmt_ctx->streams[stream_index];
+
+        /* find decoder for the stream */
+        dec = avcodec_find_decoder(st->codecpar->codec_id);
+        if (!dec) {
+            fprintf(stderr, "Failed to find %s codec\n",
+                    av_get_media_type_string(type));
+            return AVERROR(EINVAL);
+        }
+
+        /* Allocate a codec context for the decoder */
+        *dec_ctx = avcodec_alloc_context3(dec);
+        if (!*dec_ctx) {
+            fprintf(stderr, "Failed to allocate the %s codec context\n",
+                    av_get_media_type_string(type));
+            return AVERROR(ENOMEM);
+        }
+
+        /* Copy codec parameters from input stream to output codec context */
+        if ((ret = avcodec_parameters_to_context(*dec_ctx, st->codecpar)) < 0) {
+            fprintf(stderr, "Failed to copy %s codec parameters to decoder context\n",
+                    av_get_media_type_string(type));
+            return ret;
+        }
+
+        apply_decoder_config(*dec_ctx, dec, cfg);
+
+        /* Init the decoders */
+        if ((ret = avcodec_open2(*dec_ctx, dec, NULL)) < 0) {
+            fprintf(stderr, "Failed to open %s codec\n",
+                    av_get_media_type_string(type));
+            return ret;
+        }
+        *stream_idx = stream_index;
+    }
+
+    return 0;
+}
+
+static int get_format_from_sample_fmt(const char **fmt,enum AVSampleFormat sample_fmt)
+{
+    int i;
+    struct sample_fmt_entry {
+        enum AVSampleFormat sample_fmt; const char *fmt_be, *fmt_le;
+    } sample_fmt_entries[] = {
+        { AV_SAMPLE_FMT_U8,  "u8",    "u8"    },
+        { AV_SAMPLE_FMT_S16, "s16be", "s16le" },
+        { AV_SAMPLE_FMT_S32, "s32be", "s32le" },
+        { AV_SAMPLE_FMT_FLT, "f32be", "f32le" },
+        { AV_SAMPLE_FMT_DBL, "f64be", "f64le" },
+    };
+    *fmt = NULL;
+
+    for (i = 0; i < FF_ARRAY_ELEMS(sample_fmt_entries); i++) {
+        struct sample_fmt_entry *entry = &sample_fmt_entries[i];
+        if (sample_fmt == entry->sample_fmt) {
+            *fmt = AV_NE(entry->fmt_be, entry->fmt_le);
+            return 0;
+        }
+    }
+
+    fprintf(stderr,
+            "sample format %s is not supported as output format\n",
+            av_get_sample_fmt_name(sample_fmt));
+    return -1;
+}
+
+/* Bounded single-producer/single-consumer ring used to link the stages of the
+ * decode pipeline. push() waits while the ring is full, which is what gives
+ * the pipeline its backpressure: a slow writer stalls the decoder, and a slow
+ * decoder stalls the demuxer, instead of letting packets pile up. */
+template <typename T>
+class SpscQueue {
+public:
+    explicit SpscQueue(size_t capacity)
+    {
+        size_t n = 2;
+        while (n < capacity)
+            n <<= 1;
+        slots_.resize(n);
+        mask_ = n - 1;
+    }
+
+    bool try_push(T v)
+    {
+        size_t tail = tail_.load(std::memory_order_relaxed);
+        if (tail - head_.load(std::memory_order_acquire) > mask_)
+            return false;
+        slots_[tail & mask_] = v;
+        tail_.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool try_pop(T &v)
+    {
+        size_t head = head_.load(std::memory_order_relaxed);
+        if (head == tail_.load(std::memory_order_acquire))
+            return false;
+        v = slots_[head & mask_];
+        head_.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+    /* Both return false only if abort was raised while waiting. */
+    bool push(T v, const std::atomic<bool> &abort)
+    {
+        for (unsigned spins = 0; !try_push(v); ++spins) {
+            if (abort.load(std::memory_order_relaxed))
+                return false;
+            backoff(spins);
+        }
+        return true;
+    }
+
+    bool pop(T &v, const std::atomic<bool> &abort)
+    {
+        for (unsigned spins = 0; !try_pop(v); ++spins) {
+            if (abort.load(std::memory_order_relaxed))
+                return false;
+            backoff(spins);
+        }
+        return true;
+    }
+
+    static void backoff(unsigned spins)
+    {
+        if (spins < 64)
+            std::this_thread::yield();
+        else
+            std::this_thread::sleep_for(std::chrono::microseconds(100));
+    }
+
+private:
+    std::vector<T> slots_;
+    size_t mask_;
+    alignas(64) std::atomic<size_t> head_{0};
+    alignas(64) std::atomic<size_t> tail_{0};
+};
+
+/* Publishes every decoded frame once to several consumers, each reading at
+ * its own pace from one shared ring of frame references. Nothing is
+ * copied: the ring holds a reference per slot and consumers take their
+ * own with av_frame_ref(). A consumer falling a whole ring behind is
+ * handled by its own policy: BLOCK stalls the producer (encoders, complete
+ * raw dumps), DROP skips the frames it missed, and COALESCE always jumps
+ * to the newest frame (previews, thumbnails). Only BLOCK consumers ever
+ * slow the producer down.
+ *
+ * A slot is guarded by its sequence number and a reader count. A reader
+ * registers before checking the sequence; the producer invalidates the
+ * sequence before checking the readers, and only waits out a reader that
+ * is inside av_frame_ref(). */
+class FrameFanout {
+public:
+    enum Policy { BLOCK, DROP, COALESCE };
+
+    explicit FrameFanout(size_t capacity)
+    {
+        size_t n = 2;
+        while (n < capacity)
+            n <<= 1;
+        slots_.reset(new Slot[n]);
+        mask_ = n - 1;
+        for (size_t i = 0; i < n; i++)
+            slots_[i].frame = av_frame_alloc();
+    }
+    FrameFanout(const FrameFanout &) = delete;
+    FrameFanout &operator=(const FrameFanout &) = delete;
+
+    ~FrameFanout()
+    {
+        for (size_t i = 0; i <= mask_; i++) {
+            if (slots_[i].frame)
+                memory_release(MEM_FANOUT, frame_bytes(slots_[i].frame));
+            av_frame_free(&slots_[i].frame);
+        }
+    }
+
+    /* Register a consumer before the first publish(); returns its id. */
+    int add_consumer(Policy policy)
+    {
+        consumers_.emplace_back(new Consumer);
+        consumers_.back()->policy = policy;
+        return consumers_.size() - 1;
+    }
+
+    /* frames consumer id has skipped so far under DROP or COALESCE */
+    uint64_t dropped(int id) const { return consumers_[id]->dropped.load(std::memory_order_relaxed); }
+
+    /* Fails with AVERROR_EXIT if abort was raised while a BLOCK consumer
+     * held the producer back. */
+    int publish(const AVFrame *frame, const std::atomic<bool> &abort)
+    {
+        uint64_t seq = tail_.load(std::memory_order_relaxed);
+        Slot &slot = slots_[seq & mask_];
+        int ret;
+
+        for (std::unique_ptr<Consumer> &c : consumers_) {
+            if (c->policy != BLOCK)
+                continue;
+            for (unsigned spins = 0; seq - c->cursor.load(std::memory_order_acquire) > mask_; ++spins) {
+                if (abort.load(std::memory_order_relaxed))
+                    return AVERROR_EXIT;
+                SpscQueue<AVFrame*>::backoff(spins);
+            }
+        }
+        if (!slot.frame)
+            return AVERROR(ENOMEM);
+        slot.seq.store(kInvalid);
+        for (unsigned spins = 0; slot.readers.load(); ++spins)
+            SpscQueue<AVFrame*>::backoff(spins);
+        memory_release(MEM_FANOUT, frame_bytes(slot.frame));
+        av_frame_unref(slot.frame);
+        if ((ret = av_frame_ref(slot.frame, frame)) < 0)
+            return ret;
+        memory_charge(MEM_FANOUT, frame_bytes(slot.frame));
+        slot.seq.store(seq, std::memory_order_release);
+        tail_.store(seq + 1, std::memory_order_release);
+        return 0;
+    }
+
+    /* end of stream, once everything has been published */
+    void close() { closed_.store(true, std::memory_order_release); }
+
+    /* Store a new reference to the next frame for consumer id in dst.
+     * Fails with AVERROR_EOF at the end of the stream and AVERROR_EXIT
+     * when abort is raised. */
+    int next(int id, AVFrame *dst, const std::atomic<bool> &abort)
+    {
+        Consumer &c = *consumers_[id];
+        uint64_t cursor = c.cursor.load(std::memory_order_relaxed);
+
+        for (unsigned spins = 0;; ++spins) {
+            uint64_t tail = tail_.load(std::memory_order_acquire);
+            if (cursor == tail) {
+                if (closed_.load(std::memory_order_acquire) &&
+                    tail_.load(std::memory_order_acquire) == cursor)
+                    return AVERROR_EOF;
+                if (abort.load(std::memory_order_relaxed))
+                    return AVERROR_EXIT;
+                SpscQueue<AVFrame*>::backoff(spins);
+                continue;
+            }
+
+            uint64_t seq = cursor;
+            if (c.policy == COALESCE)
+                seq = tail - 1;
+            else if (c.policy == DROP && tail - cursor > mask_)
+                seq = tail - mask_;  /* lapped, oldest slot not being rewritten */
+
+            int ret = take(seq, dst);
+            if (ret < 0)
+                return ret;
+            if (!ret)
+                continue;  /* overwritten meanwhile, look at the new tail */
+            if (seq != cursor)
+                c.dropped.fetch_add(seq - cursor, std::memory_order_relaxed);
+            c.cursor.store(seq + 1, std::memory_order_release);
+            return 0;
+        }
+    }
+
+private:
+    static const uint64_t kInvalid = UINT64_MAX;
+
+    struct Slot {
+        AVFrame *frame = NULL;
+        std::atomic<uint64_t> seq{kInvalid};
+        std::atomic<int> readers{0};
+    };
+
+    struct Consumer {
+        alignas(64) std::atomic<uint64_t> cursor{0};
+        std::atomic<uint64_t> dropped{0};
+        Policy policy = BLOCK;
+    };
+
+    /* 1 with a new reference in dst, 0 if the slot no longer holds seq */
+    int take(uint64_t seq, AVFrame *dst)
+    {
+        Slot &slot = slots_[seq & mask_];
+        int ret = 0;
+
+        slot.readers.fetch_add(1);
+        if (slot.seq.load() == seq)
+            ret = av_frame_ref(dst, slot.frame) < 0 ? AVERROR(ENOMEM) : 1;
+        slot.readers.fetch_sub(1, std::memory_order_release);
+        return ret;
+    }
+
+    std::unique_ptr<Slot[]> slots_;
+    size_t mask_;
+    std::vector<std::unique_ptr<Consumer>> consumers_;
+    alignas(64) std::atomic<uint64_t> tail_{0};
+    std::atomic<bool> closed_{false};
+};
+
+/* Queue depths for the threaded decode path. A NULL entry in either queue
+ * marks end of stream. */
+struct PipelineConfig {
+    bool enabled = false;
+    size_t packet_queue_size = 64;
+    size_t frame_queue_size = 8;
+};
+static PipelineConfig decode_pipeline_cfg;
+
+struct DecodeStage {
+    AVCodecContext *dec = nullptr;
+    SpscQueue<AVPacket*> packets;
+    SpscQueue<AVFrame*> frames;
+    bool done = false;
+
+    DecodeStage(AVCodecContext *dec, const PipelineConfig &cfg)
+        : dec(dec), packets(cfg.packet_queue_size), frames(cfg.frame_queue_size) {}
+};
+
+static int decode_stage_send(DecodeStage *stage, const AVPacket *pkt,
+                             std::atomic<bool> &abort)
+{
+    int ret = timed_send_packet(stage->dec, pkt);
+    if (ret < 0) {
+        char buffer[AV_ERROR_MAX_STRING_SIZE]{0};
+        av_make_error_string(buffer, AV_ERROR_MAX_STRING_SIZE, ret);
+        fprintf(stderr, "Error submitting a packet for decoding (%s)\n", buffer);
+        return ret;
+    }
+
+    for (;;) {
+        AVFrame *out = frame_pool.acquire();
+        if (!out)
+            return AVERROR(ENOMEM);
+        memory_throttle(1u << MEM_FRAME_QUEUE, abort);
+        ret = timed_receive_frame(stage->dec, out);
+        if (ret < 0) {
+            frame_pool.release(out);
+            if (ret == AVERROR_EOF || ret == AVERROR(EAGAIN))
+                return 0;
+
+            char buffer[AV_ERROR_MAX_STRING_SIZE]{0};
+            av_make_error_string(buffer, AV_ERROR_MAX_STRING_SIZE, ret);
+            fprintf(stderr, "Error during decoding (%s)\n", buffer);
+            return ret;
+        }
+        int64_t bytes = frame_bytes(out);
+        memory_charge(MEM_FRAME_QUEUE, bytes);
+        if (!stage->frames.push(out, abort)) {
+            memory_release(MEM_FRAME_QUEUE, bytes);
+            frame_pool.release(out);
+            return AVERROR_EXIT;
+        }
+    }
+}
+
+static void decode_stage_run(DecodeStage *stage, std::atomic<bool> &abort)
+{
+    AVPacket *pkt;
+    int ret = 0;
+
+    while (stage->packets.pop(pkt, abort)) {
+        /* a NULL packet flushes the decoder */
+        ret = decode_stage_send(stage, pkt, abort);
+        if (!pkt)
+            break;
+        memory_release(MEM_PACKET_QUEUE, packet_bytes(pkt));
+        packet_pool.release(pkt);
+        if (ret < 0)
+            break;
+    }
+    if (ret < 0 && ret != AVERROR_EXIT)
+        abort = true;
+
+    stage->frames.push(nullptr, abort);
+}
+
+static void writer_stage_run(DecodeSession *s, DecodeStage *video, DecodeStage *audio,
+                             std::atomic<bool> &abort)
+{
+    DecodeStage *stages[] = { video, audio };
+    int live = (video != nullptr) + (audio != nullptr);
+
+    for (unsigned spins = 0; live > 0 && !abort; ) {
+        bool progressed = false;
+        for (DecodeStage *stage : stages) {
+            AVFrame *out;
+            if (!stage || stage->done || !stage->frames.try_pop(out))
+                continue;
+            progressed = true;
+            if (!out) {
+                stage->done = true;
+                --live;
+                continue;
+            }
+            int ret = stage == video ? output_video_frame(s, out)
+                                     : output_audio_frame(s, out);
+            memory_release(MEM_FRAME_QUEUE, frame_bytes(out));
+            frame_pool.release(out);
+            if (ret < 0)
+                abort = true;
+        }
+        if (progressed)
+            spins = 0;
+        else
+            SpscQueue<AVFrame*>::backoff(spins++);
+    }
+}
+
+/* Threaded variant of the read loop in decode_to_raw(): this thread demuxes,
+ * every decoder gets its own thread and a single writer thread drains the
+ * decoded frames to the output files. */
+static int run_decode_pipeline(DecodeSession *s)
+{
+    std::atomic<bool> abort{false};
+    std::unique_ptr<DecodeStage> video, audio;
+    std::vector<std::thread> threads;
+    int ret = 0;
+
+    if (s->video_dec_ctx && s->video_stream)
+        video.reset(new DecodeStage(s->video_dec_ctx, decode_pipeline_cfg));
+    if (s->audio_dec_ctx && s->audio_stream)
+        audio.reset(new DecodeStage(s->audio_dec_ctx, decode_pipeline_cfg));
+
+    if (video)
+        threads.emplace_back(decode_stage_run, video.get(), std::ref(abort));
+    if (audio)
+        threads.emplace_back(decode_stage_run, audio.get(), std::ref(abort));
+    threads.emplace_back(writer_stage_run, s, video.get(), audio.get(), std::ref(abort));
+
+    while (!abort && !s->range_done()) {
+        AVPacket *in = packet_pool.acquire();
+        if (!in) {
+            ret = AVERROR(ENOMEM);
+            break;
+        }
+        memory_throttle((1u << MEM_PACKET_QUEUE) | (1u << MEM_FRAME_QUEUE), abort);
+        if ((ret = timed_read_frame(s->fmt_ctx, in)) < 0) {
+            packet_pool.release(in);
+            if (ret == AVERROR_EOF)
+                ret = 0;
+            break;
+        }
+
+        DecodeStage *stage = nullptr;
+        if (skip_packet(s, in))
+            ;
+        else if (video && in->stream_index == s->video_stream_idx)
+            stage = video.get();
+        else if (audio && in->stream_index == s->audio_stream_idx)
+            stage = audio.get();
+
+        if (!stage) {
+            packet_pool.release(in);
+            continue;
+        }
+        int64_t bytes = packet_bytes(in);
+        memory_charge(MEM_PACKET_QUEUE, bytes);
+        if (!stage->packets.push(in, abort)) {
+            memory_release(MEM_PACKET_QUEUE, bytes);
+            packet_pool.release(in);
+        }
+    }
+
+    /* on abort every stage unwinds by itself, no end marker needed */
+    for (DecodeStage *stage : { video.get(), audio.get() })
+        if (stage)
+            stage->packets.push(nullptr, abort);
+
+    for (std::thread &t : threads)
+        t.join();
+
+    /* release whatever was still queued when a stage bailed out */
+    for (DecodeStage *stage : { video.get(), audio.get() }) {
+        if (!stage)
+            continue;
+        AVPacket *p;
+        while (stage->packets.try_pop(p)) {
+            if (p)
+                memory_release(MEM_PACKET_QUEUE, packet_bytes(p));
+            packet_pool.release(p);
+        }
+        AVFrame *f;
+        while (stage->frames.try_pop(f)) {
+            if (f)
+                memory_release(MEM_FRAME_QUEUE, frame_bytes(f));
+            frame_pool.release(f);
+        }
+    }
+
+    if (ret >= 0 && abort)
+        ret = AVERROR_EXTERNAL;
+    return ret;
+}
+
+
+
+/* Base for inputs that feed libavformat through our own AVIOContext rather
+ * than a protocol. The context owns the object through pb->opaque;
+ * close_input() frees both. */
+class CustomIO {
+public:
+    virtual ~CustomIO() = default;
+    virtual int read(uint8_t *buf, int size) = 0;
+    /* whence as for avio seek callbacks, including AVSEEK_SIZE */
+    virtual int64_t seek(int64_t offset, int whence) = 0;
+
+    static int read_cb(void *opaque, uint8_t *buf, int size)
+    {
+        return ((CustomIO *)opaque)->read(buf, size);
+    }
+
+    static int64_t seek_cb(void *opaque, int64_t offset, int whence)
+    {
+        return ((CustomIO *)opaque)->seek(offset, whence);
+    }
+};
+
+/* Local file read straight out of a read-only mapping. The kernel is told
+ * the access is sequential, and a WILLNEED window is kept in front of the
+ * read position so page faults are resolved by readahead rather than one
+ * by one. */
+class MmapIO : public CustomIO {
+public:
+    ~MmapIO() override
+    {
+        if (data_)
+            munmap(data_, size_);
+    }
+
+    int open(const char *path, size_t window)
+    {
+        struct stat st;
+        int fd = ::open(path, O_RDONLY);
+        if (fd < 0)
+            return AVERROR(errno);
+        if (fstat(fd, &st) < 0 || st.st_size <= 0) {
+            ::close(fd);
+            return AVERROR(EINVAL);
+        }
+        size_ = st.st_size;
+        data_ = (uint8_t *)mmap(NULL, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+        if (data_ == MAP_FAILED) {
+            data_ = NULL;
+            return AVERROR(errno);
+        }
+        window_ = FFALIGN(FFMAX(window, (size_t)1 << 20), page_size());
+        madvise(data_, size_, MADV_SEQUENTIAL);
+        advise(0);
+        return 0;
+    }
+
+    int read(uint8_t *buf, int size) override
+    {
+        if (pos_ >= size_)
+            return AVERROR_EOF;
+        size_t n = FFMIN((size_t)size, size_ - pos_);
+        if (pos_ + n > advised_end_ || pos_ < advised_start_)
+            advise(pos_);
+        memcpy(buf, data_ + pos_, n);
+        pos_ += n;
+        return n;
+    }
+
+    int64_t seek(int64_t offset, int whence) override
+    {
+        int64_t pos;
+        switch (whence & ~AVSEEK_FORCE) {
+        case AVSEEK_SIZE: return size_;
+        case SEEK_SET:    pos = offset; break;
+        case SEEK_CUR:    pos = pos_ + offset; break;
+        case SEEK_END:    pos = size_ + offset; break;
+        default:          return AVERROR(EINVAL);
+        }
+        if (pos < 0)
+            return AVERROR(EINVAL);
+        pos_ = pos;
+        return pos;
+    }
+
+private:
+    static size_t page_size()
+    {
+        return sysconf(_SC_PAGESIZE);
+    }
+
+    /* start a new window at pos (rounded down to a page) */
+    void advise(size_t pos)
+    {
+        size_t start = pos & ~(page_size() - 1);
+        if (start >= size_)
+            return;
+        size_t len = FFMIN(window_, size_ - start);
+        madvise(data_ + start, len, MADV_WILLNEED);
+        advised_start_ = start;
+        advised_end_ = start + len;
+    }
+
+    uint8_t *data_ = NULL;
+    size_t size_ = 0;
+    size_t pos_ = 0;
+    size_t window_ = 0;
+    size_t advised_start_ = 0, advised_end_ = 0;
+};
+
+/* Read-ahead settings for network inputs (http, https, anything not local). */
+struct PrefetchConfig {
+    bool enabled = false;
+    size_t buffer_mb = 64;
+    size_t chunk_size = 4 << 20;
+    /* parallel range requests when the resource is seekable */
+    int connections = 4;
+};
+static PrefetchConfig prefetch_cfg;
+
+/* Network input fed from a ring of chunk buffers that background threads
+ * keep filled ahead of the demuxer. Chunk k holds bytes
+ * [k * chunk_size, (k + 1) * chunk_size) of the resource; the ring covers
+ * the chunks from the one being read onwards. For seekable resources each
+ * fetch thread holds its own connection and fetches chunks with range
+ * requests, so several chunks download at once; otherwise a single thread
+ * reads the stream sequentially. A seek outside the buffered window drops
+ * the window and restarts prefetching at the new position. */
+class PrefetchIO : public CustomIO {
+public:
+    ~PrefetchIO() override
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stop_ = true;
+        }
+        cv_.notify_all();
+        for (std::thread &t : threads_)
+            t.join();
+        avio_closep(&first_pb_);
+    }
+
+    int open(const char *url, const PrefetchConfig &cfg)
+    {
+        int ret;
+
+        url_ = url;
+        chunk_size_ = FFMAX(cfg.chunk_size, (size_t)64 << 10);
+        size_t nslots = FFMAX((cfg.buffer_mb << 20) / chunk_size_, (size_t)2);
+        slots_.resize(nslots);
+        for (Slot &s : slots_)
+            s.data.resize(chunk_size_);
+
+        if ((ret = open_connection(&first_pb_)) < 0) {
+            fprintf(stderr, "Could not open %s\n", url);
+            return ret;
+        }
+        size_ = avio_size(first_pb_);
+        seekable_ = size_ > 0 && (first_pb_->seekable & AVIO_SEEKABLE_NORMAL);
+
+        int nthreads = seekable_ ? FFMAX(cfg.connections, 1) : 1;
+        for (int i = 0; i < nthreads; i++)
+            threads_.emplace_back(&PrefetchIO::fetch_thread, this, i);
+        return 0;
+    }
+
+    int read(uint8_t *buf, int size) override
+    {
+        int64_t k = pos_ / chunk_size_;
+        std::unique_lock<std::mutex> lock(mutex_);
+
+        if (size_ > 0 && pos_ >= size_)
+            return AVERROR_EOF;
+        if (k < window_start_ || k >= window_start_ + (int64_t)slots_.size())
+            reset_window(k);
+        else if (k > window_start_) {
+            /* slots behind the reader are free for new chunks */
+            window_start_ = k;
+            cv_.notify_all();
+        }
+
+        Slot &s = slots_[k % slots_.size()];
+        cv_.wait(lock, [&] { return stop_ || (s.chunk == k && s.state >= kReady); });
+        if (stop_)
+            return AVERROR_EXIT;
+        if (s.state == kError)
+            return s.error;
+
+        size_t off = pos_ - k * chunk_size_;
+        if (off >= s.len)
+            return AVERROR_EOF;
+        size_t n = FFMIN((size_t)size, s.len - off);
+        memcpy(buf, s.data.data() + off, n);
+        pos_ += n;
+        return n;
+    }
+
+    int64_t seek(int64_t offset, int whence) override
+    {
+        int64_t pos;
+        switch (whence & ~AVSEEK_FORCE) {
+        case AVSEEK_SIZE: return size_ > 0 ? size_ : AVERROR(ENOSYS);
+        case SEEK_SET:    pos = offset; break;
+        case SEEK_CUR:    pos = pos_ + offset; break;
+        case SEEK_END:
+            if (size_ <= 0)
+                return AVERROR(ENOSYS);
+            pos = size_ + offset;
+            break;
+        default:
+            return AVERROR(EINVAL);
+        }
+        if (pos < 0)
+            return AVERROR(EINVAL);
+
+        if (!seekable_) {
+            /* only within what is still buffered */
+            std::lock_guard<std::mutex> lock(mutex_);
+            int64_t k = pos / chunk_size_;
+            Slot &s = slots_[k % slots_.size()];
+            if (k < window_start_ || s.chunk != k || s.state < kReady)
+                return AVERROR(ESPIPE);
+        }
+        pos_ = pos;
+        return pos;
+    }
+
+private:
+    enum { kEmpty, kFetching, kReady, kError };
+
+    struct Slot {
+        int64_t chunk = -1;
+        int state = kEmpty;
+        size_t len = 0;
+        int error = 0;
+        std::vector<uint8_t> data;
+    };
+
+    static int interrupt_cb(void *opaque)
+    {
+        return ((PrefetchIO *)opaque)->stop_.load();
+    }
+
+    int open_connection(AVIOContext **pb)
+    {
+        AVIOInterruptCB cb = { interrupt_cb, this };
+        AVDictionary *opts = NULL;
+        /* keep-alive, so consecutive range requests reuse the connection */
+        av_dict_set(&opts, "multiple_requests", "1", 0);
+        int ret = avio_open2(pb, url_.c_str(), AVIO_FLAG_READ, &cb, &opts);
+        av_dict_free(&opts);
+        return ret;
+    }
+
+    /* called with mutex_ held */
+    void reset_window(int64_t k)
+    {
+        generation_++;
+        window_start_ = k;
+        next_chunk_ = k;
+        for (Slot &s : slots_) {
+            s.chunk = -1;
+            /* a slot still being written stays busy until its fetch returns */
+            if (s.state != kFetching)
+                s.state = kEmpty;
+        }
+        cv_.notify_all();
+    }
+
+    bool chunk_wanted() const
+    {
+        if (next_chunk_ >= window_start_ + (int64_t)slots_.size())
+            return false;
+        if (size_ > 0 && next_chunk_ * (int64_t)chunk_size_ >= size_)
+            return false;
+        return !eof_seen_ && slots_[next_chunk_ % slots_.size()].state != kFetching;
+    }
+
+    void fetch_thread(int id)
+    {
+        AVIOContext *pb = NULL;
+        std::unique_lock<std::mutex> lock(mutex_);
+
+        for (;;) {
+            cv_.wait(lock, [this] { return stop_ || chunk_wanted(); });
+            if (stop_)
+                break;
+
+            int64_t k = next_chunk_++;
+            uint64_t generation = generation_;
+            Slot &s = slots_[k % slots_.size()];
+            s.chunk = k;
+            s.state = kFetching;
+            lock.unlock();
+
+            /* the first thread reuses the probing connection */
+            int ret = 0;
+            if (!pb) {
+                if (id == 0) {
+                    pb = first_pb_;
+                    first_pb_ = NULL;
+                } else {
+                    ret = open_connection(&pb);
+                }
+            }
+            size_t len = 0;
+            if (ret >= 0 && seekable_ && avio_tell(pb) != k * (int64_t)chunk_size_)
+                ret = avio_seek(pb, k * chunk_size_, SEEK_SET);
+            while (ret >= 0 && len < chunk_size_) {
+                int n = avio_read(pb, s.data.data() + len, chunk_size_ - len);
+                if (n == AVERROR_EOF || n == 0)
+                    break;
+                if (n < 0)
+                    ret = n;
+                else
+                    len += n;
+            }
+
+            lock.lock();
+            if (generation != generation_ || s.chunk != k) {
+                /* a seek dropped this chunk meanwhile */
+                s.state = kEmpty;
+                cv_.notify_all();
+                continue;
+            }
+            s.len = len;
+            s.error = ret;
+            s.state = ret < 0 ? kError : kReady;
+            if (!seekable_ && len < chunk_size_)
+                eof_seen_ = true;
+            cv_.notify_all();
+        }
+        lock.unlock();
+        avio_closep(&pb);
+    }
+
+    std::string url_;
+    size_t chunk_size_ = 0;
+    int64_t size_ = -1;
+    bool seekable_ = false;
+    AVIOContext *first_pb_ = NULL;
+    int64_t pos_ = 0;
+
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::vector<std::thread> threads_;
+    std::vector<Slot> slots_;
+    std::atomic<bool> stop_{false};
+    uint64_t generation_ = 0;
+    int64_t window_start_ = 0;
+    int64_t next_chunk_ = 0;
+    bool eof_seen_ = false;
+};
+
+/* How entry points open their inputs. */
+struct InputConfig {
+    /* read local files through MmapIO instead of the file protocol */
+    bool use_mmap = false;
+    size_t mmap_window = 16 << 20;
+    size_t avio_buffer_size = 256 << 10;
+    /* probing limits handed to avformat_open_input(); 0 and -1 keep the
+     * libavformat defaults */
+    int64_t probesize = 0;          /* bytes */
+    int64_t analyzeduration = 0;    /* microseconds */
+    int fpsprobesize = -1;          /* frames */
+    /* reuse find_stream_info() results across runs, see load_probe_cache() */
+    bool probe_cache = false;
+};
+static InputConfig input_cfg;
+
+static bool is_local_path(const char *path)
+{
+    return !strstr(path, "://") || !strncmp(path, "file://", 7);
+}
+
+/* avformat_open_input() reading through io, which the context takes over
+ * even on failure. */
+static int open_custom_input(AVFormatContext **ic, const char *url, CustomIO *io,
+                             size_t buffer_size, AVDictionary **opts)
+{
+    uint8_t *buffer = (uint8_t *)av_malloc(buffer_size);
+    AVIOContext *pb = NULL;
+    int ret;
+
+    if (buffer)
+        pb = avio_alloc_context(buffer, buffer_size, 0, io,
+                                CustomIO::read_cb, NULL, CustomIO::seek_cb);
+    if (!pb || !(*ic = avformat_alloc_context())) {
+        if (pb)
+            av_freep(&pb->buffer);
+        else
+            av_free(buffer);
+        avio_context_free(&pb);
+        delete io;
+        return AVERROR(ENOMEM);
+    }
+    (*ic)->pb = pb;
+    if ((ret = avformat_open_input(ic, url, NULL, opts)) < 0) {
+        /* avformat_open_input() freed the format context, not our IO */
+        av_freep(&pb->buffer);
+        avio_context_free(&pb);
+        delete io;
+    }
+    return ret;
+}
+
+/* Picks the IO layer for url: MmapIO, PrefetchIO or the protocol's own. */
+static int open_input_io(AVFormatContext **ic, const char *url, AVDictionary **opts)
+{
+    if (input_cfg.use_mmap && is_local_path(url)) {
+        const char *path = strncmp(url, "file://", 7) ? url : url + 7;
+        MmapIO *io = new MmapIO;
+        int ret = io->open(path, input_cfg.mmap_window);
+        if (ret >= 0)
+            return open_custom_input(ic, url, io, input_cfg.avio_buffer_size, opts);
+        /* pipes, empty or special files: let the file protocol have it */
+        delete io;
+    }
+    if (prefetch_cfg.enabled && !is_local_path(url)) {
+        PrefetchIO *io = new PrefetchIO;
+        int ret = io->open(url, prefetch_cfg);
+        if (ret < 0) {
+            delete io;
+            return ret;
+        }
+        return open_custom_input(ic, url, io, input_cfg.avio_buffer_size, opts);
+    }
+    return avformat_open_input(ic, url, NULL, opts);
+}
+
+/* avformat_open_input() honouring input_cfg and prefetch_cfg. Inputs opened
+ * here must be closed with close_input(). */
+static int open_input(AVFormatContext **ic, const char *url, AVDictionary **opts = NULL)
+{
+    AVDictionary *o = NULL;
+    int ret;
+
+    /* caller's options win over the configured probing limits */
+    if (opts)
+        av_dict_copy(&o, *opts, 0);
+    if (input_cfg.probesize > 0)
+        av_dict_set_int(&o, "probesize", input_cfg.probesize, AV_DICT_DONT_OVERWRITE);
+    if (input_cfg.analyzeduration > 0)
+        av_dict_set_int(&o, "analyzeduration", input_cfg.analyzeduration, AV_DICT_DONT_OVERWRITE);
+    if (input_cfg.fpsprobesize >= 0)
+        av_dict_set_int(&o, "fpsprobesize", input_cfg.fpsprobesize, AV_DICT_DONT_OVERWRITE);
+
+    ret = open_input_io(ic, url, &o);
+    if (opts) {
+        av_dict_free(opts);
+        *opts = o;
+    } else {
+        av_dict_free(&o);
+    }
+    return ret;
+}
+
+static void close_input(AVFormatContext **ic)
+{
+    if (!*ic)
+        return;
+    if (!((*ic)->flags & AVFMT_FLAG_CUSTOM_IO)) {
+        avformat_close_input(ic);
+        return;
+    }
+    AVIOContext *pb = (*ic)->pb;
+    avformat_close_input(ic);
+    if (pb) {
+        delete (CustomIO *)pb->opaque;
+        av_freep(&pb->buffer);
+        avio_context_free(&pb);
+    }
+}
+
+static int stat_file_identity(const char *path, int64_t *size, int64_t *mtime)
+{
+    struct stat st;
+    if (stat(path, &st) < 0)
+        return AVERROR(errno);
+    *size = st.st_size;
+    *mtime = st.st_mtime;
+    return 0;
+}
+
+/* Sidecar files next to inputs are written to a temporary file of their
+ * own and renamed over the old one once complete: jobs sharing an input
+ * never read half a sidecar, and two writers cannot interleave. */
+static FILE *open_sidecar_tmp(const std::string &path, std::string *tmp)
+{
+    FILE *f;
+    int fd;
+
+    *tmp = path + ".XXXXXX";
+    if ((fd = mkstemp(&(*tmp)[0])) < 0)
+        return NULL;
+    if (fchmod(fd, 0644) < 0 || !(f = fdopen(fd, "wb"))) {
+        int err = errno;
+        ::close(fd);
+        unlink(tmp->c_str());
+        errno = err;
+        return NULL;
+    }
+    return f;
+}
+
+/* Close f from open_sidecar_tmp() and move it into place as path, or drop
+ * it when ok is false. */
+static int commit_sidecar(FILE *f, const std::string &tmp, const std::string &path, bool ok)
+{
+    if (fclose(f) != 0 || !ok || rename(tmp.c_str(), path.c_str()) < 0) {
+        unlink(tmp.c_str());
+        return AVERROR(EIO);
+    }
+    return 0;
+}
+
+/* What avformat_find_stream_info() worked out for one stream. Followed in
+ * the cache file by extradata_size bytes of extradata. */
+struct ProbeStreamRecord {
+    int32_t codec_type;
+    int32_t codec_id;
+    uint32_t codec_tag;
+    int32_t format;
+    int64_t bit_rate;
+    int32_t bits_per_coded_sample;
+    int32_t bits_per_raw_sample;
+    int32_t profile;
+    int32_t level;
+    int32_t width;
+    int32_t height;
+    AVRational sample_aspect_ratio;
+    int32_t field_order;
+    int32_t color_range;
+    int32_t color_primaries;
+    int32_t color_trc;
+    int32_t color_space;
+    int32_t chroma_location;
+    int32_t video_delay;
+    int32_t sample_rate;
+    int32_t nb_channels;
+    uint64_t channel_mask;  /* 0 when the layout is not a native one */
+    int32_t frame_size;
+    int32_t block_align;
+    int32_t initial_padding;
+    AVRational avg_frame_rate;
+    AVRational r_frame_rate;
+    int64_t start_time;
+    int64_t duration;
+    int64_t nb_frames;
+    int32_t extradata_size;
+};
+
+struct ProbeHeader {
+    char magic[8];
+    int64_t file_size;
+    int64_t mtime;
+    int64_t start_time;
+    int64_t duration;
+    int64_t bit_rate;
+    uint32_t nb_streams;
+};
+
+static const char kProbeCacheMagic[8] = { 'P', 'R', 'O', 'B', 'E', '1', 0, 0 };
+
+static std::string probe_cache_path(const char *path)
+{
+    return std::string(path) + ".probe";
+}
+
+static void fill_probe_record(ProbeStreamRecord *r, const AVStream *st)
+{
+    const AVCodecParameters *par = st->codecpar;
+
+    memset(r, 0, sizeof(*r));
+    r->codec_type = par->codec_type;
+    r->codec_id = par->codec_id;
+    r->codec_tag = par->codec_tag;
+    r->format = par->format;
+    r->bit_rate = par->bit_rate;
+    r->bits_per_coded_sample = par->bits_per_coded_sample;
+    r->bits_per_raw_sample = par->bits_per_raw_sample;
+    r->profile = par->profile;
+    r->level = par->level;
+    r->width = par->width;
+    r->height = par->height;
+    r->sample_aspect_ratio = par->sample_aspect_ratio;
+    r->field_order = par->field_order;
+    r->color_range = par->color_range;
+    r->color_primaries = par->color_primaries;
+    r->color_trc = par->color_trc;
+    r->color_space = par->color_space;
+    r->chroma_location = par->chroma_location;
+    r->video_delay = par->video_delay;
+    r->sample_rate = par->sample_rate;
+    r->nb_channels = par->ch_layout.nb_channels;
+    if (par->ch_layout.order == AV_CHANNEL_ORDER_NATIVE)
+        r->channel_mask = par->ch_layout.u.mask;
+    r->frame_size = par->frame_size;
+    r->block_align = par->block_align;
+    r->initial_padding = par->initial_padding;
+    r->avg_frame_rate = st->avg_frame_rate;
+    r->r_frame_rate = st->r_frame_rate;
+    r->start_time = st->start_time;
+    r->duration = st->duration;
+    r->nb_frames = st->nb_frames;
+    r->extradata_size = par->extradata_size;
+}
+
+/* Takes ownership of extradata, allocated with padding, or NULL. */
+static void apply_probe_record(AVStream *st, const ProbeStreamRecord &r,
+                               uint8_t *extradata, int extradata_size)
+{
+    AVCodecParameters *par = st->codecpar;
+
+    par->codec_tag = r.codec_tag;
+    par->format = r.format;
+    par->bit_rate = r.bit_rate;
+    par->bits_per_coded_sample = r.bits_per_coded_sample;
+    par->bits_per_raw_sample = r.bits_per_raw_sample;
+    par->profile = r.profile;
+    par->level = r.level;
+    par->width = r.width;
+    par->height = r.height;
+    par->sample_aspect_ratio = r.sample_aspect_ratio;
+    par->field_order = (enum AVFieldOrder)r.field_order;
+    par->color_range = (enum AVColorRange)r.color_range;
+    par->color_primaries = (enum AVColorPrimaries)r.color_primaries;
+    par->color_trc = (enum AVColorTransferCharacteristic)r.color_trc;
+    par->color_space = (enum AVColorSpace)r.color_space;
+    par->chroma_location = (enum AVChromaLocation)r.chroma_location;
+    par->video_delay = r.video_delay;
+    par->sample_rate = r.sample_rate;
+    if (r.nb_channels != par->ch_layout.nb_channels ||
+        (r.channel_mask && par->ch_layout.order != AV_CHANNEL_ORDER_NATIVE)) {
+        av_channel_layout_uninit(&par->ch_layout);
+        if (r.channel_mask)
+            av_channel_layout_from_mask(&par->ch_layout, r.channel_mask);
+        else {
+            par->ch_layout.order = AV_CHANNEL_ORDER_UNSPEC;
+            par->ch_layout.nb_channels = r.nb_channels;
+        }
+    }
+    par->frame_size = r.frame_size;
+    par->block_align = r.block_align;
+    par->initial_padding = r.initial_padding;
+    st->avg_frame_rate = r.avg_frame_rate;
+    st->r_frame_rate = r.r_frame_rate;
+    st->start_time = r.start_time;
+    st->duration = r.duration;
+    st->nb_frames = r.nb_frames;
+
+    if (extradata) {
+        par->extradata = extradata;
+        par->extradata_size = extradata_size;
+    }
+}
+
+static int save_probe_cache(const char *path, const AVFormatContext *ic)
+{
+    std::string cache_path = probe_cache_path(path), tmp_path;
+    ProbeHeader hdr;
+    FILE *f;
+    bool ok;
+    int ret;
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, kProbeCacheMagic, sizeof(hdr.magic));
+    if ((ret = stat_file_identity(path, &hdr.file_size, &hdr.mtime)) < 0)
+        return ret;
+    hdr.start_time = ic->start_time;
+    hdr.duration = ic->duration;
+    hdr.bit_rate = ic->bit_rate;
+    hdr.nb_streams = ic->nb_streams;
+
+    if (!(f = open_sidecar_tmp(cache_path, &tmp_path)))
+        return AVERROR(errno);
+    ok = fwrite(&hdr, sizeof(hdr), 1, f) == 1;
+    for (unsigned i = 0; ok && i < ic->nb_streams; i++) {
+        const AVCodecParameters *par = ic->streams[i]->codecpar;
+        ProbeStreamRecord r;
+        fill_probe_record(&r, ic->streams[i]);
+        ok = fwrite(&r, sizeof(r), 1, f) == 1 &&
+             (!par->extradata_size ||
+              fwrite(par->extradata, par->extradata_size, 1, f) == 1);
+    }
+    return commit_sidecar(f, tmp_path, cache_path, ok);
+}
+
+/* Restores a cached probe into the freshly opened ic. Fails with
+ * AVERROR_INVALIDDATA when the cache is missing, stale, or the demuxer
+ * came up with a different stream layout (e.g. a headerless format that
+ * has not found all of its streams yet); ic is left untouched on every
+ * failure, so the caller can still probe it. */
+static int load_probe_cache(const char *path, AVFormatContext *ic)
+{
+    std::string cache_path = probe_cache_path(path);
+    FILE *f = fopen(cache_path.c_str(), "rb");
+    std::vector<ProbeStreamRecord> records;
+    std::vector<std::vector<uint8_t>> extradata;
+    ProbeHeader hdr;
+    int64_t size, mtime;
+    bool ok;
+
+    if (!f)
+        return AVERROR_INVALIDDATA;
+    ok = stat_file_identity(path, &size, &mtime) == 0 &&
+         fread(&hdr, sizeof(hdr), 1, f) == 1 &&
+         !memcmp(hdr.magic, kProbeCacheMagic, sizeof(hdr.magic)) &&
+         hdr.file_size == size && hdr.mtime == mtime &&
+         hdr.nb_streams == ic->nb_streams;
+    if (ok) {
+        records.resize(hdr.nb_streams);
+        extradata.resize(hdr.nb_streams);
+    }
+    for (uint32_t i = 0; ok && i < hdr.nb_streams; i++) {
+        const AVCodecParameters *par = ic->streams[i]->codecpar;
+        ProbeStreamRecord &r = records[i];
+        ok = fread(&r, sizeof(r), 1, f) == 1 &&
+             r.codec_type == par->codec_type && r.codec_id == par->codec_id &&
+             r.extradata_size >= 0 && r.extradata_size < (1 << 24);
+        if (ok && r.extradata_size) {
+            extradata[i].resize(r.extradata_size);
+            ok = fread(extradata[i].data(), r.extradata_size, 1, f) == 1;
+        }
+    }
+    fclose(f);
+    if (!ok)
+        return AVERROR_INVALIDDATA;
+
+    /* headerless formats only learn extradata from the bitstream; every
+     * buffer is allocated before any stream is patched, so that running
+     * out of memory still leaves ic as it was */
+    std::vector<uint8_t *> buffers(hdr.nb_streams, (uint8_t *)NULL);
+    for (uint32_t i = 0; i < hdr.nb_streams; i++) {
+        if (ic->streams[i]->codecpar->extradata_size || extradata[i].empty())
+            continue;
+        if (!(buffers[i] = (uint8_t *)av_mallocz(extradata[i].size() + AV_INPUT_BUFFER_PADDING_SIZE))) {
+            for (uint8_t *&b : buffers)
+                av_freep(&b);
+            return AVERROR(ENOMEM);
+        }
+        memcpy(buffers[i], extradata[i].data(), extradata[i].size());
+    }
+    for (unsigned i = 0; i < ic->nb_streams; i++)
+        apply_probe_record(ic->streams[i], records[i], buffers[i], extradata[i].size());
+    ic->start_time = hdr.start_time;
+    ic->duration = hdr.duration;
+    ic->bit_rate = hdr.bit_rate;
+    return 0;
+}
+
+/* avformat_find_stream_info() for inputs from open_input(). With
+ * input_cfg.probe_cache the result is kept next to local files as
+ * <path>.probe, and later opens of the same file skip probing. */
+static int find_stream_info(AVFormatContext *ic, const char *url)
+{
+    bool cacheable = input_cfg.probe_cache && is_local_path(url);
+    const char *path = strncmp(url, "file://", 7) ? url : url + 7;
+    int ret;
+
+    if (cacheable && load_probe_cache(path, ic) >= 0)
+        return 0;
+    if ((ret = avformat_find_stream_info(ic, NULL)) < 0)
+        return ret;
+    if (cacheable && save_probe_cache(path, ic) < 0)
+        fprintf(stderr, "Could not save probe cache for %s\n", path);
+    return ret;
+}
+
+static int open_input_with_info(AVFormatContext **ic, const char *in_file)
+{
+    int ret;
+    if ((ret = open_input(ic, in_file)) < 0) {
+        fprintf(stderr, "Could not open source file %s\n", in_file);
+        return ret;
+    }
+    if ((ret = find_stream_info(*ic, in_file)) < 0) {
+        fprintf(stderr, "Could not find stream information\n");
+        close_input(ic);
+    }
+    return ret;
+}
+
+/* Let the demuxer drop the packets of every stream mapped to -1, so that
+ * they are skipped at the container level instead of being read, returned
+ * and thrown away by us. */
+static void discard_unmapped_streams(AVFormatContext *ic, const std::vector<int> &stream_map)
+{
+    for (unsigned i = 0; i < ic->nb_streams; i++)
+        if (stream_map[i] < 0)
+            ic->streams[i]->discard = AVDISCARD_ALL;
+}
+
+
+DecodeSession::DecodeSession()
+    : video_writer(new BlockWriter), audio_block_writer(new BlockWriter),
+      audio_writer(new PackedAudioWriter), scalers(new SwsCache),
+      video_filter(new FrameFilter), audio_filter(new FrameFilter),
+      video_index(new RawIndexWriter)
+{
+}
+
+DecodeSession::~DecodeSession()
+{
+    close();
+}
+
+void DecodeSession::close()
+{
+    audio_writer->close();
+    video_writer->close();
+    audio_block_writer->close();
+    video_index->close();
+    free_decoder_context(&video_dec_ctx);
+    free_decoder_context(&audio_dec_ctx);
+    close_input(&fmt_ctx);
+    if (video_dst_file)
+        fclose(video_dst_file);
+    if (audio_dst_file)
+        fclose(audio_dst_file);
+    video_dst_file = audio_dst_file = NULL;
+    av_packet_free(&pkt);
+    av_frame_free(&frame);
+    av_freep(&video_dst_data[0]);
+    video_stream = audio_stream = NULL;
+    video_stream_idx = audio_stream_idx = -1;
+}
+
+/* Decode in_file into raw video and packed audio files. Every call works
+ * on its own DecodeSession, so calls may run concurrently. */
+static int decode_to_raw(const char *in_file, const char *video_out, const char *audio_out,
+                         const DecoderConfig *dec_cfg = &decoder_cfg,
+                         const DecodeRange &range = DecodeRange(), int64_t *video_frames = NULL,
+                         const FrameSelectConfig &select = frame_select_cfg)
+{
+    DecodeSession session;
+    DecodeSession *s = &session;
+    int ret = 0;
+
+    s->frame_select = select;
+    s->src_filename = in_file;
+    s->video_dst_filename = video_out;
+    s->audio_dst_filename = audio_out;
+    const char *src_filename = s->src_filename.c_str();
+    const char *video_dst_filename = s->video_dst_filename.c_str();
+    const char *audio_dst_filename = s->audio_dst_filename.c_str();
+
+    /* open input file, and allocate format context */
+    if ((ret = open_input(&s->fmt_ctx, src_filename)) < 0) {
+        fprintf(stderr, "Could not open source file %s\n", src_filename);
+        return ret;
+    }
+
+    /* retrieve stream information */
+    if ((ret = find_stream_info(s->fmt_ctx, src_filename)) < 0) {
+        fprintf(stderr, "Could not find stream information\n");
+        return ret;
+    }
+
+    DecoderConfig video_cfg = *dec_cfg;
+    if (select.mode == FrameSelectConfig::KEYFRAMES)
+        video_cfg.skip_frame = AVDISCARD_NONKEY;
+    else if (select.mode == FrameSelectConfig::EVERY_NTH && select.n > 1)
+        video_cfg.skip_frame = AVDISCARD_NONREF;
+
+    if (open_codec_context(&s->video_stream_idx, &s->video_dec_ctx, s->fmt_ctx,
+                           AVMEDIA_TYPE_VIDEO, &video_cfg) >= 0) {
+        s->video_stream = s->fmt_ctx->streams[s->video_stream_idx];
+        if (raw_writer_cfg.enabled) {
+            if ((ret = s->video_writer->open(video_dst_filename, raw_writer_cfg)) < 0) {
+                fprintf(stderr, "Could not open destination file %s\n", video_dst_filename);
+                return ret;
+            }
+        } else if (!(s->video_dst_file = fopen(video_dst_filename, "wb"))) {
+            fprintf(stderr, "Could not open destination file %s\n", video_dst_filename);
+            return AVERROR(errno);
+        }
+        /* allocate image where the decoded image will be put, hardware
+         * decoders defer this to the first downloaded frame */
+        if (s->video_dec_ctx->hw_device_ctx) {
+            s->width = s->video_dec_ctx->width;
+            s->height = s->video_dec_ctx->height;
+            s->pix_fmt = AV_PIX_FMT_NONE;
+        } else if ((ret = alloc_raw_video_dst(s, s->video_dec_ctx->width, s->video_dec_ctx->height,
+                                              s->video_dec_ctx->pix_fmt)) < 0) {
+            return ret;
+        }
+    }
+
+    if (open_codec_context(&s->audio_stream_idx, &s->audio_dec_ctx, s->fmt_ctx,
+                           AVMEDIA_TYPE_AUDIO, dec_cfg) >= 0) {
+        s->audio_stream = s->fmt_ctx->streams[s->audio_stream_idx];
+        if (raw_writer_cfg.enabled) {
+            if ((ret = s->audio_block_writer->open(audio_dst_filename, raw_writer_cfg)) < 0) {
+                fprintf(stderr, "Could not open destination file %s\n", audio_dst_filename);
+                return ret;
+            }
+            s->audio_writer->open(s->audio_block_writer.get(), audio_writer_cfg);
+        } else if (!(s->audio_dst_file = fopen(audio_dst_filename, "wb"))) {
+            fprintf(stderr, "Could not open destination file %s\n", audio_dst_filename);
+            return AVERROR(errno);
+        } else {
+            s->audio_writer->open(s->audio_dst_file, audio_writer_cfg);
+        }
+    }
+
+    /* dump input information to stderr */
+    av_dump_format(s->fmt_ctx, 0, src_filename, 0);
+
+    if (!s->audio_stream && !s->video_stream) {
+        fprintf(stderr, "Could not find audio or video stream in the input, aborting\n");
+        return AVERROR_STREAM_NOT_FOUND;
+    }
+
+    std::vector<int> used(s->fmt_ctx->nb_streams, -1);
+    if (s->video_stream) {
+        used[s->video_stream_idx] = 0;
+        if (select.mode == FrameSelectConfig::KEYFRAMES)
+            s->video_stream->discard = AVDISCARD_NONKEY;
+    }
+    if (s->audio_stream)
+        used[s->audio_stream_idx] = 0;
+    discard_unmapped_streams(s->fmt_ctx, used);
+
+    s->frame = av_frame_alloc();
+    if (!s->frame) {
+        fprintf(stderr, "Could not allocate frame\n");
+        return AVERROR(ENOMEM);
+    }
+
+    s->pkt = av_packet_alloc();
+    if (!s->pkt) {
+        fprintf(stderr, "Could not allocate packet\n");
+        return AVERROR(ENOMEM);
+    }
+
+    if (s->video_stream)
+        printf("Demuxing video from file '%s' into '%s'\n", src_filename, video_dst_filename);
+    if (s->audio_stream)
+        printf("Demuxing audio from file '%s' into '%s'\n", src_filename, audio_dst_filename);
+
+    int64_t offset = s->fmt_ctx->start_time != AV_NOPTS_VALUE ? s->fmt_ctx->start_time : 0;
+    if (range.start != AV_NOPTS_VALUE)
+        s->range_start = range.start + offset;
+    if (range.end != AV_NOPTS_VALUE)
+        s->range_end = range.end + offset;
+    s->max_video_frames = range.max_frames;
+    if (s->range_start != AV_NOPTS_VALUE &&
+        avformat_seek_file(s->fmt_ctx, -1, INT64_MIN, s->range_start, s->range_start, 0) < 0)
+        fprintf(stderr, "Could not seek %s, decoding from the start\n", src_filename);
+
+    if (decode_pipeline_cfg.enabled)
+        ret = run_decode_pipeline(s);
+
+    /* read frames from the file, up to the end of the range */
+    while (!decode_pipeline_cfg.enabled && !s->range_done() &&
+           timed_read_frame(s->fmt_ctx, s->pkt) >= 0) {
+        // check if the packet belongs to a stream we are interested in, otherwise
+        // skip it
+        if (skip_packet(s, s->pkt))
+            ;
+        else if (s->pkt->stream_index == s->video_stream_idx)
+            ret = decode_packet(s, s->video_dec_ctx, s->pkt);
+        else if (s->pkt->stream_index == s->audio_stream_idx)
+            ret = decode_packet(s, s->audio_dec_ctx, s->pkt);
+
+        av_packet_unref(s->pkt);
+        if (ret < 0)
+            break;
+    }
+
+    /* flush the decoders, the pipeline has already drained its own; frames
+     * past the range are dropped by the output functions */
+    for (AVCodecContext *dec : { s->video_dec_ctx, s->audio_dec_ctx })
+        if (dec && !decode_pipeline_cfg.enabled && ret >= 0)
+            ret = decode_packet(s, dec, NULL);
+    if (ret >= 0)
+        ret = flush_filters(s);
+
+    /* the outputs are closed either way, the first error is what the job
+     * reports */
+    int err;
+    if (s->audio_stream && (err = s->audio_writer->flush()) < 0) {
+        fprintf(stderr, "Could not write audio frame to %s\n", audio_dst_filename);
+        if (ret >= 0)
+            ret = err;
+    }
+    if (s->video_writer->is_open() && (err = s->video_writer->close()) < 0) {
+        fprintf(stderr, "Could not write video frame to %s\n", video_dst_filename);
+        if (ret >= 0)
+            ret = err;
+    }
+    if (s->video_index->close() < 0)
+        fprintf(stderr, "Could not write frame index %s\n", raw_index_path(video_dst_filename).c_str());
+    if (s->audio_block_writer->is_open() && (err = s->audio_block_writer->close()) < 0) {
+        fprintf(stderr, "Could not write audio frame to %s\n", audio_dst_filename);
+        if (ret >= 0)
+            ret = err;
+    }
+
+    if (ret >= 0)
+        printf("Demuxing succeeded.\n");
+
+    if (decode_pipeline_cfg.enabled) {
+        print_pool_stats(stderr, "frame", frame_pool.stats);
+        print_pool_stats(stderr, "packet", packet_pool.stats);
+    }
+    for (AVCodecContext *dec : { s->video_dec_ctx, s->audio_dec_ctx })
+        if (dec && dec->get_buffer2 == decoder_pool_get_buffer2)
+            print_pool_stats(stderr, av_get_media_type_string(dec->codec_type),
+                             ((DecoderBufferPool *)dec->opaque)->stats);
+
+    if (s->video_stream) {
+        printf("Video stream #%d decoded via %s\n", s->video_stream_idx,
+               decoder_path_name(s->video_dec_ctx));
+        printf("Play the output video file with the command:\n"
+            "ffplay -f rawvideo -pix_fmt %s -video_size %dx%d %s\n",
+            av_get_pix_fmt_name(s->pix_fmt), s->width, s->height,
+            video_dst_filename);
+    }
+
+    if (s->audio_stream) {
+        enum AVSampleFormat sfmt = s->audio_dec_ctx->sample_fmt;
+        int n_channels = s->audio_dec_ctx->ch_layout.nb_channels;
+        int sample_rate = s->audio_dec_ctx->sample_rate;
+        const char *fmt;
+        int fmt_ret;
+
+        if (s->audio_filter->configured()) {
+            const AVFilterContext *sink = s->audio_filter->sink();
+            AVChannelLayout layout{};
+            sfmt = AVSampleFormat(av_buffersink_get_format(sink));
+            sample_rate = av_buffersink_get_sample_rate(sink);
+            if (av_buffersink_get_ch_layout(sink, &layout) >= 0)
+                n_channels = layout.nb_channels;
+            av_channel_layout_uninit(&layout);
+        }
+
+        /* planar output has been interleaved by audio_writer */
+        if (av_sample_fmt_is_planar(sfmt))
+            sfmt = av_get_packed_sample_fmt(sfmt);
+
+        /* only a hint, the audio has been written either way */
+        if ((fmt_ret = get_format_from_sample_fmt(&fmt, sfmt)) >= 0)
+            printf("Play the output audio file with the command:\n"
+                "ffplay -f %s -ac %d -ar %d %s\n",
+                fmt, n_channels, sample_rate,
+                audio_dst_filename);
+    }
+
+    if (video_frames)
+        *video_frames = s->video_frame_count;
+    return ret < 0 ? ret : 0;
+}
+
+void demuxer_decode(){
+    std::string in_file("test_video.1080p.mp4");
+    std::string out_file("test_video.1080p.data");
+    std::string out_audio_file("test_video.1080p.pcm");
+    std::string out_video_file("test_video_encode.1080p.mp4");
+    std::ofstream out_st;
+    out_st.open(out_video_file,std::ios::app|std::ios::binary);
+    if(!out_st.is_open()){
+        std::cerr<<"open write file failed"<<std::endl;
+    }
+
+    if (decode_to_raw(in_file.c_str(), out_file.c_str(), out_audio_file.c_str()) < 0)
+        exit(1);
+}
+
+/* Settings for live sources (rtmp://, srt://, udp://, ...), where latency
+ * matters more than getting every frame. */
+struct LiveConfig {
+    int64_t probesize = 32 << 10;
+    int64_t analyzeduration = 100000;       /* microseconds */
+    /* deadline for opening the input and for every single read */
+    int64_t open_timeout = 10 * AV_TIME_BASE;
+    int64_t read_timeout = 2 * AV_TIME_BASE;
+    /* return EAGAIN instead of blocking inside the protocol */
+    bool nonblock = true;
+    /* frames later than this on arrival at the writer are dropped */
+    int64_t max_latency = AV_TIME_BASE / 2;
+    size_t queue_size = 8;
+    /* stop after this much wall time, 0 = until the feed ends */
+    int64_t duration = 0;
+};
+static LiveConfig live_cfg;
+
+/* Deadline checked by the input's interrupt callback, so no protocol call
+ * can block longer than the timeout given to arm(). */
+struct IoDeadline {
+    std::atomic<int64_t> deadline{INT64_MAX};
+    std::atomic<bool> abort{false};
+
+    void arm(int64_t timeout) { deadline = av_gettime_relative() + timeout; }
+
+    static int interrupt_cb(void *opaque)
+    {
+        IoDeadline *d = (IoDeadline *)opaque;
+        return d->abort || av_gettime_relative() > d->deadline;
+    }
+};
+
+/* Frame queue between a live decoder and its writer that never lets delay
+ * build up: push() drops the oldest frame when the writer is a whole
+ * queue behind, and the writer drops frames already past max_latency
+ * instead of writing them late. */
+class LiveFrameQueue {
+public:
+    explicit LiveFrameQueue(size_t capacity) : capacity_(FFMAX(capacity, (size_t)1)) {}
+
+    ~LiveFrameQueue()
+    {
+        for (Entry &e : entries_) {
+            memory_release(MEM_LIVE_QUEUE, frame_bytes(e.frame));
+            frame_pool.release(e.frame);
+        }
+    }
+
+    void push(AVFrame *frame, int64_t capture_time)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (entries_.size() >= capacity_) {
+            memory_release(MEM_LIVE_QUEUE, frame_bytes(entries_.front().frame));
+            frame_pool.release(entries_.front().frame);
+            entries_.pop_front();
+            dropped++;
+        }
+        memory_charge(MEM_LIVE_QUEUE, frame_bytes(frame));
+        entries_.push_back({ frame, capture_time });
+        cv_.notify_one();
+    }
+
+    /* false once closed and empty */
+    bool pop(AVFrame **frame, int64_t *capture_time)
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        cv_.wait(lock, [this] { return closed_ || !entries_.empty(); });
+        if (entries_.empty())
+            return false;
+        *frame = entries_.front().frame;
+        *capture_time = entries_.front().capture_time;
+        entries_.pop_front();
+        memory_release(MEM_LIVE_QUEUE, frame_bytes(*frame));
+        return true;
+    }
+
+    void close()
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        closed_ = true;
+        cv_.notify_all();
+    }
+
+    std::atomic<uint64_t> dropped{0};
+
+private:
+    struct Entry {
+        AVFrame *frame;
+        int64_t capture_time;
+    };
+    size_t capacity_;
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::deque<Entry> entries_;
+    bool closed_ = false;
+};
+
+/* Maps frame timestamps to the wall clock they were captured at. Sources
+ * that carry it once opened (RTSP/RTCP sender reports) give the real
+ * capture time; otherwise the first frame is taken as arriving with no
+ * delay, and latency is measured relative to that. Which of the two is
+ * fixed at construction, so that the writer thread can call now() while
+ * the demuxing thread maps timestamps. */
+struct LiveClock {
+    const bool realtime;
+    int64_t base_wall = AV_NOPTS_VALUE;
+    int64_t base_pts = 0;
+
+    explicit LiveClock(const AVFormatContext *ic)
+        : realtime(ic->start_time_realtime != AV_NOPTS_VALUE)
+    {
+    }
+
+    int64_t now() const { return realtime ? av_gettime() : av_gettime_relative(); }
+
+    int64_t capture_time(const AVFormatContext *ic, int64_t pts)
+    {
+        if (pts == AV_NOPTS_VALUE)
+            return now();
+        if (realtime)
+            return ic->start_time_realtime + pts;
+        int64_t t = now();
+        /* first frame, or a timestamp discontinuity: re-anchor */
+        if (base_wall == AV_NOPTS_VALUE || FFABS(t - (base_wall + pts - base_pts)) > 10 * AV_TIME_BASE) {
+            base_wall = t;
+            base_pts = pts;
+        }
+        return base_wall + pts - base_pts;
+    }
+};
+
+static int open_live_input(AVFormatContext **ic, const char *url, const LiveConfig &cfg,
+                           IoDeadline *deadline)
+{
+    AVDictionary *opts = NULL;
+    int ret;
+
+    if (!(*ic = avformat_alloc_context()))
+        return AVERROR(ENOMEM);
+    (*ic)->interrupt_callback.callback = IoDeadline::interrupt_cb;
+    (*ic)->interrupt_callback.opaque = deadline;
+    (*ic)->flags |= AVFMT_FLAG_NOBUFFER;
+    if (cfg.nonblock)
+        (*ic)->flags |= AVFMT_FLAG_NONBLOCK;
+
+    av_dict_set_int(&opts, "probesize", cfg.probesize, 0);
+    av_dict_set_int(&opts, "analyzeduration", cfg.analyzeduration, 0);
+    av_dict_set_int(&opts, "fpsprobesize", 0, 0);
+
+    deadline->arm(cfg.open_timeout);
+    ret = avformat_open_input(ic, url, NULL, &opts);
+    av_dict_free(&opts);
+    if (ret < 0) {
+        fprintf(stderr, "Could not open live input %s\n", url);
+        return ret;
+    }
+    if ((ret = avformat_find_stream_info(*ic, NULL)) < 0) {
+        fprintf(stderr, "Could not find stream information\n");
+        close_input(ic);
+    }
+    return ret;
+}
+
+static int live_read_frame(AVFormatContext *ic, AVPacket *pkt, const LiveConfig &cfg,
+                           IoDeadline *deadline)
+{
+    int ret;
+
+    deadline->arm(cfg.read_timeout);
+    while ((ret = timed_read_frame(ic, pkt)) == AVERROR(EAGAIN)) {
+        if (IoDeadline::interrupt_cb(deadline))
+            return AVERROR(ETIMEDOUT);
+        av_usleep(1000);
+    }
+    return ret;
+}
+
+/* Decode the video of a live feed into a rawvideo file with bounded
+ * latency. This thread reads and decodes; a writer thread takes frames
+ * off a LiveFrameQueue and drops whatever arrives later than
+ * cfg.max_latency. Per-frame capture-to-write latency is recorded as the
+ * "live_latency" metrics stage. */
+static int live_ingest(const char *url, const char *video_out, const LiveConfig &cfg)
+{
+    /* the input's interrupt callback points at it until the session has
+     * closed the input */
+    IoDeadline deadline;
+    DecodeSession session;
+    DecodeSession *s = &session;
+    LiveFrameQueue queue(cfg.queue_size);
+    std::atomic<uint64_t> late{0};
+    std::atomic<int> write_ret{0};
+    std::thread writer;
+    int64_t stop_at = cfg.duration > 0 ? av_gettime_relative() + cfg.duration : INT64_MAX;
+    int ret;
+
+    s->src_filename = url;
+    s->video_dst_filename = video_out;
+    if ((ret = open_live_input(&s->fmt_ctx, url, cfg, &deadline)) < 0)
+        return ret;
+    LiveClock clock(s->fmt_ctx);
+
+    /* frame threading buffers thread_count frames, slices do not */
+    DecoderConfig dec = decoder_cfg;
+    dec.low_delay = true;
+    dec.thread_type = FF_THREAD_SLICE;
+    if ((ret = open_codec_context(&s->video_stream_idx, &s->video_dec_ctx, s->fmt_ctx,
+                                  AVMEDIA_TYPE_VIDEO, &dec)) < 0)
+        return ret;
+    s->video_stream = s->fmt_ctx->streams[s->video_stream_idx];
+    {
+        std::vector<int> used(s->fmt_ctx->nb_streams, -1);
+        used[s->video_stream_idx] = 0;
+        discard_unmapped_streams(s->fmt_ctx, used);
+    }
+    if (!(s->video_dst_file = fopen(video_out, "wb"))) {
+        fprintf(stderr, "Could not open destination file %s\n", video_out);
+        return AVERROR(errno);
+    }
+    /* geometry taken from the first frame, live streams may not say */
+    s->pix_fmt = AV_PIX_FMT_NONE;
+    if (!(s->pkt = av_packet_alloc()))
+        return AVERROR(ENOMEM);
+    av_dump_format(s->fmt_ctx, 0, url, 0);
+
+    writer = std::thread([&] {
+        AVFrame *frame;
+        int64_t capture;
+        while (queue.pop(&frame, &capture)) {
+            int64_t latency = clock.now() - capture;
+            if (latency > cfg.max_latency) {
+                late++;
+            } else if (write_ret >= 0) {
+                write_ret = output_video_frame(s, frame);
+                metrics_record(STAGE_LATENCY, FFMAX(clock.now() - capture, 0) * 1000);
+            }
+            frame_pool.release(frame);
+        }
+    });
+
+    while (av_gettime_relative() < stop_at && write_ret >= 0) {
+        if ((ret = live_read_frame(s->fmt_ctx, s->pkt, cfg, &deadline)) < 0)
+            break;
+        if (s->pkt->stream_index != s->video_stream_idx) {
+            av_packet_unref(s->pkt);
+            continue;
+        }
+        ret = timed_send_packet(s->video_dec_ctx, s->pkt);
+        av_packet_unref(s->pkt);
+        while (ret >= 0) {
+            AVFrame *frame = frame_pool.acquire();
+            if (!frame) {
+                ret = AVERROR(ENOMEM);
+                break;
+            }
+            if ((ret = timed_receive_frame(s->video_dec_ctx, frame)) < 0) {
+                frame_pool.release(frame);
+                break;
+            }
+            int64_t capture = clock.capture_time(s->fmt_ctx, frame_time(frame, s->video_stream));
+            queue.push(frame, capture);
+        }
+        if (ret == AVERROR(EAGAIN))
+            ret = 0;
+        if (ret < 0)
+            break;
+    }
+    if (ret == AVERROR_EOF || av_gettime_relative() >= stop_at)
+        ret = 0;
+
+    queue.close();
+    writer.join();
+    fprintf(stderr, "Live ingest: %d frames written, %llu dropped in the queue, %llu late\n",
+            s->video_frame_count, (unsigned long long)queue.dropped.load(),
+            (unsigned long long)late.load());
+    return ret < 0 ? ret : write_ret.load();
+}
+
+
+/* Splitting raw planar dumps (rawvideo, as written by decode_to_raw()) into
+ * smaller files for quality-metric jobs. Frames are fixed size, so every
+ * output file is one contiguous byte range of the source. */
+struct RawSplitConfig {
+    int width = 1920, height = 1080;
+    enum AVPixelFormat pix_fmt = AV_PIX_FMT_YUV420P;
+    int64_t first_frame = 0;
+    /* instead of first_frame, in AV_TIME_BASE; needs the dump's index */
+    int64_t start_time = AV_NOPTS_VALUE;
+    /* frames to extract, -1 = up to the end of the source */
+    int64_t frame_count = -1;
+    int frames_per_file = 1;
+    /* outputs are written concurrently by this many threads */
+    int threads = 1;
+};
+static RawSplitConfig raw_split_cfg;
+
+/* Copy len bytes at offset of in_fd to the end of out_fd inside the kernel:
+ * copy_file_range() (reflinks on btrfs/xfs, server side copies on NFS),
+ * then sendfile(), and a write() straight out of the source mapping when
+ * neither works between these two files. */
+static int raw_copy_range(int in_fd, int64_t offset, int out_fd, size_t len,
+                          const uint8_t *map)
+{
+    off_t off = offset;
+    bool use_copy_file_range = true, use_sendfile = true;
+
+    while (len > 0) {
+        ssize_t n;
+        if (use_copy_file_range) {
+            n = copy_file_range(in_fd, &off, out_fd, NULL, len, 0);
+            if (n < 0 && (errno == EXDEV || errno == ENOSYS || errno == EINVAL ||
+                          errno == EOPNOTSUPP)) {
+                use_copy_file_range = false;
+                continue;
+            }
+        } else if (use_sendfile) {
+            n = sendfile(out_fd, in_fd, &off, len);
+            if (n < 0 && (errno == ENOSYS || errno == EINVAL)) {
+                use_sendfile = false;
+                continue;
+            }
+        } else if (map) {
+            n = write(out_fd, map + off, len);
+            if (n > 0)
+                off += n;
+        } else {
+            return AVERROR(ENOSYS);
+        }
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return AVERROR(errno);
+        }
+        if (n == 0)
+            return AVERROR(EIO);
+        len -= n;
+    }
+    return 0;
+}
+
+/* The RawIndexWriter sidecar of a dump, mapped read-only. Records past
+ * the end of the dump, from one that is still being written or was cut
+ * short, are left out. */
+class RawIndexReader {
+public:
+    RawIndexReader() = default;
+    RawIndexReader(const RawIndexReader &) = delete;
+    RawIndexReader &operator=(const RawIndexReader &) = delete;
+    ~RawIndexReader() { close(); }
+
+    /* Fails with AVERROR_INVALIDDATA when the index is missing or corrupt. */
+    int open(const char *data_path)
+    {
+        std::string path = raw_index_path(data_path);
+        struct stat st, data_st;
+        int fd;
+
+        close();
+        if (stat(data_path, &data_st) < 0)
+            return AVERROR(errno);
+        if ((fd = ::open(path.c_str(), O_RDONLY)) < 0)
+            return AVERROR_INVALIDDATA;
+        if (fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(RawIndexHeader)) {
+            ::close(fd);
+            return AVERROR_INVALIDDATA;
+        }
+        void *m = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (m == MAP_FAILED)
+            return AVERROR(ENOMEM);
+        map_ = (const uint8_t *)m;
+        map_size_ = st.st_size;
+
+        hdr_ = (const RawIndexHeader *)map_;
+        if (memcmp(hdr_->magic, kRawIndexMagic, sizeof(kRawIndexMagic)) ||
+            hdr_->header_size < sizeof(RawIndexHeader) || hdr_->header_size % 8 ||
+            hdr_->record_size < sizeof(RawIndexRecord) || hdr_->record_size % 8 ||
+            hdr_->header_size > map_size_ || hdr_->frame_size <= 0 ||
+            hdr_->width <= 0 || hdr_->height <= 0 || hdr_->time_base.num <= 0 ||
+            hdr_->time_base.den <= 0 || !memchr(hdr_->pix_fmt, 0, sizeof(hdr_->pix_fmt))) {
+            close();
+            return AVERROR_INVALIDDATA;
+        }
+        count_ = (map_size_ - hdr_->header_size) / hdr_->record_size;
+        if (hdr_->count)
+            count_ = FFMIN(count_, (int64_t)FFMIN(hdr_->count, (uint64_t)INT64_MAX));
+        while (count_ > 0 && (*this)[count_ - 1].offset + (*this)[count_ - 1].size > data_st.st_size)
+            count_--;
+        return 0;
+    }
+
+    void close()
+    {
+        if (map_)
+            munmap((void *)map_, map_size_);
+        map_ = NULL;
+        hdr_ = NULL;
+        map_size_ = 0;
+        count_ = 0;
+    }
+
+    const RawIndexHeader &header() const { return *hdr_; }
+    int64_t size() const { return count_; }
+
+    const RawIndexRecord &operator[](int64_t n) const
+    {
+        return *(const RawIndexRecord *)(map_ + hdr_->header_size + n * hdr_->record_size);
+    }
+
+    /* Last frame starting at or before ts, in header().time_base, -1 when
+     * ts precedes the first one. The frames of a dump are in presentation
+     * order; those without a pts are never found by time. */
+    int64_t find(int64_t ts) const
+    {
+        int64_t lo = 0, hi = count_;
+        while (lo < hi) {
+            int64_t mid = lo + (hi - lo) / 2;
+            int64_t pts = (*this)[mid].pts;
+            if (pts != AV_NOPTS_VALUE && pts > ts)
+                hi = mid;
+            else
+                lo = mid + 1;
+        }
+        while (lo > 0 && (*this)[lo - 1].pts == AV_NOPTS_VALUE)
+            lo--;
+        return lo - 1;
+    }
+
+private:
+    const uint8_t *map_ = NULL;
+    size_t map_size_ = 0;
+    const RawIndexHeader *hdr_ = NULL;
+    int64_t count_ = 0;
+};
+
+/* Split frames of the raw file in_file into out_pattern files, numbered
+ * from 0 as by av_get_frame_filename() ("%d.yuv", "clip%03d.yuv"). The
+ * geometry comes from the file's frame index when it has one, from cfg
+ * otherwise. Returns the number of files written. */
+static int split_raw_frames(const char *in_file, const char *out_pattern, const RawSplitConfig &cfg)
+{
+    int frame_size = av_image_get_buffer_size(cfg.pix_fmt, cfg.width, cfg.height, 1);
+    int64_t first_frame = cfg.first_frame;
+    const uint8_t *map = NULL;
+    RawIndexReader idx;
+    struct stat st;
+    int fd, ret = 0;
+
+    if (idx.open(in_file) >= 0) {
+        const RawIndexHeader &hdr = idx.header();
+        if (hdr.frame_size > INT_MAX) {
+            fprintf(stderr, "%s: %lld byte frames are too large\n", in_file, (long long)hdr.frame_size);
+            return AVERROR(EINVAL);
+        }
+        frame_size = hdr.frame_size;
+        if (cfg.start_time != AV_NOPTS_VALUE)
+            first_frame = FFMAX(0, idx.find(av_rescale_q(cfg.start_time, AV_TIME_BASE_Q,
+                                                         hdr.time_base)));
+    } else if (cfg.start_time != AV_NOPTS_VALUE) {
+        fprintf(stderr, "%s has no frame index to seek in\n", in_file);
+        return AVERROR(EINVAL);
+    }
+
+    if (frame_size <= 0 || cfg.frames_per_file <= 0) {
+        fprintf(stderr, "Invalid raw frame geometry %dx%d %s\n", cfg.width, cfg.height,
+                av_get_pix_fmt_name(cfg.pix_fmt));
+        return AVERROR(EINVAL);
+    }
+    if (first_frame < 0) {
+        fprintf(stderr, "Invalid first frame %lld\n", (long long)first_frame);
+        return AVERROR(EINVAL);
+    }
+    if ((fd = ::open(in_file, O_RDONLY)) < 0 || fstat(fd, &st) < 0) {
+        ret = AVERROR(errno);
+        fprintf(stderr, "Could not open source file %s\n", in_file);
+        if (fd >= 0)
+            ::close(fd);
+        return ret;
+    }
+
+    int64_t available = (idx.size() ? idx.size() : st.st_size / frame_size) - first_frame;
+    int64_t frames = cfg.frame_count < 0 ? available : FFMIN(cfg.frame_count, available);
+    if (st.st_size % frame_size)
+        fprintf(stderr, "%s: %lld trailing bytes are not a whole frame\n", in_file,
+                (long long)(st.st_size % frame_size));
+    if (frames <= 0) {
+        ::close(fd);
+        return 0;
+    }
+    int64_t nb_files = (frames + cfg.frames_per_file - 1) / cfg.frames_per_file;
+
+    /* only the write() fallback reads through it */
+    void *m = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (m != MAP_FAILED) {
+        map = (const uint8_t *)m;
+        madvise(m, st.st_size, MADV_SEQUENTIAL);
+    }
+
+    std::atomic<int64_t> next{0};
+    std::atomic<int> error{0};
+    auto worker = [&] {
+        for (int64_t i; !error && (i = next++) < nb_files; ) {
+            int64_t first = first_frame + i * cfg.frames_per_file;
+            int64_t n = FFMIN((int64_t)cfg.frames_per_file, frames - i * cfg.frames_per_file);
+            char name[1024];
+            int out, err;
+
+            if (av_get_frame_filename(name, sizeof(name), out_pattern, i) < 0) {
+                error = AVERROR(EINVAL);
+                break;
+            }
+            if ((out = ::open(name, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+                error = AVERROR(errno);
+                fprintf(stderr, "Could not open destination file %s\n", name);
+                break;
+            }
+            int64_t offset = idx.size() ? idx[first].offset : first * frame_size;
+            err = raw_copy_range(fd, offset, out, n * frame_size, map);
+            if (::close(out) < 0 && err >= 0)
+                err = AVERROR(errno);
+            if (err < 0) {
+                fprintf(stderr, "Could not write %s\n", name);
+                error = err;
+            }
+        }
+    };
+
+    std::vector<std::thread> threads;
+    int nthreads = FFMAX(1, FFMIN(cfg.threads, (int)FFMIN(nb_files, (int64_t)INT_MAX)));
+    for (int t = 1; t < nthreads; t++)
+        threads.emplace_back(worker);
+    worker();
+    for (std::thread &t : threads)
+        t.join();
+
+    if (map)
+        munmap(m, st.st_size);
+    ::close(fd);
+    return error ? (int)error : (int)nb_files;
+}
+
+void testYUV(){
+    std::string filename("/home/liu/project/ffmpeglib/output.mp4");
+    RawSplitConfig cfg;
+    cfg.frame_count = 10;
+
+    if (split_raw_frames(filename.c_str(), "%d.yuv", cfg) < 0)
+        std::cerr << "splitting " << filename << " failed" << std::endl;
+}
+
+
+
+/* Keyframe positions of one input file, per stream, in stream time_base.
+ * pts is AV_NOPTS_VALUE when it came from a container index that only
+ * records decode timestamps. */
+struct KeyframeEntry {
+    int64_t pts;
+    int64_t dts;
+    int64_t pos;
+};
+
+struct KeyframeIndex {
+    int64_t file_size = 0;
+    int64_t mtime = 0;
+    std::vector<AVRational> time_base;
+    std::vector<std::vector<KeyframeEntry>> streams;
+};
+
+static const char kKeyframeIndexMagic[8] = { 'K', 'F', 'I', 'D', 'X', '1', 0, 0 };
+
+static int64_t keyframe_ts(const KeyframeEntry &e)
+{
+    return e.pts != AV_NOPTS_VALUE ? e.pts : e.dts;
+}
+
+static std::string keyframe_index_path(const char *path)
+{
+    return std::string(path) + ".kfidx";
+}
+
+static int save_keyframe_index(const char *path, const KeyframeIndex &idx)
+{
+    std::string idx_path = keyframe_index_path(path), tmp_path;
+    FILE *f = open_sidecar_tmp(idx_path, &tmp_path);
+    uint32_t nb_streams = idx.streams.size();
+    bool ok;
+
+    if (!f)
+        return AVERROR(errno);
+    ok = fwrite(kKeyframeIndexMagic, sizeof(kKeyframeIndexMagic), 1, f) == 1 &&
+         fwrite(&idx.file_size, sizeof(idx.file_size), 1, f) == 1 &&
+         fwrite(&idx.mtime, sizeof(idx.mtime), 1, f) == 1 &&
+         fwrite(&nb_streams, sizeof(nb_streams), 1, f) == 1;
+    for (uint32_t i = 0; ok && i < nb_streams; i++) {
+        uint64_t count = idx.streams[i].size();
+        ok = fwrite(&idx.time_base[i], sizeof(AVRational), 1, f) == 1 &&
+             fwrite(&count, sizeof(count), 1, f) == 1 &&
+             fwrite(idx.streams[i].data(), sizeof(KeyframeEntry), count, f) == count;
+    }
+    return commit_sidecar(f, tmp_path, idx_path, ok);
+}
+
+/* Fails with AVERROR_INVALIDDATA when the index is missing, corrupt or was
+ * built for another version of the file. */
+static int load_keyframe_index(const char *path, KeyframeIndex *idx)
+{
+    std::string idx_path = keyframe_index_path(path);
+    FILE *f = fopen(idx_path.c_str(), "rb");
+    char magic[sizeof(kKeyframeIndexMagic)];
+    int64_t size, mtime;
+    uint32_t nb_streams;
+    bool ok;
+
+    if (!f)
+        return AVERROR_INVALIDDATA;
+    ok = stat_file_identity(path, &size, &mtime) == 0 &&
+         fread(magic, sizeof(magic), 1, f) == 1 &&
+         !memcmp(magic, kKeyframeIndexMagic, sizeof(magic)) &&
+         fread(&idx->file_size, sizeof(idx->file_size), 1, f) == 1 &&
+         fread(&idx->mtime, sizeof(idx->mtime), 1, f) == 1 &&
+         idx->file_size == size && idx->mtime == mtime &&
+         fread(&nb_streams, sizeof(nb_streams), 1, f) == 1 && nb_streams < 4096;
+    if (ok) {
+        idx->time_base.resize(nb_streams);
+        idx->streams.resize(nb_streams);
+    }
+    for (uint32_t i = 0; ok && i < nb_streams; i++) {
+        uint64_t count;
+        ok = fread(&idx->time_base[i], sizeof(AVRational), 1, f) == 1 &&
+             fread(&count, sizeof(count), 1, f) == 1 && count <= (uint64_t)size;
+        if (ok) {
+            idx->streams[i].resize(count);
+            ok = fread(idx->streams[i].data(), sizeof(KeyframeEntry), count, f) == count;
+        }
+    }
+    fclose(f);
+    return ok ? 0 : AVERROR_INVALIDDATA;
+}
+
+/* Take the keyframes from the demuxer's own index when it has entries for
+ * every stream (mp4/mov/mkv with cues), otherwise read through the file
+ * once without decoding anything. */
+static int build_keyframe_index(const char *path, KeyframeIndex *idx)
+{
+    AVFormatContext *ic = NULL;
+    AVPacket *pkt = NULL;
+    bool have_index = true;
+    int ret;
+
+    if ((ret = stat_file_identity(path, &idx->file_size, &idx->mtime)) < 0)
+        return ret;
+    if ((ret = open_input(&ic, path)) < 0) {
+        fprintf(stderr, "Could not open source file %s\n", path);
+        return ret;
+    }
+    if ((ret = find_stream_info(ic, path)) < 0) {
+        fprintf(stderr, "Could not find stream information\n");
+        close_input(&ic);
+        return ret;
+    }
+
+    idx->time_base.resize(ic->nb_streams);
+    idx->streams.assign(ic->nb_streams, std::vector<KeyframeEntry>());
+    for (unsigned i = 0; i < ic->nb_streams; i++) {
+        AVStream *st = ic->streams[i];
+        int n = avformat_index_get_entries_count(st);
+        idx->time_base[i] = st->time_base;
+        if (n <= 0)
+            have_index = false;
+        for (int j = 0; j < n; j++) {
+            const AVIndexEntry *e = avformat_index_get_entry(st, j);
+            if (e->flags & AVINDEX_KEYFRAME)
+                idx->streams[i].push_back({ AV_NOPTS_VALUE, e->timestamp, e->pos });
+        }
+    }
+
+    if (!have_index) {
+        idx->streams.assign(ic->nb_streams, std::vector<KeyframeEntry>());
+        if (!(pkt = av_packet_alloc())) {
+            close_input(&ic);
+            return AVERROR(ENOMEM);
+        }
+        while ((ret = timed_read_frame(ic, pkt)) >= 0) {
+            if (pkt->flags & AV_PKT_FLAG_KEY)
+                idx->streams[pkt->stream_index].push_back({ pkt->pts, pkt->dts, pkt->pos });
+            av_packet_unref(pkt);
+        }
+        av_packet_free(&pkt);
+        if (ret != AVERROR_EOF) {
+            close_input(&ic);
+            return ret;
+        }
+    }
+
+    close_input(&ic);
+    return 0;
+}
+
+/* Keyframe index for path, built on first use and cached next to the file
+ * as <path>.kfidx. */
+static int get_keyframe_index(const char *path, KeyframeIndex *idx)
+{
+    int ret;
+
+    if (load_keyframe_index(path, idx) >= 0)
+        return 0;
+    if ((ret = build_keyframe_index(path, idx)) < 0)
+        return ret;
+    if (save_keyframe_index(path, *idx) < 0)
+        fprintf(stderr, "Could not save keyframe index for %s\n", path);
+    return 0;
+}
+
+/* Last keyframe of stream at or before ts (stream time_base), or the first
+ * keyframe if ts precedes all of them. NULL for streams without any. */
+static const KeyframeEntry *find_keyframe_before(const KeyframeIndex &idx, int stream, int64_t ts)
+{
+    const std::vector<KeyframeEntry> &v = idx.streams[stream];
+    const KeyframeEntry *best = NULL;
+
+    if (v.empty())
+        return NULL;
+    /* entries are in decode order, but pts of keyframes only ever increase */
+    size_t lo = 0, hi = v.size();
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (keyframe_ts(v[mid]) <= ts) {
+            best = &v[mid];
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return best ? best : &v[0];
+}
+
+/* Incremental fingerprint of a stream copy: the codec parameters of the
+ * streams it keeps and every packet it passes on, fed from the read loop
+ * itself so that it costs no extra pass over the data. murmur3 is cheap
+ * enough to be lost in the demuxer's own cost. */
+class PacketHasher {
+public:
+    PacketHasher()
+    {
+        if (av_hash_alloc(&ctx_, "murmur3") >= 0)
+            av_hash_init(ctx_);
+    }
+    ~PacketHasher() { av_hash_freep(&ctx_); }
+    PacketHasher(const PacketHasher &) = delete;
+    PacketHasher &operator=(const PacketHasher &) = delete;
+
+    bool ok() const { return ctx_ != NULL; }
+
+    void add(const void *data, size_t size) { av_hash_update(ctx_, (const uint8_t *)data, size); }
+    void add(const std::string &s) { add(s.data(), s.size()); }
+
+    void add_stream(int index, const AVStream *st)
+    {
+        const AVCodecParameters *par = st->codecpar;
+        int64_t v[] = { index, par->codec_type, par->codec_id, par->width, par->height,
+                        par->sample_rate, par->ch_layout.nb_channels, par->format,
+                        st->time_base.num, st->time_base.den, par->extradata_size };
+        add(v, sizeof(v));
+        if (par->extradata_size > 0)
+            add(par->extradata, par->extradata_size);
+        const AVDictionaryEntry *tag = NULL;
+        while ((tag = av_dict_get(st->metadata, "", tag, AV_DICT_IGNORE_SUFFIX))) {
+            add(tag->key, strlen(tag->key) + 1);
+            add(tag->value, strlen(tag->value) + 1);
+        }
+    }
+
+    void add_packet(const AVPacket *pkt)
+    {
+        int64_t v[] = { pkt->stream_index, pkt->pts, pkt->dts, pkt->duration,
+                        pkt->flags & AV_PKT_FLAG_KEY, pkt->size };
+        add(v, sizeof(v));
+        if (pkt->size > 0)
+            add(pkt->data, pkt->size);
+    }
+
+    void final(uint8_t digest[16]) { av_hash_final(ctx_, digest); }
+
+private:
+    struct AVHashContext *ctx_ = NULL;
+};
+
+/* Interleaves packets by dts across the streams of oc and hands them to
+ * av_write_frame(), instead of going through av_interleaved_write_frame()
+ * and its unbounded internal buffer. A packet is released once every
+ * continuous (audio/video) stream has something queued, or when the queues
+ * exceed max_queued packets or span more than max_delta, so memory stays
+ * constant no matter how long the input is. Packets must already be in the
+ * output stream's time_base, i.e. be pushed after avformat_write_header(). */
+class PacketInterleaver {
+public:
+    explicit PacketInterleaver(AVFormatContext *oc, size_t max_queued = 512,
+                               int64_t max_delta = AV_TIME_BASE)
+        : oc_(oc), queues_(oc->nb_streams), last_key_(oc->nb_streams, AV_NOPTS_VALUE),
+          max_queued_(max_queued), max_delta_(max_delta) {}
+    PacketInterleaver(const PacketInterleaver &) = delete;
+    PacketInterleaver &operator=(const PacketInterleaver &) = delete;
+
+    ~PacketInterleaver()
+    {
+        for (std::deque<Entry> &q : queues_)
+            for (Entry &e : q) {
+                memory_release(MEM_MUX_QUEUE, packet_bytes(e.pkt));
+                packet_pool.release(e.pkt);
+            }
+    }
+
+    /* Takes over the reference held by pkt, which is left blank. */
+    int write(AVPacket *pkt)
+    {
+        int idx = pkt->stream_index;
+        AVPacket *queued = packet_pool.acquire();
+        int ret;
+
+        if (!queued)
+            return AVERROR(ENOMEM);
+        av_packet_move_ref(queued, pkt);
+        memory_charge(MEM_MUX_QUEUE, packet_bytes(queued));
+
+        /* timestampless packets stay behind their predecessor */
+        int64_t key = queued->dts != AV_NOPTS_VALUE ? queued->dts : queued->pts;
+        if (key == AV_NOPTS_VALUE)
+            key = last_key_[idx];
+        else
+            key = av_rescale_q(key, oc_->streams[idx]->time_base, AV_TIME_BASE_Q);
+        if (key == AV_NOPTS_VALUE)
+            key = INT64_MIN;
+        last_key_[idx] = key;
+        newest_ = FFMAX(newest_, key);
+
+        queues_[idx].push_back({ queued, key });
+        queued_++;
+
+        while (queued_ > 0 && ready())
+            if ((ret = write_earliest()) < 0)
+                return ret;
+        return 0;
+    }
+
+    /* Writes out everything still queued, at end of input. */
+    int flush()
+    {
+        int ret;
+        while (queued_ > 0)
+            if ((ret = write_earliest()) < 0)
+                return ret;
+        return 0;
+    }
+
+private:
+    struct Entry {
+        AVPacket *pkt;
+        int64_t key;
+    };
+
+    bool ready() const
+    {
+        if (queued_ > max_queued_)
+            return true;
+
+        int64_t oldest = INT64_MAX;
+        for (const std::deque<Entry> &q : queues_)
+            if (!q.empty())
+                oldest = FFMIN(oldest, q.front().key);
+        if (oldest != INT64_MIN && newest_ - oldest > max_delta_)
+            return true;
+
+        for (size_t i = 0; i < queues_.size(); i++) {
+            enum AVMediaType type = oc_->streams[i]->codecpar->codec_type;
+            if (queues_[i].empty() && (type == AVMEDIA_TYPE_VIDEO || type == AVMEDIA_TYPE_AUDIO))
+                return false;
+        }
+        return true;
+    }
+
+    int write_earliest()
+    {
+        int best = -1;
+        for (size_t i = 0; i < queues_.size(); i++)
+            if (!queues_[i].empty() &&
+                (best < 0 || queues_[i].front().key < queues_[best].front().key))
+                best = i;
+
+        AVPacket *pkt = queues_[best].front().pkt;
+        queues_[best].pop_front();
+        queued_--;
+        memory_release(MEM_MUX_QUEUE, packet_bytes(pkt));
+        int ret;
+        {
+            StageTimer timer(STAGE_MUX);
+            ret = av_write_frame(oc_, pkt);
+        }
+        packet_pool.release(pkt);
+        if (ret < 0)
+            fprintf(stderr, "Error muxing packet\n");
+        return ret;
+    }
+
+    AVFormatContext *oc_;
+    std::vector<std::deque<Entry>> queues_;
+    std::vector<int64_t> last_key_;
+    size_t queued_ = 0;
+    size_t max_queued_;
+    int64_t max_delta_;
+    int64_t newest_ = INT64_MIN;
+};
+
+/* Stream-copy every audio and video packet of ic from seek_ts up to end_ts
+ * (both absolute, AV_TIME_BASE units) into out_file. The input is sought to
+ * seek_ts first, which should be a video keyframe; INT64_MIN instead reads
+ * a freshly opened ic from its first packet. With rebase the output starts
+ * at zero, otherwise it keeps the input timeline so that consecutive ranges
+ * can be joined again. Packets are selected on pts, or with by_dts on dts:
+ * ranges cut at keyframe dts then split every stream in file order, and
+ * B-frames shown before a cut cannot fall between two ranges. Copied
+ * streams and packets are fed to hasher when one is given. */
+static int copy_range(AVFormatContext *ic, const char *out_file, const char *format,
+                      int64_t seek_ts, int64_t end_ts, bool rebase, bool by_dts,
+                      AVDictionary **mux_opts, PacketHasher *hasher = NULL)
+{
+    /* how far past end_ts interleaving may still hold packets of the range */
+    const int64_t interleave_slack = 2 * AV_TIME_BASE;
+    AVFormatContext *oc = NULL;
+    AVPacket *pkt = NULL;
+    std::unique_ptr<PacketInterleaver> interleaver;
+    std::vector<int> stream_map(ic->nb_streams, -1);
+    std::vector<bool> stream_done(ic->nb_streams, true);
+    int ret;
+
+    if (seek_ts != INT64_MIN &&
+        (ret = avformat_seek_file(ic, -1, INT64_MIN, seek_ts, seek_ts, 0)) < 0) {
+        fprintf(stderr, "Could not seek to %lld\n", (long long)seek_ts);
+        return ret;
+    }
+
+    if ((ret = avformat_alloc_output_context2(&oc, NULL, format, out_file)) < 0) {
+        fprintf(stderr, "Could not create output context for %s\n", out_file);
+        return ret;
+    }
+    for (unsigned i = 0; i < ic->nb_streams; i++) {
+        AVStream *ist = ic->streams[i], *ost;
+        if (ist->codecpar->codec_type != AVMEDIA_TYPE_VIDEO &&
+            ist->codecpar->codec_type != AVMEDIA_TYPE_AUDIO)
+            continue;
+        if (!(ost = avformat_new_stream(oc, NULL))) {
+            ret = AVERROR(ENOMEM);
+            goto end;
+        }
+        if ((ret = avcodec_parameters_copy(ost->codecpar, ist->codecpar)) < 0)
+            goto end;
+        ost->codecpar->codec_tag = 0;
+        ost->time_base = ist->time_base;
+        stream_map[i] = ost->index;
+        stream_done[i] = false;
+        if (hasher)
+            hasher->add_stream(i, ist);
+    }
+    discard_unmapped_streams(ic, stream_map);
+    if (!(oc->oformat->flags & AVFMT_NOFILE) &&
+        (ret = avio_open(&oc->pb, out_file, AVIO_FLAG_WRITE)) < 0) {
+        fprintf(stderr, "Could not open output file %s\n", out_file);
+        goto end;
+    }
+    if ((ret = avformat_write_header(oc, mux_opts)) < 0)
+        goto end;
+    interleaver.reset(new PacketInterleaver(oc));
+
+    if (!(pkt = av_packet_alloc())) {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+    while ((ret = timed_read_frame(ic, pkt)) >= 0) {
+        AVStream *ist = ic->streams[pkt->stream_index];
+        int64_t ts = by_dts ? (pkt->dts != AV_NOPTS_VALUE ? pkt->dts : pkt->pts)
+                            : (pkt->pts != AV_NOPTS_VALUE ? pkt->pts : pkt->dts);
+        /* both ends rounded the same way, so that where one range ends the
+         * next one starts */
+        int64_t offset = seek_ts == INT64_MIN ? INT64_MIN : av_rescale_q(seek_ts, AV_TIME_BASE_Q, ist->time_base);
+        int64_t end = end_ts == INT64_MAX ? INT64_MAX : av_rescale_q(end_ts, AV_TIME_BASE_Q, ist->time_base);
+        int out_idx = stream_map[pkt->stream_index];
+
+        if (out_idx < 0 || ts == AV_NOPTS_VALUE || ts < offset) {
+            av_packet_unref(pkt);
+            continue;
+        }
+        if (ts >= end) {
+            /* the other streams may still have packets before end_ts
+             * interleaved behind this one */
+            stream_done[pkt->stream_index] = true;
+            bool done = std::find(stream_done.begin(), stream_done.end(), false) == stream_done.end() ||
+                        av_compare_ts(ts, ist->time_base, end_ts + interleave_slack, AV_TIME_BASE_Q) >= 0;
+            av_packet_unref(pkt);
+            if (done)
+                break;
+            continue;
+        }
+
+        if (hasher)
+            hasher->add_packet(pkt);
+        if (rebase) {
+            if (pkt->pts != AV_NOPTS_VALUE)
+                pkt->pts -= offset;
+            if (pkt->dts != AV_NOPTS_VALUE)
+                pkt->dts -= offset;
+        }
+        pkt->pos = -1;
+        pkt->stream_index = out_idx;
+        av_packet_rescale_ts(pkt, ist->time_base, oc->streams[out_idx]->time_base);
+        if ((ret = interleaver->write(pkt)) < 0)
+            goto end;
     }
+    if ((ret = interleaver->flush()) < 0)
+        goto end;
+    ret = av_write_trailer(oc);
 
-    printf("video_frame n:%d coded_n:%d\n",
-           video_frame_count++, frame->coded_picture_number);
+end:
+    interleaver.reset();
+    av_packet_free(&pkt);
+    if (!(oc->oformat->flags & AVFMT_NOFILE))
+        avio_closep(&oc->pb);
+    avformat_free_context(oc);
+    return ret;
+}
 
-    /* copy decoded frame to destination buffer:
-     * this is required since rawvideo expects non aligned data */
-    av_image_copy(video_dst_data, video_dst_linesize,
-                  (const uint8_t **)(frame->data), frame->linesize,
-                  pix_fmt, width, height);
+/* Decode time of a keyframe, where a cut in file order falls. */
+static int64_t keyframe_dts(const KeyframeEntry &e)
+{
+    return e.dts != AV_NOPTS_VALUE ? e.dts : e.pts;
+}
 
-    /* write to rawvideo file */
-    fwrite(video_dst_data[0], 1, video_dst_bufsize, video_dst_file);
+/* Absolute time (AV_TIME_BASE) of the last video keyframe at or before the
+ * absolute time ts, or ts itself when there is no video index. The time
+ * is the keyframe's pts, or its dts with by_dts. */
+static int64_t snap_to_keyframe(const KeyframeIndex &idx, int video_idx, int64_t ts,
+                                bool by_dts = false)
+{
+    if (video_idx < 0 || video_idx >= (int)idx.streams.size())
+        return ts;
+    AVRational tb = idx.time_base[video_idx];
+    const KeyframeEntry *kf = find_keyframe_before(idx, video_idx, av_rescale_q(ts, AV_TIME_BASE_Q, tb));
+    if (!kf)
+        return ts;
+    return av_rescale_q(by_dts ? keyframe_dts(*kf) : keyframe_ts(*kf), tb, AV_TIME_BASE_Q);
+}
+
+/* Copy the [start, end) range (AV_TIME_BASE units, end <= 0 for the rest of
+ * the file) of every audio and video stream of in_file into out_file. The
+ * input is sought straight to the video keyframe at or before start, so the
+ * clip begins with a decodable picture and nothing before it is read. */
+static int trim_clip(const char *in_file, const char *out_file, int64_t start, int64_t end,
+                     PacketHasher *hasher = NULL)
+{
+    AVFormatContext *ic = NULL;
+    KeyframeIndex idx;
+    int64_t base = 0;
+    int video_idx, ret;
+
+    if ((ret = get_keyframe_index(in_file, &idx)) < 0)
+        return ret;
+    if ((ret = open_input_with_info(&ic, in_file)) < 0)
+        return ret;
+
+    /* index and packets use the file's own timeline */
+    if (ic->start_time != AV_NOPTS_VALUE)
+        base = ic->start_time;
+    video_idx = av_find_best_stream(ic, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0);
+    ret = copy_range(ic, out_file, NULL, snap_to_keyframe(idx, video_idx, base + start),
+                     end > 0 ? base + end : INT64_MAX, true, false, NULL, hasher);
+    close_input(&ic);
+    return ret;
+}
+
+struct SegmentRemuxConfig {
+    int segments = 4;
+    /* "mpegts" or "mp4"; mp4 segments are written fragmented */
+    const char *format = "mpegts";
+    /* join the segments into one output once all of them are written */
+    bool concat = true;
+};
+
+/* Stream-copy every packet of the segment files, in order, into out_file.
+ * The segments keep the input timeline, so no timestamp fixup is needed. */
+static int concat_segments(const std::vector<std::string> &segments, const char *out_file)
+{
+    AVFormatContext *oc = NULL;
+    AVPacket *pkt = av_packet_alloc();
+    std::unique_ptr<PacketInterleaver> interleaver;
+    int ret = 0;
+
+    if (!pkt)
+        return AVERROR(ENOMEM);
+    for (size_t s = 0; s < segments.size() && ret >= 0; s++) {
+        AVFormatContext *ic = NULL;
+        if ((ret = open_input_with_info(&ic, segments[s].c_str())) < 0)
+            break;
+        if (!oc) {
+            if ((ret = avformat_alloc_output_context2(&oc, NULL, NULL, out_file)) < 0) {
+                close_input(&ic);
+                break;
+            }
+            for (unsigned i = 0; i < ic->nb_streams && ret >= 0; i++) {
+                AVStream *ost = avformat_new_stream(oc, NULL);
+                if (!ost) {
+                    ret = AVERROR(ENOMEM);
+                    break;
+                }
+                ret = avcodec_parameters_copy(ost->codecpar, ic->streams[i]->codecpar);
+                ost->codecpar->codec_tag = 0;
+                ost->time_base = ic->streams[i]->time_base;
+            }
+            if (ret >= 0 && !(oc->oformat->flags & AVFMT_NOFILE))
+                ret = avio_open(&oc->pb, out_file, AVIO_FLAG_WRITE);
+            if (ret >= 0)
+                ret = avformat_write_header(oc, NULL);
+            if (ret >= 0)
+                interleaver.reset(new PacketInterleaver(oc));
+        }
+        while (ret >= 0 && (ret = timed_read_frame(ic, pkt)) >= 0) {
+            if (pkt->stream_index >= (int)oc->nb_streams) {
+                av_packet_unref(pkt);
+                continue;
+            }
+            pkt->pos = -1;
+            av_packet_rescale_ts(pkt, ic->streams[pkt->stream_index]->time_base,
+                                 oc->streams[pkt->stream_index]->time_base);
+            ret = interleaver->write(pkt);
+        }
+        if (ret == AVERROR_EOF)
+            ret = 0;
+        close_input(&ic);
+    }
+    if (ret >= 0 && interleaver)
+        ret = interleaver->flush();
+    if (ret >= 0 && oc)
+        ret = av_write_trailer(oc);
+
+    interleaver.reset();
+    av_packet_free(&pkt);
+    if (oc && !(oc->oformat->flags & AVFMT_NOFILE))
+        avio_closep(&oc->pb);
+    avformat_free_context(oc);
+    return ret;
+}
+
+/* Split in_file into cfg.segments keyframe-aligned time ranges and remux
+ * them concurrently, one thread and one demuxer/muxer pair per range, into
+ * <out_prefix>.NNN.ts (or .mp4). With cfg.concat the segments are then
+ * joined into concat_file. */
+static int parallel_segment_remux(const char *in_file, const char *out_prefix,
+                                  const char *concat_file, const SegmentRemuxConfig &cfg)
+{
+    AVFormatContext *ic = NULL;
+    KeyframeIndex idx;
+    std::vector<int64_t> cuts;
+    std::vector<std::string> names;
+    std::vector<int> results;
+    std::vector<std::thread> workers;
+    bool mp4 = !strcmp(cfg.format, "mp4");
+    int64_t base = 0, duration;
+    int video_idx, ret;
+
+    if ((ret = get_keyframe_index(in_file, &idx)) < 0)
+        return ret;
+    if ((ret = open_input_with_info(&ic, in_file)) < 0)
+        return ret;
+    if (ic->start_time != AV_NOPTS_VALUE)
+        base = ic->start_time;
+    duration = ic->duration;
+    video_idx = av_find_best_stream(ic, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0);
+    close_input(&ic);
+
+    /* cut points snapped back to keyframes, at their dts so that the
+     * segments split the file in decode order; short inputs with few
+     * keyframes end up with fewer segments. The first one takes whatever
+     * comes before the first cut, dts before the start time included. */
+    cuts.push_back(INT64_MIN);
+    for (int i = 1; duration > 0 && i < cfg.segments; i++) {
+        int64_t cut = snap_to_keyframe(idx, video_idx, base + duration * i / cfg.segments, true);
+        if (cut > FFMAX(cuts.back(), base))
+            cuts.push_back(cut);
+    }
+    cuts.push_back(INT64_MAX);
+
+    size_t nb = cuts.size() - 1;
+    results.assign(nb, 0);
+    for (size_t i = 0; i < nb; i++) {
+        char name[1024];
+        snprintf(name, sizeof(name), "%s.%03d.%s", out_prefix, (int)i, mp4 ? "mp4" : "ts");
+        names.push_back(name);
+    }
+    for (size_t i = 0; i < nb; i++) {
+        workers.emplace_back([&, i] {
+            AVFormatContext *wic = NULL;
+            AVDictionary *opts = NULL;
+            if ((results[i] = open_input_with_info(&wic, in_file)) < 0)
+                return;
+            if (mp4)
+                av_dict_set(&opts, "movflags", "frag_keyframe+empty_moov+default_base_moof", 0);
+            results[i] = copy_range(wic, names[i].c_str(), cfg.format,
+                                    cuts[i], cuts[i + 1], false, true, &opts);
+            av_dict_free(&opts);
+            close_input(&wic);
+        });
+    }
+    for (std::thread &t : workers)
+        t.join();
+
+    for (size_t i = 0; i < nb; i++) {
+        if (results[i] < 0) {
+            fprintf(stderr, "Remuxing segment %s failed\n", names[i].c_str());
+            return results[i];
+        }
+    }
+    if (cfg.concat && concat_file)
+        return concat_segments(names, concat_file);
     return 0;
 }
 
-static int output_audio_frame(AVFrame *frame)
+/* Stream types copied by remux_streams(). */
+struct RemuxConfig {
+    bool video = true;
+    bool audio = true;
+    bool subtitle = true;
+};
+
+/* Stream-copy every selected stream of in_file into out_file, rescaling
+ * timestamps to the time bases the muxer picked. Streams whose codec the
+ * output container cannot hold are skipped with a warning. Copied streams
+ * and packets are fed to hasher when one is given. */
+static int remux_streams(const char *in_file, const char *out_file, const RemuxConfig &cfg,
+                         PacketHasher *hasher = NULL)
 {
-    char buffer[AV_TS_MAX_STRING_SIZE]{0};
-    size_t unpadded_linesize = frame->nb_samples * av_get_bytes_per_sample(AVSampleFormat(frame->format));
-    printf("audio_frame n:%d nb_samples:%d pts:%s\n",
-           audio_frame_count++, frame->nb_samples,
-           av_ts_make_time_string(buffer, frame->pts, &audio_dec_ctx->time_base));
-
-    /* Write the raw audio data samples of the first plane. This works
-     * fine for packed formats (e.g. AV_SAMPLE_FMT_S16). However,
-     * most audio decoders output planar audio, which uses a separate
-     * plane of audio samples for each channel (e.g. AV_SAMPLE_FMT_S16P).
-     * In other words, this code will write only the first audio channel
-     * in these cases.
-     * You should use libswresample or libavfilter to convert the frame
-     * to packed data. */
-    fwrite(frame->extended_data[0], 1, unpadded_linesize, audio_dst_file);
+    AVFormatContext *ic = NULL, *oc = NULL;
+    AVPacket *pkt = NULL;
+    std::unique_ptr<PacketInterleaver> interleaver;
+    std::vector<int> stream_map;
+    int ret;
+
+    if ((ret = open_input_with_info(&ic, in_file)) < 0)
+        return ret;
+    av_dump_format(ic, 0, in_file, 0);
+
+    if ((ret = avformat_alloc_output_context2(&oc, NULL, NULL, out_file)) < 0) {
+        fprintf(stderr, "Could not create output context for %s\n", out_file);
+        goto end;
+    }
+    stream_map.assign(ic->nb_streams, -1);
+    for (unsigned i = 0; i < ic->nb_streams; i++) {
+        AVCodecParameters *par = ic->streams[i]->codecpar;
+        AVStream *ost;
+        bool wanted = (par->codec_type == AVMEDIA_TYPE_VIDEO && cfg.video) ||
+                      (par->codec_type == AVMEDIA_TYPE_AUDIO && cfg.audio) ||
+                      (par->codec_type == AVMEDIA_TYPE_SUBTITLE && cfg.subtitle);
+        if (!wanted)
+            continue;
+        if (avformat_query_codec(oc->oformat, par->codec_id, FF_COMPLIANCE_NORMAL) == 0) {
+            fprintf(stderr, "Stream #%u (%s) cannot be stored in %s, skipping it\n",
+                    i, avcodec_get_name(par->codec_id), oc->oformat->name);
+            continue;
+        }
+        if (!(ost = avformat_new_stream(oc, NULL))) {
+            ret = AVERROR(ENOMEM);
+            goto end;
+        }
+        if ((ret = avcodec_parameters_copy(ost->codecpar, par)) < 0)
+            goto end;
+        ost->codecpar->codec_tag = 0;
+        ost->time_base = ic->streams[i]->time_base;
+        av_dict_copy(&ost->metadata, ic->streams[i]->metadata, 0);
+        stream_map[i] = ost->index;
+        if (hasher)
+            hasher->add_stream(i, ic->streams[i]);
+    }
+    discard_unmapped_streams(ic, stream_map);
+    if (!oc->nb_streams) {
+        fprintf(stderr, "No stream of %s selected for remuxing\n", in_file);
+        ret = AVERROR_STREAM_NOT_FOUND;
+        goto end;
+    }
+
+    if (!(oc->oformat->flags & AVFMT_NOFILE) &&
+        (ret = avio_open(&oc->pb, out_file, AVIO_FLAG_WRITE)) < 0) {
+        fprintf(stderr, "Could not open output file %s\n", out_file);
+        goto end;
+    }
+    if ((ret = avformat_write_header(oc, NULL)) < 0)
+        goto end;
+    av_dump_format(oc, 0, out_file, 1);
+    interleaver.reset(new PacketInterleaver(oc));
+
+    if (!(pkt = av_packet_alloc())) {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+    while ((ret = timed_read_frame(ic, pkt)) >= 0) {
+        int in_idx = pkt->stream_index;
+        int out_idx = stream_map[in_idx];
+        if (out_idx < 0) {
+            av_packet_unref(pkt);
+            continue;
+        }
+        if (hasher)
+            hasher->add_packet(pkt);
+        pkt->stream_index = out_idx;
+        pkt->pos = -1;
+        av_packet_rescale_ts(pkt, ic->streams[in_idx]->time_base, oc->streams[out_idx]->time_base);
+        if ((ret = interleaver->write(pkt)) < 0)
+            goto end;
+    }
+    if (ret != AVERROR_EOF)
+        goto end;
+    if ((ret = interleaver->flush()) < 0)
+        goto end;
+    ret = av_write_trailer(oc);
+
+end:
+    interleaver.reset();
+    av_packet_free(&pkt);
+    close_input(&ic);
+    if (oc && !(oc->oformat->flags & AVFMT_NOFILE))
+        avio_closep(&oc->pb);
+    avformat_free_context(oc);
+    return ret;
+}
+
+/* Content-addressed cache of stream-copy outputs. An entry is stored as
+ * <dir>/<digest><ext>, where the digest covers the request (operation,
+ * stream selection, time range, output format) and everything the copy
+ * read: codec parameters and packets. Next to each input, <path>.remux
+ * maps request digests to entry digests for that exact file (size and
+ * mtime), so a repeated request is answered without opening the input.
+ * Entries are copied in and out, never linked, so that rewriting an
+ * output in place cannot alter the entry it came from; copy_file_range()
+ * makes the copies reflinks on filesystems that have them. Stored entries
+ * are made read-only. */
+struct RemuxCacheConfig {
+    /* NULL = no caching */
+    const char *dir = NULL;
+};
+static RemuxCacheConfig remux_cache_cfg;
+
+struct RemuxCacheRecord {
+    uint8_t request[16];
+    uint8_t content[16];
+};
+
+struct RemuxCacheHeader {
+    char magic[8];
+    int64_t file_size;
+    int64_t mtime;
+    uint32_t nb_records;
+    uint32_t reserved;
+};
+
+static const char kRemuxCacheMagic[8] = { 'R', 'E', 'M', 'U', 'X', '1', 0, 0 };
+
+/* serializes index updates between batch jobs sharing an input */
+static std::mutex remux_cache_mutex;
+
+static std::string remux_cache_index_path(const char *path)
+{
+    return std::string(path) + ".remux";
+}
+
+static std::string remux_cache_entry_path(const RemuxCacheConfig &cfg, const uint8_t digest[16],
+                                          const char *out_file)
+{
+    const char *base = strrchr(out_file, '/');
+    const char *ext = strrchr(base ? base : out_file, '.');
+    char hex[33];
+    for (int i = 0; i < 16; i++)
+        snprintf(hex + 2 * i, 3, "%02x", digest[i]);
+    return std::string(cfg.dir) + "/" + hex + (ext ? ext : "");
+}
+
+/* Records of the index next to path; empty when missing or stale. */
+static void load_remux_cache_index(const char *path, std::vector<RemuxCacheRecord> *records)
+{
+    std::string index_path = remux_cache_index_path(path);
+    FILE *f = fopen(index_path.c_str(), "rb");
+    RemuxCacheHeader hdr;
+    int64_t size, mtime;
+
+    records->clear();
+    if (!f)
+        return;
+    if (stat_file_identity(path, &size, &mtime) == 0 &&
+        fread(&hdr, sizeof(hdr), 1, f) == 1 &&
+        !memcmp(hdr.magic, kRemuxCacheMagic, sizeof(hdr.magic)) &&
+        hdr.file_size == size && hdr.mtime == mtime && hdr.nb_records < (1 << 20)) {
+        records->resize(hdr.nb_records);
+        if (hdr.nb_records &&
+            fread(records->data(), sizeof(RemuxCacheRecord), hdr.nb_records, f) != hdr.nb_records)
+            records->clear();
+    }
+    fclose(f);
+}
+
+static int save_remux_cache_index(const char *path, const std::vector<RemuxCacheRecord> &records)
+{
+    std::string index_path = remux_cache_index_path(path);
+    std::string tmp_path = index_path + ".tmp";
+    RemuxCacheHeader hdr;
+    FILE *f;
+    bool ok;
+    int ret;
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, kRemuxCacheMagic, sizeof(hdr.magic));
+    if ((ret = stat_file_identity(path, &hdr.file_size, &hdr.mtime)) < 0)
+        return ret;
+    hdr.nb_records = records.size();
 
+    if (!(f = fopen(tmp_path.c_str(), "wb")))
+        return AVERROR(errno);
+    ok = fwrite(&hdr, sizeof(hdr), 1, f) == 1 &&
+         (records.empty() ||
+          fwrite(records.data(), sizeof(RemuxCacheRecord), records.size(), f) == records.size());
+    if (fclose(f) != 0 || !ok || rename(tmp_path.c_str(), index_path.c_str()) < 0) {
+        unlink(tmp_path.c_str());
+        return AVERROR(EIO);
+    }
     return 0;
 }
 
-static int decode_packet(AVCodecContext *dec, const AVPacket *pkt)
+static int copy_file(const char *src, const char *dst)
 {
-    int ret = 0;
+    struct stat st;
+    int in_fd, out_fd, ret;
 
-    // submit the packet to the decoder
-    ret = avcodec_send_packet(dec, pkt);
-    if (ret < 0) {
-        char buffer[AV_ERROR_MAX_STRING_SIZE]{0};
-        av_make_error_string(buffer, AV_ERROR_MAX_STRING_SIZE, ret);
-        fprintf(stderr, "Error submitting a packet for decoding (%s)\n", buffer);
+    if ((in_fd = ::open(src, O_RDONLY)) < 0)
+        return AVERROR(errno);
+    if (fstat(in_fd, &st) < 0 ||
+        (out_fd = ::open(dst, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+        ret = AVERROR(errno);
+        close(in_fd);
         return ret;
     }
+    ret = raw_copy_range(in_fd, 0, out_fd, st.st_size, NULL);
+    if (close(out_fd) < 0 && ret >= 0)
+        ret = AVERROR(errno);
+    close(in_fd);
+    return ret;
+}
 
-    // get all the available frames from the decoder
-    while (ret >= 0) {
-        ret = avcodec_receive_frame(dec, frame);
-        if (ret < 0) {
-            // those two return values are special and mean there is no output
-            // frame available, but there were no errors during decoding
-            if (ret == AVERROR_EOF || ret == AVERROR(EAGAIN))
-                return 0;
+/* Make dst a copy of src with the given mode. dst is replaced atomically,
+ * so a concurrent reader never sees half a file. */
+static int place_file(const char *src, const char *dst, mode_t mode)
+{
+    std::string tmp = std::string(dst) + ".tmp";
+    int ret;
 
-            char buffer[AV_ERROR_MAX_STRING_SIZE]{0};
-            av_make_error_string(buffer, AV_ERROR_MAX_STRING_SIZE, ret);
-            fprintf(stderr, "Error during decoding (%s)\n", buffer);
-            return ret;
+    unlink(tmp.c_str());
+    ret = copy_file(src, tmp.c_str());
+    if (ret >= 0 && chmod(tmp.c_str(), mode) < 0)
+        ret = AVERROR(errno);
+    if (ret >= 0 && rename(tmp.c_str(), dst) < 0)
+        ret = AVERROR(errno);
+    if (ret < 0)
+        unlink(tmp.c_str());
+    return ret;
+}
+
+/* Run a stream copy of in_file into out_file through the remux cache.
+ * request describes everything besides the input that determines the
+ * output; run does the copy, feeding the hasher it is given. */
+template <typename Run>
+static int cached_stream_copy(const char *in_file, const char *out_file,
+                              const std::string &request, Run run)
+{
+    const RemuxCacheConfig &cfg = remux_cache_cfg;
+    const AVOutputFormat *ofmt;
+    std::vector<RemuxCacheRecord> records;
+    RemuxCacheRecord rec;
+    std::string desc, entry;
+    int ret;
+
+    if (!cfg.dir)
+        return run((PacketHasher *)NULL);
+
+    /* the format the muxer will pick for out_file is part of the request */
+    ofmt = av_guess_format(NULL, out_file, NULL);
+    desc = request + " format=" + (ofmt ? ofmt->name : "?");
+    {
+        PacketHasher h;
+        if (!h.ok())
+            return AVERROR(ENOMEM);
+        h.add(desc);
+        h.final(rec.request);
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(remux_cache_mutex);
+        load_remux_cache_index(in_file, &records);
+    }
+    for (const RemuxCacheRecord &r : records) {
+        if (memcmp(r.request, rec.request, sizeof(rec.request)))
+            continue;
+        entry = remux_cache_entry_path(cfg, r.content, out_file);
+        if (access(entry.c_str(), R_OK) == 0 && place_file(entry.c_str(), out_file, 0644) >= 0) {
+            fprintf(stderr, "%s: served from remux cache %s\n", out_file, entry.c_str());
+            return 0;
         }
+        break;
+    }
 
-        // write the frame data to output file
-        if (dec->codec->type == AVMEDIA_TYPE_VIDEO)
-            ret = output_video_frame(frame);
-        else
-            ret = output_audio_frame(frame);
+    PacketHasher hasher;
+    if (!hasher.ok())
+        return AVERROR(ENOMEM);
+    hasher.add(desc);
+    if ((ret = run(&hasher)) < 0)
+        return ret;
+    hasher.final(rec.content);
 
-        av_frame_unref(frame);
-        if (ret < 0)
-            return ret;
+    /* another input with the same packets may have stored it already */
+    entry = remux_cache_entry_path(cfg, rec.content, out_file);
+    if (access(entry.c_str(), R_OK) != 0 && place_file(out_file, entry.c_str(), 0444) < 0) {
+        fprintf(stderr, "Could not store %s in the remux cache\n", out_file);
+        return 0;
     }
 
+    std::lock_guard<std::mutex> lock(remux_cache_mutex);
+    load_remux_cache_index(in_file, &records);
+    records.erase(std::remove_if(records.begin(), records.end(), [&](const RemuxCacheRecord &r) {
+                      return !memcmp(r.request, rec.request, sizeof(rec.request));
+                  }), records.end());
+    records.push_back(rec);
+    if (save_remux_cache_index(in_file, records) < 0)
+        fprintf(stderr, "Could not update the remux cache index of %s\n", in_file);
     return 0;
 }
 
-static int open_codec_context(int *stream_idx, AVCodecContext **dec_ctx, AVFormatContext *fmt_ctx, enum AVMediaType type)
+static int cached_remux_streams(const char *in_file, const char *out_file, const RemuxConfig &cfg)
 {
-    int ret, stream_index;
-    AVStream *st;
-    const AVCodec *dec = NULL;
+    char request[64];
+    snprintf(request, sizeof(request), "remux v=%d a=%d s=%d", cfg.video, cfg.audio, cfg.subtitle);
+    return cached_stream_copy(in_file, out_file, request, [&](PacketHasher *hasher) {
+        return remux_streams(in_file, out_file, cfg, hasher);
+    });
+}
 
-    ret = av_find_best_stream(fmt_ctx, type, -1, -1, NULL, 0);
-    if (ret < 0) {
-        fprintf(stderr, "Could not find %s stream in input file '%s'\n",
-                av_get_media_type_string(type), src_filename);
+static int cached_trim_clip(const char *in_file, const char *out_file, int64_t start, int64_t end)
+{
+    char request[64];
+    snprintf(request, sizeof(request), "trim %lld %lld", (long long)start, (long long)end);
+    return cached_stream_copy(in_file, out_file, request, [&](PacketHasher *hasher) {
+        return trim_clip(in_file, out_file, start, end, hasher);
+    });
+}
+
+/* Video encoder settings for transcode(). Zero/-1/NULL fields keep the
+ * encoder's own default. */
+struct EncoderConfig {
+    const char *encoder = "libx264";
+    const char *preset = "medium";
+    const char *tune = NULL;
+    int crf = 23;
+    int64_t bit_rate = 0;
+    int gop_size = 0;
+    int max_b_frames = -1;
+    /* encoder threads; the lookahead depth is what mostly decides how much
+     * frame-level parallelism x264/x265 can find */
+    int thread_count = 0;
+    int lookahead = -1;
+    /* output geometry, 0 keeps the source size */
+    int width = 0, height = 0;
+    enum AVPixelFormat pix_fmt = AV_PIX_FMT_NONE;
+    int sws_flags = SWS_BICUBIC;
+    int sws_threads = 1;
+    /* surfaces a hardware encoder may hold on to, added to the decoder's
+     * pool when it feeds its frames straight to the encoder */
+    int hw_queue_frames = 16;
+};
+static EncoderConfig encoder_cfg;
+
+struct TranscodeContext {
+    AVFormatContext *ic = NULL, *oc = NULL;
+    AVCodecContext *dec = NULL, *enc = NULL;
+    int video_idx = -1;
+    AVStream *video_ost = NULL;
+    /* input stream -> output stream for streams that are copied as is */
+    std::vector<int> copy_map;
+
+    /* source size or format may change mid-stream, the encoder's not */
+    SwsCache scalers;
+    AVFrame *scaled = NULL;
+    /* the same for hardware frames, without leaving the device */
+    FrameFilter device_scaler;
+    /* filter_cfg.video, ahead of both */
+    FrameFilter filter;
+
+    /* packets produced before avformat_write_header() could run, i.e.
+     * before the encoder was opened on the first decoded frame */
+    AVFifo *muxing_queue = NULL;
+    bool header_written = false;
+    std::unique_ptr<PacketInterleaver> interleaver;
+
+    int64_t frames_in = 0;
+};
+
+static void set_encoder_option(AVCodecContext *enc, const char *name, const char *value)
+{
+    if (value && av_opt_set(enc->priv_data, name, value, 0) < 0)
+        fprintf(stderr, "Encoder %s does not support option %s, ignoring it\n",
+                enc->codec->name, name);
+}
+
+/* Holds pkt until the header has been written, then passes packets on to
+ * the interleaver in the output time base. pkt->time_base must be set. */
+static int transcode_mux(TranscodeContext *t, AVPacket *pkt)
+{
+    if (!t->header_written) {
+        AVPacket *queued = packet_pool.acquire();
+        if (!queued)
+            return AVERROR(ENOMEM);
+        av_packet_move_ref(queued, pkt);
+        if (av_fifo_write(t->muxing_queue, &queued, 1) < 0) {
+            fprintf(stderr, "Too many packets buffered for output stream\n");
+            packet_pool.release(queued);
+            return AVERROR(ENOSPC);
+        }
+        return 0;
+    }
+
+    av_packet_rescale_ts(pkt, pkt->time_base, t->oc->streams[pkt->stream_index]->time_base);
+    pkt->time_base = t->oc->streams[pkt->stream_index]->time_base;
+    return t->interleaver->write(pkt);
+}
+
+static int transcode_write_header(TranscodeContext *t)
+{
+    AVPacket *queued;
+    int ret;
+
+    if ((ret = avformat_write_header(t->oc, NULL)) < 0) {
+        fprintf(stderr, "Error writing the output header\n");
         return ret;
+    }
+    av_dump_format(t->oc, 0, t->oc->url, 1);
+    t->header_written = true;
+    t->interleaver.reset(new PacketInterleaver(t->oc));
+
+    while (av_fifo_read(t->muxing_queue, &queued, 1) >= 0) {
+        ret = transcode_mux(t, queued);
+        packet_pool.release(queued);
+        if (ret < 0)
+            return ret;
+    }
+    return 0;
+}
+
+/* The encoder is opened on the first decoded frame, once the real frame
+ * size and format are known, and the header only after that. */
+static int transcode_open_encoder(TranscodeContext *t, const AVFrame *frame,
+                                  const EncoderConfig &cfg)
+{
+    AVStream *ist = t->ic->streams[t->video_idx];
+    const AVCodec *codec = avcodec_find_encoder_by_name(cfg.encoder);
+    char value[32];
+    int ret;
+
+    if (!codec) {
+        fprintf(stderr, "Encoder %s not found\n", cfg.encoder);
+        return AVERROR_ENCODER_NOT_FOUND;
+    }
+    if (!(t->enc = avcodec_alloc_context3(codec)))
+        return AVERROR(ENOMEM);
+
+    t->enc->width = cfg.width ? cfg.width : frame->width;
+    t->enc->height = cfg.height ? cfg.height : frame->height;
+    if (frame->hw_frames_ctx) {
+        /* the encoder reads the surfaces of the decoder or device scaler */
+        t->enc->pix_fmt = AVPixelFormat(frame->format);
+        t->enc->sw_pix_fmt = ((AVHWFramesContext *)frame->hw_frames_ctx->data)->sw_format;
+        if (!(t->enc->hw_frames_ctx = av_buffer_ref(frame->hw_frames_ctx)))
+            return AVERROR(ENOMEM);
     } else {
-        stream_index = ret;
-        st = fmt_ctx->streams[stream_index];
+        t->enc->pix_fmt = cfg.pix_fmt != AV_PIX_FMT_NONE ? cfg.pix_fmt : AVPixelFormat(frame->format);
+    }
+    if (codec->pix_fmts && cfg.pix_fmt == AV_PIX_FMT_NONE && !frame->hw_frames_ctx) {
+        const enum AVPixelFormat *p = codec->pix_fmts;
+        while (*p != AV_PIX_FMT_NONE && *p != t->enc->pix_fmt)
+            p++;
+        if (*p == AV_PIX_FMT_NONE)
+            t->enc->pix_fmt = codec->pix_fmts[0];
+    }
+    t->enc->sample_aspect_ratio = frame->sample_aspect_ratio;
+    t->enc->time_base = ist->time_base;
+    t->enc->framerate = av_guess_frame_rate(t->ic, ist, NULL);
+    if (t->filter.configured()) {
+        /* fps and interlacing filters change the rate */
+        AVRational rate = av_buffersink_get_frame_rate(t->filter.sink());
+        if (rate.num > 0)
+            t->enc->framerate = rate;
+    }
+    t->enc->thread_count = cfg.thread_count;
+    if (cfg.bit_rate)
+        t->enc->bit_rate = cfg.bit_rate;
+    if (cfg.gop_size)
+        t->enc->gop_size = cfg.gop_size;
+    if (cfg.max_b_frames >= 0)
+        t->enc->max_b_frames = cfg.max_b_frames;
+    if (t->oc->oformat->flags & AVFMT_GLOBALHEADER)
+        t->enc->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
 
-        /* find decoder for the stream */
-        dec = avcodec_find_decoder(st->codecpar->codec_id);
-        if (!dec) {
-            fprintf(stderr, "Failed to find %s codec\n",
-                    av_get_media_type_string(type));
-            return AVERROR(EINVAL);
+    set_encoder_option(t->enc, "preset", cfg.preset);
+    set_encoder_option(t->enc, "tune", cfg.tune);
+    if (cfg.crf >= 0 && !cfg.bit_rate) {
+        snprintf(value, sizeof(value), "%d", cfg.crf);
+        set_encoder_option(t->enc, "crf", value);
+    }
+    if (cfg.lookahead >= 0) {
+        if (!strcmp(codec->name, "libx265")) {
+            snprintf(value, sizeof(value), "rc-lookahead=%d", cfg.lookahead);
+            set_encoder_option(t->enc, "x265-params", value);
+        } else {
+            snprintf(value, sizeof(value), "%d", cfg.lookahead);
+            set_encoder_option(t->enc, "rc-lookahead", value);
+        }
+    }
+
+    if ((ret = avcodec_open2(t->enc, codec, NULL)) < 0) {
+        fprintf(stderr, "Failed to open encoder %s\n", cfg.encoder);
+        return ret;
+    }
+    if ((ret = avcodec_parameters_from_context(t->video_ost->codecpar, t->enc)) < 0)
+        return ret;
+    t->video_ost->time_base = t->enc->time_base;
+    t->video_ost->avg_frame_rate = t->enc->framerate;
+
+    t->scalers.set_threads(cfg.sws_threads);
+    if (!(t->scaled = av_frame_alloc()))
+        return AVERROR(ENOMEM);
+
+    return transcode_write_header(t);
+}
+
+static int transcode_encode(TranscodeContext *t, const AVFrame *frame)
+{
+    AVPacket *out = packet_pool.acquire();
+    int ret;
+
+    if (!out)
+        return AVERROR(ENOMEM);
+    if ((ret = timed_send_frame(t->enc, frame)) < 0) {
+        fprintf(stderr, "Error sending a frame to the encoder\n");
+        packet_pool.release(out);
+        return ret;
+    }
+    while ((ret = timed_receive_packet(t->enc, out)) >= 0) {
+        out->stream_index = t->video_ost->index;
+        out->time_base = t->enc->time_base;
+        if ((ret = transcode_mux(t, out)) < 0)
+            break;
+        av_packet_unref(out);
+    }
+    packet_pool.release(out);
+    return ret == AVERROR(EAGAIN) || ret == AVERROR_EOF ? 0 : ret;
+}
+
+static bool encoder_takes_format(const char *name, int format)
+{
+    const AVCodec *codec = avcodec_find_encoder_by_name(name);
+    if (!codec || !codec->pix_fmts)
+        return false;
+    for (const enum AVPixelFormat *p = codec->pix_fmts; *p != AV_PIX_FMT_NONE; p++)
+        if (*p == format)
+            return true;
+    return false;
+}
+
+static int device_scale_filter(char *buf, size_t size, enum AVHWDeviceType type,
+                               int w, int h, enum AVPixelFormat sw_fmt)
+{
+    const char *name;
+
+    switch (type) {
+    case AV_HWDEVICE_TYPE_CUDA:  name = "scale_cuda";  break;
+    case AV_HWDEVICE_TYPE_VAAPI: name = "scale_vaapi"; break;
+    case AV_HWDEVICE_TYPE_QSV:   name = "scale_qsv";   break;
+    default:
+        return AVERROR(ENOSYS);
+    }
+    snprintf(buf, size, "%s=w=%d:h=%d:format=%s", name, w, h, av_get_pix_fmt_name(sw_fmt));
+    return 0;
+}
+
+/* Hardware frames for an encoder that takes them as they are: scale them on
+ * the device when the output geometry differs, then pass the surfaces on,
+ * sharing the hw_frames_ctx, so no picture ever crosses PCIe. */
+static int transcode_device_frame(TranscodeContext *t, AVFrame *frame, const EncoderConfig &cfg)
+{
+    const AVHWFramesContext *frames = (const AVHWFramesContext *)frame->hw_frames_ctx->data;
+    int w = t->enc ? t->enc->width : cfg.width ? cfg.width : frame->width;
+    int h = t->enc ? t->enc->height : cfg.height ? cfg.height : frame->height;
+    enum AVPixelFormat sw_fmt = t->enc ? t->enc->sw_pix_fmt :
+                                cfg.pix_fmt != AV_PIX_FMT_NONE ? cfg.pix_fmt : frames->sw_format;
+    AVFrame *scaled;
+    int ret;
+
+    if (frame->width == w && frame->height == h && frames->sw_format == sw_fmt) {
+        if (!t->enc && (ret = transcode_open_encoder(t, frame, cfg)) < 0)
+            return ret;
+        return transcode_encode(t, frame);
+    }
+
+    if (!t->device_scaler.matches(frame)) {
+        enum AVHWDeviceType type = ((AVHWDeviceContext *)frames->device_ref->data)->type;
+        char desc[128];
+        if ((ret = device_scale_filter(desc, sizeof(desc), type, w, h, sw_fmt)) < 0) {
+            fprintf(stderr, "No device scaler for %s frames\n", av_hwdevice_get_type_name(type));
+            return ret;
         }
+        if ((ret = t->device_scaler.init(AVMEDIA_TYPE_VIDEO, frame, t->ic->streams[t->video_idx]->time_base,
+                                         desc)) < 0)
+            return ret;
+    }
+    if ((ret = t->device_scaler.push(frame)) < 0)
+        return ret;
+    if (!(scaled = frame_pool.acquire()))
+        return AVERROR(ENOMEM);
+    while ((ret = t->device_scaler.pull(scaled)) >= 0) {
+        if (!t->enc && (ret = transcode_open_encoder(t, scaled, cfg)) < 0)
+            break;
+        ret = transcode_encode(t, scaled);
+        av_frame_unref(scaled);
+        if (ret < 0)
+            break;
+    }
+    frame_pool.release(scaled);
+    return ret == AVERROR(EAGAIN) ? 0 : ret;
+}
+
+static int transcode_system_frame(TranscodeContext *t, AVFrame *frame, const EncoderConfig &cfg);
+
+static int transcode_filtered_frame(TranscodeContext *t, AVFrame *frame, const EncoderConfig &cfg)
+{
+    int ret;
+
+    if (!frame->hw_frames_ctx)
+        return transcode_system_frame(t, frame, cfg);
+
+    if (t->enc ? t->enc->hw_frames_ctx != NULL : encoder_takes_format(cfg.encoder, frame->format))
+        return transcode_device_frame(t, frame, cfg);
+
+    /* a software encoder needs the pictures in system memory */
+    AVFrame *sw_frame = frame_pool.acquire();
+    if (!sw_frame)
+        return AVERROR(ENOMEM);
+    if ((ret = av_hwframe_transfer_data(sw_frame, frame, 0)) >= 0 &&
+        (ret = av_frame_copy_props(sw_frame, frame)) >= 0)
+        ret = transcode_system_frame(t, sw_frame, cfg);
+    else
+        fprintf(stderr, "Error transferring the frame to system memory\n");
+    frame_pool.release(sw_frame);
+    return ret;
+}
+
+/* Runs filter_cfg.video, if any, on decoded frames; NULL flushes it. The
+ * encoder keeps the input stream's time base whatever the filters use. */
+static int transcode_frame(TranscodeContext *t, AVFrame *frame, const EncoderConfig &cfg)
+{
+    AVStream *ist = t->ic->streams[t->video_idx];
+
+    if (frame) {
+        t->frames_in++;
+        frame->pts = frame->best_effort_timestamp;
+        frame->pict_type = AV_PICTURE_TYPE_NONE;
+    }
+    if (!filter_cfg.video)
+        return frame ? transcode_filtered_frame(t, frame, cfg) : 0;
+
+    return filter_frames(&t->filter, ist, filter_cfg.video, frame, [&](AVFrame *out) {
+        AVRational tb = av_buffersink_get_time_base(t->filter.sink());
+        out->pts = av_rescale_q(out->pts, tb, ist->time_base);
+        out->duration = av_rescale_q(out->duration, tb, ist->time_base);
+        out->pict_type = AV_PICTURE_TYPE_NONE;
+        return transcode_filtered_frame(t, out, cfg);
+    });
+}
+
+static int transcode_system_frame(TranscodeContext *t, AVFrame *frame, const EncoderConfig &cfg)
+{
+    int ret;
+
+    if (!t->enc && (ret = transcode_open_encoder(t, frame, cfg)) < 0)
+        return ret;
+
+    if (frame->width == t->enc->width && frame->height == t->enc->height &&
+        frame->format == t->enc->pix_fmt)
+        return transcode_encode(t, frame);
+
+    av_frame_unref(t->scaled);
+    t->scaled->width = t->enc->width;
+    t->scaled->height = t->enc->height;
+    t->scaled->format = t->enc->pix_fmt;
+    if ((ret = t->scalers.scale(t->scaled, frame, cfg.sws_flags)) < 0)
+        return ret;
+    return transcode_encode(t, t->scaled);
+}
+
+static int transcode_decode(TranscodeContext *t, const AVPacket *pkt, const EncoderConfig &cfg)
+{
+    AVFrame *frame = frame_pool.acquire();
+    int ret;
+
+    if (!frame)
+        return AVERROR(ENOMEM);
+    ret = timed_send_packet(t->dec, pkt);
+    while (ret >= 0) {
+        if ((ret = timed_receive_frame(t->dec, frame)) < 0)
+            break;
+        ret = transcode_frame(t, frame, cfg);
+        av_frame_unref(frame);
+    }
+    frame_pool.release(frame);
+    return ret == AVERROR(EAGAIN) || ret == AVERROR_EOF ? 0 : ret;
+}
+
+static void transcode_close(TranscodeContext *t)
+{
+    AVPacket *queued;
+
+    t->interleaver.reset();
+    t->device_scaler.reset();
+    t->filter.reset();
+    if (t->muxing_queue) {
+        while (av_fifo_read(t->muxing_queue, &queued, 1) >= 0)
+            packet_pool.release(queued);
+        av_fifo_freep2(&t->muxing_queue);
+    }
+    av_frame_free(&t->scaled);
+    avcodec_free_context(&t->enc);
+    free_decoder_context(&t->dec);
+    close_input(&t->ic);
+    if (t->oc && !(t->oc->oformat->flags & AVFMT_NOFILE))
+        avio_closep(&t->oc->pb);
+    avformat_free_context(t->oc);
+    t->oc = NULL;
+}
+
+static double cpu_seconds()
+{
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_utime.tv_sec + ru.ru_stime.tv_sec +
+           (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e6;
+}
+
+/* Decode the best video stream of in_file, scale it if the configured
+ * output differs, re-encode it with cfg.encoder and mux it into out_file
+ * together with stream copies of the audio streams. Reports the achieved
+ * fps and fps per CPU-second at the end. */
+static int transcode(const char *in_file, const char *out_file, const EncoderConfig &cfg,
+                     const DecoderConfig *dec_cfg = &decoder_cfg)
+{
+    TranscodeContext t;
+    AVPacket *pkt = NULL;
+    auto wall_start = std::chrono::steady_clock::now();
+    double cpu_start = cpu_seconds();
+    DecoderConfig dec = *dec_cfg;
+    const AVCodec *enc_codec = avcodec_find_encoder_by_name(cfg.encoder);
+    int ret;
+
+    /* a hardware encoder keeps decoded surfaces referenced while they wait
+     * in its queue, so the decoder's pool has to be deeper */
+    if (dec.hw_device_type != AV_HWDEVICE_TYPE_NONE && enc_codec &&
+        (enc_codec->capabilities & AV_CODEC_CAP_HARDWARE))
+        dec.extra_hw_frames += cfg.hw_queue_frames;
+
+    if ((ret = open_input_with_info(&t.ic, in_file)) < 0)
+        return ret;
+    av_dump_format(t.ic, 0, in_file, 0);
+    if ((ret = open_codec_context(&t.video_idx, &t.dec, t.ic, AVMEDIA_TYPE_VIDEO, &dec)) < 0)
+        goto end;
 
-        /* Allocate a codec context for the decoder */
-        *dec_ctx = avcodec_alloc_context3(dec);
-        if (!*dec_ctx) {
-            fprintf(stderr, "Failed to allocate the %s codec context\n",
-                    av_get_media_type_string(type));
-            return AVERROR(ENOMEM);
+    if ((ret = avformat_alloc_output_context2(&t.oc, NULL, NULL, out_file)) < 0) {
+        fprintf(stderr, "Could not create output context for %s\n", out_file);
+        goto end;
+    }
+    av_dict_copy(&t.oc->metadata, t.ic->metadata, AV_DICT_DONT_OVERWRITE);
+    av_dict_set(&t.oc->metadata, "creation_time", NULL, 0);
+    t.copy_map.assign(t.ic->nb_streams, -1);
+    for (unsigned i = 0; i < t.ic->nb_streams; i++) {
+        AVStream *ist = t.ic->streams[i], *ost;
+        if ((int)i != t.video_idx && ist->codecpar->codec_type != AVMEDIA_TYPE_AUDIO)
+            continue;
+        if (!(ost = avformat_new_stream(t.oc, NULL))) {
+            ret = AVERROR(ENOMEM);
+            goto end;
         }
-
-        /* Copy codec parameters from input stream to output codec context */
-        if ((ret = avcodec_parameters_to_context(*dec_ctx, st->codecpar)) < 0) {
-            fprintf(stderr, "Failed to copy %s codec parameters to decoder context\n",
-                    av_get_media_type_string(type));
-            return ret;
+        av_dict_copy(&ost->metadata, ist->metadata, AV_DICT_DONT_OVERWRITE);
+        if ((int)i == t.video_idx) {
+            t.video_ost = ost;
+            continue;
         }
+        if ((ret = avcodec_parameters_copy(ost->codecpar, ist->codecpar)) < 0)
+            goto end;
+        ost->codecpar->codec_tag = 0;
+        ost->time_base = ist->time_base;
+        t.copy_map[i] = ost->index;
+    }
+    for (unsigned i = 0; i < t.ic->nb_streams; i++)
+        if ((int)i != t.video_idx && t.copy_map[i] < 0)
+            t.ic->streams[i]->discard = AVDISCARD_ALL;
+    if (!(t.oc->oformat->flags & AVFMT_NOFILE) &&
+        (ret = avio_open(&t.oc->pb, out_file, AVIO_FLAG_WRITE)) < 0) {
+        fprintf(stderr, "Could not open output file %s\n", out_file);
+        goto end;
+    }
 
-        /* Init the decoders */
-        if ((ret = avcodec_open2(*dec_ctx, dec, NULL)) < 0) {
-            fprintf(stderr, "Failed to open %s codec\n",
-                    av_get_media_type_string(type));
-            return ret;
+    t.muxing_queue = av_fifo_alloc2(8, sizeof(AVPacket*), AV_FIFO_FLAG_AUTO_GROW);
+    pkt = av_packet_alloc();
+    if (!t.muxing_queue || !pkt) {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+    /* an encoder that never outputs would otherwise queue the whole input */
+    av_fifo_auto_grow_limit(t.muxing_queue, 4096);
+
+    while ((ret = timed_read_frame(t.ic, pkt)) >= 0) {
+        AVStream *ist = t.ic->streams[pkt->stream_index];
+        if (pkt->stream_index == t.video_idx) {
+            ret = transcode_decode(&t, pkt, cfg);
+        } else if (t.copy_map[pkt->stream_index] >= 0) {
+            pkt->stream_index = t.copy_map[pkt->stream_index];
+            pkt->time_base = ist->time_base;
+            pkt->pos = -1;
+            ret = transcode_mux(&t, pkt);
         }
-        *stream_idx = stream_index;
+        av_packet_unref(pkt);
+        if (ret < 0)
+            goto end;
     }
+    if (ret != AVERROR_EOF)
+        goto end;
 
-    return 0;
+    /* flush decoder, filters, then encoder */
+    if ((ret = transcode_decode(&t, NULL, cfg)) < 0 ||
+        (ret = transcode_frame(&t, NULL, cfg)) < 0)
+        goto end;
+    if (!t.enc) {
+        fprintf(stderr, "No video frame could be decoded from %s\n", in_file);
+        ret = AVERROR_INVALIDDATA;
+        goto end;
+    }
+    if ((ret = transcode_encode(&t, NULL)) < 0 ||
+        (ret = t.interleaver->flush()) < 0)
+        goto end;
+    ret = av_write_trailer(t.oc);
+
+    {
+        double wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - wall_start).count();
+        double cpu = cpu_seconds() - cpu_start;
+        printf("Transcoded %lld frames in %.2fs: %.1f fps, %.2f fps per CPU-second\n",
+               (long long)t.frames_in, wall, wall > 0 ? t.frames_in / wall : 0.0,
+               cpu > 0 ? t.frames_in / cpu : 0.0);
+    }
+
+end:
+    av_packet_free(&pkt);
+    transcode_close(&t);
+    return ret;
 }
 
-static int get_format_from_sample_fmt(const char **fmt,enum AVSampleFormat sample_fmt)
+/* Set up t to encode video stream video_idx of ic, which is shared and
+ * not closed by transcode_close() if t->ic is cleared first, into a
+ * video-only out_file. Frames are then fed with transcode_frame() and the
+ * output completed with transcode_finish(). */
+static int transcode_open_video_output(TranscodeContext *t, AVFormatContext *ic, int video_idx,
+                                       const char *out_file)
 {
-    int i;
-    struct sample_fmt_entry {
-        enum AVSampleFormat sample_fmt; const char *fmt_be, *fmt_le;
-    } sample_fmt_entries[] = {
-        { AV_SAMPLE_FMT_U8,  "u8",    "u8"    },
-        { AV_SAMPLE_FMT_S16, "s16be", "s16le" },
-        { AV_SAMPLE_FMT_S32, "s32be", "s32le" },
-        { AV_SAMPLE_FMT_FLT, "f32be", "f32le" },
-        { AV_SAMPLE_FMT_DBL, "f64be", "f64le" },
-    };
-    *fmt = NULL;
+    int ret;
 
-    for (i = 0; i < FF_ARRAY_ELEMS(sample_fmt_entries); i++) {
-        struct sample_fmt_entry *entry = &sample_fmt_entries[i];
-        if (sample_fmt == entry->sample_fmt) {
-            *fmt = AV_NE(entry->fmt_be, entry->fmt_le);
-            return 0;
-        }
+    t->ic = ic;
+    t->video_idx = video_idx;
+    if ((ret = avformat_alloc_output_context2(&t->oc, NULL, NULL, out_file)) < 0) {
+        fprintf(stderr, "Could not create output context for %s\n", out_file);
+        return ret;
     }
+    if (!(t->video_ost = avformat_new_stream(t->oc, NULL)) ||
+        !(t->muxing_queue = av_fifo_alloc2(8, sizeof(AVPacket*), AV_FIFO_FLAG_AUTO_GROW)))
+        return AVERROR(ENOMEM);
+    if (!(t->oc->oformat->flags & AVFMT_NOFILE) &&
+        (ret = avio_open(&t->oc->pb, out_file, AVIO_FLAG_WRITE)) < 0) {
+        fprintf(stderr, "Could not open output file %s\n", out_file);
+        return ret;
+    }
+    av_fifo_auto_grow_limit(t->muxing_queue, 4096);
+    return 0;
+}
 
-    fprintf(stderr,
-            "sample format %s is not supported as output format\n",
-            av_get_sample_fmt_name(sample_fmt));
-    return -1;
+/* Flush the filters and the encoder fed by transcode_frame(), then write
+ * the trailer. */
+static int transcode_finish(TranscodeContext *t, const EncoderConfig &cfg)
+{
+    int ret;
+
+    if ((ret = transcode_frame(t, NULL, cfg)) < 0)
+        return ret;
+    if (!t->enc)
+        return AVERROR_INVALIDDATA;
+    if ((ret = transcode_encode(t, NULL)) < 0 ||
+        (ret = t->interleaver->flush()) < 0)
+        return ret;
+    return av_write_trailer(t->oc);
 }
 
+/* One rung of an ABR ladder. width == 0 derives the width from height and
+ * the source aspect ratio. */
+struct Rendition {
+    const char *out_file;
+    int width, height;
+    int64_t bit_rate;
+};
 
+struct RenditionWorker {
+    TranscodeContext t;
+    EncoderConfig cfg;
+    SpscQueue<AVFrame*> frames;
+    int ret = 0;
 
+    explicit RenditionWorker(size_t queue_size) : frames(queue_size) {}
+};
 
-void demuxer_decode(){
- int ret = 0;
+static void rendition_run(RenditionWorker *w, std::atomic<bool> &abort)
+{
+    AVFrame *frame;
 
-    std::string in_file("test_video.1080p.mp4");
-    std::string out_file("test_video.1080p.data");
-    std::string out_video_file("test_video_encode.1080p.mp4");
-    std::ofstream out_st;
-    out_st.open(out_video_file,std::ios::app|std::ios::binary);
-    if(!out_st.is_open()){
-        std::cerr<<"open write file failed"<<std::endl;
+    while (w->frames.pop(frame, abort) && frame) {
+        memory_release(MEM_FRAME_QUEUE, frame_bytes(frame));
+        if (w->ret >= 0 && !w->t.enc && !w->cfg.width)
+            w->cfg.width = FFALIGN((int)av_rescale(w->cfg.height, frame->width, frame->height), 2);
+        if (w->ret >= 0)
+            w->ret = transcode_frame(&w->t, frame, w->cfg);
+        frame_pool.release(frame);
+        if (w->ret < 0)
+            abort = true;
     }
+    if (w->ret < 0 || abort)
+        return;
+    w->ret = transcode_finish(&w->t, w->cfg);
+}
 
-    src_filename = in_file.c_str();
+/* Decode the best video stream of in_file once and encode every rendition
+ * of ladder from it concurrently, one encoder thread per rung. Each rung
+ * gets a new reference to every decoded frame rather than a copy, and
+ * scales it with its own SwsContext that lives as long as the rung. The
+ * outputs are video only. */
+static int abr_transcode(const char *in_file, const std::vector<Rendition> &ladder,
+                         const EncoderConfig &base)
+{
+    AVFormatContext *ic = NULL;
+    AVCodecContext *dec = NULL;
+    AVPacket *pkt = NULL;
+    AVFrame *frame = NULL;
+    std::vector<std::unique_ptr<RenditionWorker>> workers;
+    std::vector<std::thread> threads;
+    std::atomic<bool> abort{false};
+    int video_idx = -1, read_ret = 0, ret;
 
-    video_dst_filename = out_file.c_str();
-    audio_dst_filename = NULL;
+    if ((ret = open_input_with_info(&ic, in_file)) < 0)
+        return ret;
+    if ((ret = open_codec_context(&video_idx, &dec, ic, AVMEDIA_TYPE_VIDEO)) < 0)
+        goto end;
+    for (unsigned i = 0; i < ic->nb_streams; i++)
+        if ((int)i != video_idx)
+            ic->streams[i]->discard = AVDISCARD_ALL;
 
-    /* open input file, and allocate format context */
-    if (avformat_open_input(&fmt_ctx, src_filename, NULL, NULL) < 0) {
-        fprintf(stderr, "Could not open source file %s\n", src_filename);
-        exit(1);
-    }
+    for (const Rendition &r : ladder) {
+        workers.emplace_back(new RenditionWorker(decode_pipeline_cfg.frame_queue_size));
+        RenditionWorker *w = workers.back().get();
+        w->cfg = base;
+        w->cfg.width = r.width;
+        w->cfg.height = r.height;
+        w->cfg.bit_rate = r.bit_rate;
+        /* the rungs share the machine, split the encoder threads */
+        if (!w->cfg.thread_count)
+            w->cfg.thread_count = cores_per_job(0, ladder.size());
 
-    /* retrieve stream information */
-    if (avformat_find_stream_info(fmt_ctx, NULL) < 0) {
-        fprintf(stderr, "Could not find stream information\n");
-        exit(1);
+        if ((ret = transcode_open_video_output(&w->t, ic, video_idx, r.out_file)) < 0)
+            goto end;
     }
 
-    try{
+    for (std::unique_ptr<RenditionWorker> &w : workers)
+        threads.emplace_back(rendition_run, w.get(), std::ref(abort));
 
-        if (open_codec_context(&video_stream_idx, &video_dec_ctx, fmt_ctx, AVMEDIA_TYPE_VIDEO) >= 0) {
-            video_stream = fmt_ctx->streams[video_stream_idx];
-            video_dst_file = fopen(video_dst_filename, "wb");
-            if (!video_dst_file) {
-                fprintf(stderr, "Could not open destination file %s\n", video_dst_filename);
-                ret = 1;
-            throw ;
-            }
-            /* allocate image where the decoded image will be put */
-            width = video_dec_ctx->width;
-            height = video_dec_ctx->height;
-            pix_fmt = video_dec_ctx->pix_fmt;
-            ret = av_image_alloc(video_dst_data, video_dst_linesize,
-                                width, height, pix_fmt, 1);
-            if (ret < 0) {
-                fprintf(stderr, "Could not allocate raw video buffer\n");
-            throw ;
-            }
-                video_dst_bufsize = ret;
-        }
-
-        if (open_codec_context(&audio_stream_idx, &audio_dec_ctx, fmt_ctx, AVMEDIA_TYPE_AUDIO) >= 0) {
-            audio_stream = fmt_ctx->streams[audio_stream_idx];
-            audio_dst_file = fopen(audio_dst_filename, "wb");
-            if (!audio_dst_file) {
-                fprintf(stderr, "Could not open destination file %s\n", audio_dst_filename);
-                ret = 1;
-            throw ;
+    pkt = av_packet_alloc();
+    frame = av_frame_alloc();
+    if (!pkt || !frame) {
+        ret = AVERROR(ENOMEM);
+        abort = true;
+    }
+    while (!abort) {
+        bool eof = (read_ret = timed_read_frame(ic, pkt)) < 0;
+        if (!eof && pkt->stream_index != video_idx) {
+            av_packet_unref(pkt);
+            continue;
+        }
+        /* a NULL packet flushes the decoder at end of input */
+        ret = timed_send_packet(dec, eof ? NULL : pkt);
+        av_packet_unref(pkt);
+        while (ret >= 0) {
+            memory_throttle(1u << MEM_FRAME_QUEUE, abort);
+            if ((ret = timed_receive_frame(dec, frame)) < 0)
+                break;
+            frame->pts = frame->best_effort_timestamp;
+            for (std::unique_ptr<RenditionWorker> &w : workers) {
+                AVFrame *ref = frame_pool.acquire();
+                if (!ref || (ret = av_frame_ref(ref, frame)) < 0) {
+                    frame_pool.release(ref);
+                    ret = AVERROR(ENOMEM);
+                    break;
+                }
+                memory_charge(MEM_FRAME_QUEUE, frame_bytes(ref));
+                if (!w->frames.push(ref, abort)) {
+                    memory_release(MEM_FRAME_QUEUE, frame_bytes(ref));
+                    frame_pool.release(ref);
+                }
             }
+            av_frame_unref(frame);
         }
+        if (ret == AVERROR(EAGAIN))
+            ret = 0;
+        if (eof || ret < 0)
+            break;
+    }
+    if (ret == AVERROR_EOF)
+        ret = 0;
+    if (ret >= 0 && read_ret < 0 && read_ret != AVERROR_EOF)
+        ret = read_ret;
+    if (ret < 0)
+        abort = true;
 
-        /* dump input information to stderr */
-        av_dump_format(fmt_ctx, 0, src_filename, 0);
-
-        if (!audio_stream && !video_stream) {
-            fprintf(stderr, "Could not find audio or video stream in the input, aborting\n");
-            ret = 1;
-            throw ;
+    for (std::unique_ptr<RenditionWorker> &w : workers)
+        w->frames.push(nullptr, abort);
+    for (std::thread &th : threads)
+        th.join();
+    for (std::unique_ptr<RenditionWorker> &w : workers) {
+        if (ret >= 0 && w->ret < 0) {
+            fprintf(stderr, "Encoding %s failed\n", w->t.oc->url);
+            ret = w->ret;
         }
+    }
 
-        frame = av_frame_alloc();
-        if (!frame) {
-            fprintf(stderr, "Could not allocate frame\n");
-            ret = AVERROR(ENOMEM);
-            throw ;
+end:
+    for (std::unique_ptr<RenditionWorker> &w : workers) {
+        AVFrame *left;
+        while (w->frames.try_pop(left)) {
+            if (left)
+                memory_release(MEM_FRAME_QUEUE, frame_bytes(left));
+            frame_pool.release(left);
         }
+        w->t.ic = NULL;  /* shared, closed below */
+        transcode_close(&w->t);
+    }
+    av_frame_free(&frame);
+    av_packet_free(&pkt);
+    free_decoder_context(&dec);
+    close_input(&ic);
+    return ret;
+}
 
-        pkt = av_packet_alloc();
-        if (!pkt) {
-            fprintf(stderr, "Could not allocate packet\n");
-            ret = AVERROR(ENOMEM);
-            throw ;
-        }
+/* Outputs of fanout_decode(), all fed from a single decode of the input.
+ * NULL outputs are not produced. */
+struct FanoutConfig {
+    /* rawvideo, as written by decode_to_raw() */
+    const char *raw_out = NULL;
+    FrameFanout::Policy raw_policy = FrameFanout::BLOCK;
+    /* PPM thumbnails every thumb_interval seconds, named by an
+     * av_get_frame_filename() pattern ("thumb%04d.ppm") */
+    const char *thumb_pattern = NULL;
+    int thumb_width = 320;
+    double thumb_interval = 10;
+    FrameFanout::Policy thumb_policy = FrameFanout::COALESCE;
+    /* video re-encoded with encoder_cfg */
+    const char *encode_out = NULL;
+    FrameFanout::Policy encode_policy = FrameFanout::BLOCK;
+    size_t ring_size = 16;
+};
+static FanoutConfig fanout_cfg;
+
+static int parse_fanout_policy(const char *name, FrameFanout::Policy *policy)
+{
+    if (!strcmp(name, "block"))
+        *policy = FrameFanout::BLOCK;
+    else if (!strcmp(name, "drop"))
+        *policy = FrameFanout::DROP;
+    else if (!strcmp(name, "coalesce"))
+        *policy = FrameFanout::COALESCE;
+    else
+        return AVERROR(EINVAL);
+    return 0;
+}
 
-        if (video_stream)
-            printf("Demuxing video from file '%s' into '%s'\n", src_filename, video_dst_filename);
-        if (audio_stream)
-            printf("Demuxing audio from file '%s' into '%s'\n", src_filename, audio_dst_filename);
+static int write_thumbnail(SwsCache *scalers, const AVFrame *frame, const char *path, int width)
+{
+    AVFrame *rgb = frame_pool.acquire();
+    FILE *f = NULL;
+    int ret;
 
+    if (!rgb)
+        return AVERROR(ENOMEM);
+    rgb->width = width;
+    rgb->height = FFMAX(2, FFALIGN((int)av_rescale(width, frame->height, frame->width), 2));
+    rgb->format = AV_PIX_FMT_RGB24;
+    if ((ret = scalers->scale(rgb, frame, SWS_BILINEAR)) < 0)
+        goto end;
+    if (!(f = fopen(path, "wb"))) {
+        fprintf(stderr, "Could not open thumbnail %s\n", path);
+        ret = AVERROR(errno);
+        goto end;
+    }
+    fprintf(f, "P6\n%d %d\n255\n", rgb->width, rgb->height);
+    for (int y = 0; y < rgb->height && ret >= 0; y++)
+        if (fwrite(rgb->data[0] + y * rgb->linesize[0], rgb->width * 3, 1, f) != 1)
+            ret = AVERROR(EIO);
+    if (fclose(f) != 0 && ret >= 0)
+        ret = AVERROR(EIO);
+end:
+    frame_pool.release(rgb);
+    return ret;
+}
 
+/* Decode the best video stream of in_file once and hand every frame, by
+ * reference, to each configured output at the same time: a raw dump, a
+ * thumbnailer and an encoder, each on its own thread behind a FrameFanout
+ * with its own slow-consumer policy. */
+static int fanout_decode(const char *in_file, const FanoutConfig &cfg)
+{
+    AVFormatContext *ic = NULL;
+    AVCodecContext *dec = NULL;
+    AVPacket *pkt = NULL;
+    AVFrame *frame = NULL;
+    FrameFanout fanout(cfg.ring_size);
+    std::vector<std::thread> threads;
+    std::atomic<bool> abort{false};
+    DecodeSession raw;
+    TranscodeContext enc;
+    EncoderConfig enc_cfg = encoder_cfg;
+    int raw_id = -1, thumb_id = -1, enc_id = -1;
+    int raw_ret = 0, thumb_ret = 0, enc_ret = 0;
+    int video_idx = -1, read_ret = 0, ret;
 
-        int frame_nums = 0;
-        /* read frames from the file */
-        while (av_read_frame(fmt_ctx, pkt) >= 0) {
-            // check if the packet belongs to a stream we are interested in, otherwise
-            // skip it
-            
+    if ((ret = open_input_with_info(&ic, in_file)) < 0)
+        return ret;
+    if ((ret = open_codec_context(&video_idx, &dec, ic, AVMEDIA_TYPE_VIDEO)) < 0)
+        goto end;
+    for (unsigned i = 0; i < ic->nb_streams; i++)
+        if ((int)i != video_idx)
+            ic->streams[i]->discard = AVDISCARD_ALL;
 
-            if (pkt->stream_index == video_stream_idx)
-                ret = decode_packet(video_dec_ctx, pkt);
-            else if (pkt->stream_index == audio_stream_idx)
-                ret = decode_packet(audio_dec_ctx, pkt);
+    if (cfg.raw_out) {
+        raw.video_stream = ic->streams[video_idx];
+        raw.video_stream_idx = video_idx;
+        raw.video_dst_filename = cfg.raw_out;
+        raw.pix_fmt = AV_PIX_FMT_NONE;
+        if (!(raw.video_dst_file = fopen(cfg.raw_out, "wb"))) {
+            fprintf(stderr, "Could not open destination file %s\n", cfg.raw_out);
+            ret = AVERROR(errno);
+            goto end;
+        }
+        raw_id = fanout.add_consumer(cfg.raw_policy);
+    }
+    if (cfg.thumb_pattern)
+        thumb_id = fanout.add_consumer(cfg.thumb_policy);
+    if (cfg.encode_out) {
+        if ((ret = transcode_open_video_output(&enc, ic, video_idx, cfg.encode_out)) < 0)
+            goto end;
+        enc_id = fanout.add_consumer(cfg.encode_policy);
+    }
+    if (raw_id < 0 && thumb_id < 0 && enc_id < 0) {
+        fprintf(stderr, "No output configured for %s\n", in_file);
+        ret = AVERROR(EINVAL);
+        goto end;
+    }
 
+    if (raw_id >= 0) {
+        threads.emplace_back([&] {
+            AVFrame *f = av_frame_alloc();
+            int r = f ? 0 : AVERROR(ENOMEM);
+            while (r >= 0 && (r = fanout.next(raw_id, f, abort)) >= 0) {
+                r = output_video_frame(&raw, f);
+                av_frame_unref(f);
+            }
+            if (r == AVERROR_EOF)
+                r = flush_filters(&raw);
+            av_frame_free(&f);
+            if ((raw_ret = r) < 0 && r != AVERROR_EXIT)
+                abort = true;
+        });
+    }
+    if (thumb_id >= 0) {
+        threads.emplace_back([&] {
+            AVRational tb = ic->streams[video_idx]->time_base;
+            AVFrame *f = av_frame_alloc();
+            SwsCache scalers;
+            int64_t next_ts = AV_NOPTS_VALUE;
+            int n = 0, r = f ? 0 : AVERROR(ENOMEM);
+            while (r >= 0 && (r = fanout.next(thumb_id, f, abort)) >= 0) {
+                int64_t ts = f->best_effort_timestamp;
+                if (ts != AV_NOPTS_VALUE)
+                    ts = av_rescale_q(ts, tb, AV_TIME_BASE_Q);
+                if (next_ts == AV_NOPTS_VALUE || ts == AV_NOPTS_VALUE || ts >= next_ts) {
+                    char path[1024];
+                    if (av_get_frame_filename(path, sizeof(path), cfg.thumb_pattern, n++) < 0)
+                        r = AVERROR(EINVAL);
+                    else if (!f->hw_frames_ctx)
+                        r = write_thumbnail(&scalers, f, path, cfg.thumb_width);
+                    else {
+                        AVFrame *sw = frame_pool.acquire();
+                        if (!sw)
+                            r = AVERROR(ENOMEM);
+                        else if ((r = av_hwframe_transfer_data(sw, f, 0)) >= 0)
+                            r = write_thumbnail(&scalers, sw, path, cfg.thumb_width);
+                        frame_pool.release(sw);
+                    }
+                    if (ts != AV_NOPTS_VALUE)
+                        next_ts = ts + (int64_t)(cfg.thumb_interval * AV_TIME_BASE);
+                }
+                av_frame_unref(f);
+            }
+            av_frame_free(&f);
+            if ((thumb_ret = r == AVERROR_EOF ? 0 : r) < 0 && r != AVERROR_EXIT)
+                abort = true;
+        });
+    }
+    if (enc_id >= 0) {
+        threads.emplace_back([&] {
+            AVFrame *f = av_frame_alloc();
+            int r = f ? 0 : AVERROR(ENOMEM);
+            while (r >= 0 && (r = fanout.next(enc_id, f, abort)) >= 0) {
+                r = transcode_frame(&enc, f, enc_cfg);
+                av_frame_unref(f);
+            }
+            if (r == AVERROR_EOF)
+                r = transcode_finish(&enc, enc_cfg);
+            av_frame_free(&f);
+            if ((enc_ret = r) < 0 && r != AVERROR_EXIT)
+                abort = true;
+        });
+    }
 
-            //out_st.write((const char*)pkt->data,pkt->size);
+    pkt = av_packet_alloc();
+    frame = av_frame_alloc();
+    if (!pkt || !frame) {
+        ret = AVERROR(ENOMEM);
+        abort = true;
+    }
+    while (!abort) {
+        bool eof = (read_ret = timed_read_frame(ic, pkt)) < 0;
+        if (!eof && pkt->stream_index != video_idx) {
             av_packet_unref(pkt);
-            if (ret < 0)
-                break;
-            if(frame_nums>=300){
-                break;
-            }
-            ++frame_nums;
-            
+            continue;
+        }
+        /* a NULL packet flushes the decoder at end of input */
+        ret = timed_send_packet(dec, eof ? NULL : pkt);
+        av_packet_unref(pkt);
+        while (ret >= 0 && (ret = timed_receive_frame(dec, frame)) >= 0) {
+            ret = fanout.publish(frame, abort);
+            av_frame_unref(frame);
         }
+        if (ret == AVERROR(EAGAIN))
+            ret = 0;
+        if (eof || ret < 0)
+            break;
+    }
+    if (ret == AVERROR_EOF || ret == AVERROR_EXIT)
+        ret = 0;
+    if (ret >= 0 && read_ret < 0 && read_ret != AVERROR_EOF)
+        ret = read_ret;
+    if (ret < 0)
+        abort = true;
+    fanout.close();
+    for (std::thread &th : threads)
+        th.join();
+
+    /* the consumers that only saw the abort are not the cause */
+    for (int r : { raw_ret, thumb_ret, enc_ret })
+        if (ret >= 0 && r < 0 && r != AVERROR_EXIT)
+            ret = r;
+    if (raw_id >= 0 && raw.video_writer->is_open() && (raw_ret = raw.video_writer->close()) < 0 && ret >= 0)
+        ret = raw_ret;
+    if (raw_id >= 0 && fanout.dropped(raw_id))
+        fprintf(stderr, "%s: %llu frames dropped\n", cfg.raw_out, (unsigned long long)fanout.dropped(raw_id));
+    if (thumb_id >= 0)
+        fprintf(stderr, "%s: %llu frames skipped\n", cfg.thumb_pattern,
+                (unsigned long long)fanout.dropped(thumb_id));
+    if (enc_id >= 0 && fanout.dropped(enc_id))
+        fprintf(stderr, "%s: %llu frames dropped\n", cfg.encode_out, (unsigned long long)fanout.dropped(enc_id));
 
+end:
+    enc.ic = NULL;  /* shared, closed below */
+    transcode_close(&enc);
+    raw.video_stream = NULL;
+    raw.close();
+    av_frame_free(&frame);
+    av_packet_free(&pkt);
+    free_decoder_context(&dec);
+    close_input(&ic);
+    return ret;
+}
 
+int encode_video(){
 
-        /* flush the decoders */
-        if (video_dec_ctx)
-            decode_packet(video_dec_ctx, NULL);
-        // if (audio_dec_ctx)
-        //     decode_packet(audio_dec_ctx, NULL);
+    std::string filename("/home/liu/project/ffmpeglib/output.mp4");
+    std::string outname("/home/liu/project/ffmpeglib/output-en.mp4");
 
-        printf("Demuxing succeeded.\n");
+    int ret = transcode(filename.c_str(), outname.c_str(), encoder_cfg);
+    if (ret < 0) {
+        char buffer[AV_ERROR_MAX_STRING_SIZE]{0};
+        av_make_error_string(buffer, AV_ERROR_MAX_STRING_SIZE, ret);
+        std::cerr << "transcode failed: " << buffer << std::endl;
+        return -1;
+    }
+    return 0;
+}
 
-        if (video_stream) {
-            printf("Play the output video file with the command:\n"
-                "ffplay -f rawvideo -pix_fmt %s -video_size %dx%d %s\n",
-                av_get_pix_fmt_name(pix_fmt), width, height,
-                video_dst_filename);
-        }
+void testDemuxer(){
+    const char* inputFileUrl = "GK88_mpeg4.mp4";
+    const char* outputFileUrl = "test_output.mp4";
 
-        if (audio_stream) {
-            enum AVSampleFormat sfmt = audio_dec_ctx->sample_fmt;
-            int n_channels = audio_dec_ctx->ch_layout.nb_channels;
-            const char *fmt;
+    int ret = cached_remux_streams(inputFileUrl, outputFileUrl, RemuxConfig());
+    if (ret < 0) {
+        char buffer[AV_ERROR_MAX_STRING_SIZE]{0};
+        av_make_error_string(buffer, AV_ERROR_MAX_STRING_SIZE, ret);
+        std::cerr << "remux failed: " << buffer << std::endl;
+    }
+}
 
-            if (av_sample_fmt_is_planar(sfmt)) {
-                const char *packed = av_get_sample_fmt_name(sfmt);
-                printf("Warning: the sample format the decoder produced is planar "
-                    "(%s). This example will output the first channel only.\n",
-                    packed ? packed : "?");
-                sfmt = av_get_packed_sample_fmt(sfmt);
-                n_channels = 1;
-            }
+/* One line of a batch manifest:
+ *
+ *   decode    <input> <video_out> <audio_out> [frames=all|key|every=N]
+ *   remux     <input> <output>
+ *   trim      <input> <output> <start_seconds> <end_seconds>
+ *   transcode <input> <output> [crf]
+ *
+ * Blank lines and lines starting with '#' are ignored. Decode jobs without
+ * frames= use the --frames selection. */
+struct BatchJob {
+    enum Op { DECODE, REMUX, TRIM, TRANSCODE } op;
+    std::string in, out, out2;
+    double start = 0, end = 0;
+    int crf = -1;
+    FrameSelectConfig frames;
+    int line = 0;
+    int ret = 0;
+    double seconds = 0;
+};
 
-            if ((ret = get_format_from_sample_fmt(&fmt, sfmt)) < 0)
-                throw std::runtime_error("get_format_from_sample_fmt failed");
+struct BatchConfig {
+    /* 0 = all online cores */
+    int core_budget = 0;
+    /* concurrent jobs, 0 = as many as the budget allows */
+    int jobs = 0;
+};
+static BatchConfig batch_cfg;
 
-            printf("Play the output audio file with the command:\n"
-                "ffplay -f %s -ac %d -ar %d %s\n",
-                fmt, n_channels, audio_dec_ctx->sample_rate,
-                audio_dst_filename);
-        }
+static int parse_manifest(const char *path, std::vector<BatchJob> *jobs)
+{
+    std::ifstream in(path);
+    std::string line;
+    int line_no = 0;
 
-    }catch(std::exception &e){
-        avcodec_free_context(&video_dec_ctx);
-        avcodec_free_context(&audio_dec_ctx);
-        avformat_close_input(&fmt_ctx);
-        if (video_dst_file)
-            fclose(video_dst_file);
-        if (audio_dst_file)
-            fclose(audio_dst_file);
-        av_packet_free(&pkt);
-        av_frame_free(&frame);
-        av_free(video_dst_data[0]);
+    if (!in.is_open()) {
+        fprintf(stderr, "Could not open manifest %s\n", path);
+        return AVERROR(errno ? errno : ENOENT);
     }
+    while (std::getline(in, line)) {
+        std::istringstream fields(line);
+        std::string op;
+        BatchJob job;
+        bool ok;
 
+        line_no++;
+        if (!(fields >> op) || op[0] == '#')
+            continue;
+        job.line = line_no;
+        if (op == "decode") {
+            std::string opt;
+            job.op = BatchJob::DECODE;
+            job.frames = frame_select_cfg;
+            ok = (bool)(fields >> job.in >> job.out >> job.out2);
+            if (ok && fields >> opt)
+                ok = !opt.compare(0, 7, "frames=") &&
+                     parse_frame_select(opt.c_str() + 7, &job.frames) >= 0;
+        } else if (op == "remux") {
+            job.op = BatchJob::REMUX;
+            ok = (bool)(fields >> job.in >> job.out);
+        } else if (op == "trim") {
+            job.op = BatchJob::TRIM;
+            ok = (bool)(fields >> job.in >> job.out >> job.start >> job.end) && job.end > job.start;
+        } else if (op == "transcode") {
+            job.op = BatchJob::TRANSCODE;
+            ok = (bool)(fields >> job.in >> job.out);
+            if (ok && !(fields >> job.crf))
+                job.crf = -1;
+        } else {
+            ok = false;
+        }
+        if (!ok) {
+            fprintf(stderr, "%s:%d: invalid job '%s'\n", path, line_no, line.c_str());
+            return AVERROR(EINVAL);
+        }
+        jobs->push_back(job);
+    }
+    return 0;
 }
 
+/* Per-worker deques of job indices. A worker takes from the back of its
+ * own deque and, once that is empty, steals from the front of the others,
+ * so a few long transcodes do not leave the rest of the pool idle. */
+class WorkStealingQueue {
+public:
+    explicit WorkStealingQueue(int workers) : queues_(workers) {}
 
-int encode_video(){
+    void push(int worker, int job)
+    {
+        std::lock_guard<std::mutex> lock(queues_[worker].mutex);
+        queues_[worker].jobs.push_back(job);
+    }
 
-    std::string filename("/home/liu/project/ffmpeglib/output.mp4");
-    std::string outname("/home/liu/project/ffmpeglib/output-en.mp4");
-	
-
-    AVFormatContext * format_ctx = nullptr;
-    AVCodecContext *dec_ctx = nullptr;
-    AVFrame *decoded_frame = nullptr;
-    AVPacket *pkt = nullptr;
-    AVPacket *outpkt = nullptr;
-    AVCodecParameters *codecPar = nullptr;
-    AVFormatContext *oc = nullptr;
-    const char *format = nullptr;
-    AVFifo *muxing_queue = nullptr;
-    AVFrame *filtered_frame = nullptr;
-
-    format_ctx = avformat_alloc_context();
-    // format_ctx->data_codec_id = AV_CODEC_ID_NONE;
-    // format_ctx->video_codec_id = AV_CODEC_ID_NONE;
-    // format_ctx->audio_codec_id = AV_CODEC_ID_NONE;
-    // format_ctx->subtitle_codec_id = AV_CODEC_ID_NONE;
-    // format_ctx->flags |= AVFMT_FLAG_NONBLOCK;
-
-    const AVInputFormat *file_iformat = NULL;
-    AVRational framerate_guessed;
-
-    int err = 0;
-    err = avformat_open_input(&format_ctx, filename.c_str(), NULL, NULL);
-    err = avformat_find_stream_info(format_ctx, NULL);
-    av_dump_format(format_ctx,0,filename.c_str(),0);
-    //avformat_new_stream()
-
-
-    const AVCodec *codec = avcodec_find_decoder(format_ctx->streams[0]->codecpar->codec_id);
-    dec_ctx = avcodec_alloc_context3(codec);
-    AVCodecParameters *par = format_ctx->streams[0]->codecpar;
-    err = avcodec_parameters_to_context(dec_ctx, par);
-    decoded_frame = av_frame_alloc();
-    pkt = av_packet_alloc();
-    framerate_guessed = av_guess_frame_rate(format_ctx, format_ctx->streams[0], NULL);
-    codecPar = avcodec_parameters_alloc();
-    err = avcodec_parameters_from_context(codecPar,dec_ctx);
+    bool pop(int worker, int *job)
+    {
+        int n = queues_.size();
+        for (int i = 0; i < n; i++) {
+            Queue &q = queues_[(worker + i) % n];
+            std::lock_guard<std::mutex> lock(q.mutex);
+            if (q.jobs.empty())
+                continue;
+            if (i == 0) {
+                *job = q.jobs.back();
+                q.jobs.pop_back();
+            } else {
+                *job = q.jobs.front();
+                q.jobs.pop_front();
+            }
+            return true;
+        }
+        return false;
+    }
 
+private:
+    struct Queue {
+        std::mutex mutex;
+        std::deque<int> jobs;
+    };
+    std::vector<Queue> queues_;
+};
 
+static int run_batch_job(BatchJob *job, int codec_threads)
+{
+    DecoderConfig dec = decoder_cfg;
+    if (!dec.thread_count)
+        dec.thread_count = codec_threads;
 
-    err = avformat_alloc_output_context2(&oc, NULL, format, outname.c_str());
-    if (av_guess_codec(oc->oformat, NULL, oc->url, NULL, AVMEDIA_TYPE_VIDEO) == AV_CODEC_ID_NONE)
-        return -1;
+    switch (job->op) {
+    case BatchJob::DECODE:
+        return decode_to_raw(job->in.c_str(), job->out.c_str(), job->out2.c_str(), &dec,
+                             DecodeRange(), NULL, job->frames);
+    case BatchJob::REMUX:
+        return cached_remux_streams(job->in.c_str(), job->out.c_str(), RemuxConfig());
+    case BatchJob::TRIM:
+        return cached_trim_clip(job->in.c_str(), job->out.c_str(),
+                         (int64_t)(job->start * AV_TIME_BASE), (int64_t)(job->end * AV_TIME_BASE));
+    case BatchJob::TRANSCODE: {
+        EncoderConfig enc = encoder_cfg;
+        if (job->crf >= 0)
+            enc.crf = job->crf;
+        if (!enc.thread_count)
+            enc.thread_count = codec_threads;
+        return transcode(job->in.c_str(), job->out.c_str(), enc, &dec);
+    }
+    }
+    return AVERROR(EINVAL);
+}
 
-    int qcr = avformat_query_codec(oc->oformat, oc->oformat->video_codec, 0);
-    AVStream *st = avformat_new_stream(oc, NULL);
-    muxing_queue = av_fifo_alloc2(8, sizeof(AVPacket*), 0);
-    filtered_frame = av_frame_alloc();
-    outpkt = av_packet_alloc();
+/* Run every job of the manifest in one process. The core budget is split
+ * between job-level parallelism and codec threads: with many more files
+ * than cores each job gets a single codec thread, which scales better than
+ * frame threading inside one decoder. Returns the number of failed jobs,
+ * or a negative error if the manifest could not be read. */
+static int run_batch(const char *manifest, const BatchConfig &cfg)
+{
+    std::vector<BatchJob> jobs;
+    std::vector<std::thread> threads;
+    auto wall_start = std::chrono::steady_clock::now();
+    int budget = cfg.core_budget > 0 ? cfg.core_budget : av_cpu_count();
+    int ret, failed = 0;
 
+    if ((ret = parse_manifest(manifest, &jobs)) < 0)
+        return ret;
+    if (jobs.empty())
+        return 0;
 
-    err = avio_open2(&oc->pb, outname.c_str(), AVIO_FLAG_WRITE,&oc->interrupt_callback,NULL);
+    int workers = cfg.jobs > 0 ? cfg.jobs : budget;
+    workers = FFMAX(1, FFMIN(workers, (int)jobs.size()));
+    int codec_threads = cores_per_job(budget, workers);
+    printf("Running %zu jobs on %d workers, %d codec threads each\n",
+           jobs.size(), workers, codec_threads);
 
-    av_dict_copy(&oc->metadata, format_ctx->metadata,AV_DICT_DONT_OVERWRITE);
-    av_dict_set(&oc->metadata, "creation_time", NULL, 0);
-    av_dict_set(&oc->metadata, "company_name", NULL, 0);
-    av_dict_set(&oc->metadata, "product_name", NULL, 0);
-    av_dict_set(&oc->metadata, "product_version", NULL, 0);
-    av_dict_copy(&st->metadata, format_ctx->streams[0]->metadata, AV_DICT_DONT_OVERWRITE);
+    WorkStealingQueue queue(workers);
+    for (size_t i = 0; i < jobs.size(); i++)
+        queue.push(i % workers, i);
 
-    err = avformat_write_header(oc, NULL);
+    for (int w = 0; w < workers; w++) {
+        threads.emplace_back([&, w] {
+            int i;
+            while (queue.pop(w, &i)) {
+                auto start = std::chrono::steady_clock::now();
+                jobs[i].ret = run_batch_job(&jobs[i], codec_threads);
+                jobs[i].seconds = std::chrono::duration<double>(
+                    std::chrono::steady_clock::now() - start).count();
+            }
+        });
+    }
+    for (std::thread &t : threads)
+        t.join();
 
-    err = av_read_frame(format_ctx, outpkt);
+    for (const BatchJob &job : jobs) {
+        if (job.ret >= 0)
+            continue;
+        char buffer[AV_ERROR_MAX_STRING_SIZE]{0};
+        av_make_error_string(buffer, AV_ERROR_MAX_STRING_SIZE, job.ret);
+        fprintf(stderr, "%s:%d: %s failed: %s\n", manifest, job.line, job.in.c_str(), buffer);
+        failed++;
+    }
+    double wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - wall_start).count();
+    printf("Batch done: %zu jobs, %d failed, %.2fs wall\n", jobs.size(), failed, wall);
+    return failed;
+}
 
-    
+/* Benchmark mode. Runs each path over a fixed corpus, one file per line of
+ * the corpus list ('#' comments allowed); the reference corpus is H.264,
+ * HEVC and AV1 at 720p, 1080p and 4K with AAC and Opus audio. Every
+ * (file, path) pair becomes one JSON line carrying the tag and host, so
+ * runs from different commits and machines can be diffed directly. */
+struct BenchConfig {
+    const char *json_path = NULL;   /* NULL = stdout */
+    const char *tag = "";           /* e.g. the commit being measured */
+    const char *out_dir = "/tmp";   /* scratch outputs of remux and raw */
+    /* comma separated subset of demux,decode,remux,raw */
+    const char *paths = "demux,decode,remux,raw";
+};
+static BenchConfig bench_cfg;
 
-    err = av_fifo_write(muxing_queue, outpkt, 1);
+struct BenchResult {
+    int64_t frames = 0;
+    int64_t bytes = 0;
+    int ret = 0;
+};
 
+/* av_read_frame() only: container parsing and IO. */
+static int bench_demux(const char *in_file, BenchResult *r)
+{
+    AVFormatContext *ic = NULL;
+    AVPacket *pkt = NULL;
+    int ret;
 
-    if(err!=0){
-        std::cerr<<"error"<<std::endl;
-        return -1;
-    
+    if ((ret = open_input_with_info(&ic, in_file)) < 0)
+        return ret;
+    int video_idx = av_find_best_stream(ic, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0);
+    if (!(pkt = av_packet_alloc())) {
+        ret = AVERROR(ENOMEM);
+        goto end;
     }
-    av_frame_unref(decoded_frame);
-    av_packet_free(&pkt);
-    
+    while ((ret = timed_read_frame(ic, pkt)) >= 0) {
+        r->bytes += pkt->size;
+        r->frames += pkt->stream_index == video_idx;
+        av_packet_unref(pkt);
+    }
+    if (ret == AVERROR_EOF)
+        ret = 0;
 
+end:
+    av_packet_free(&pkt);
+    close_input(&ic);
+    return ret;
+}
 
+/* Demux and decode video and audio, discarding the frames. */
+static int bench_decode(const char *in_file, BenchResult *r)
+{
+    AVFormatContext *ic = NULL;
+    AVCodecContext *dec[2] = { NULL, NULL };
+    int idx[2] = { -1, -1 };
+    AVPacket *pkt = NULL;
+    AVFrame *frame = NULL;
+    int ret;
 
+    if ((ret = open_input_with_info(&ic, in_file)) < 0)
+        return ret;
+    open_codec_context(&idx[0], &dec[0], ic, AVMEDIA_TYPE_VIDEO);
+    open_codec_context(&idx[1], &dec[1], ic, AVMEDIA_TYPE_AUDIO);
+    if (!dec[0] && !dec[1]) {
+        ret = AVERROR_STREAM_NOT_FOUND;
+        goto end;
+    }
+    {
+        std::vector<int> used(ic->nb_streams, -1);
+        for (int i = 0; i < 2; i++)
+            if (dec[i])
+                used[idx[i]] = 0;
+        discard_unmapped_streams(ic, used);
+    }
+    pkt = av_packet_alloc();
+    frame = av_frame_alloc();
+    if (!pkt || !frame) {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
 
+    for (;;) {
+        bool eof = (ret = timed_read_frame(ic, pkt)) < 0;
+        if (eof && ret != AVERROR_EOF)
+            break;
+        for (int i = 0; i < 2; i++) {
+            if (!dec[i] || (!eof && pkt->stream_index != idx[i]))
+                continue;
+            r->bytes += eof ? 0 : pkt->size;
+            /* a NULL packet drains the decoder at the end */
+            if ((ret = timed_send_packet(dec[i], eof ? NULL : pkt)) < 0)
+                break;
+            while ((ret = timed_receive_frame(dec[i], frame)) >= 0) {
+                r->frames += i == 0;
+                av_frame_unref(frame);
+            }
+            if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF)
+                ret = 0;
+            if (ret < 0)
+                break;
+        }
+        av_packet_unref(pkt);
+        if (eof || ret < 0)
+            break;
+    }
+    if (ret == AVERROR_EOF)
+        ret = 0;
 
+end:
+    av_frame_free(&frame);
+    av_packet_free(&pkt);
+    for (int i = 0; i < 2; i++)
+        free_decoder_context(&dec[i]);
+    close_input(&ic);
+    return ret;
+}
 
-    try{
-        //const AVCodec *codec = avcodec_find_encoder(AVCodecID::AV_CODEC_ID_H264);
-        const AVCodec *codec = avcodec_find_encoder_by_name("libx264");
-        if(codec==nullptr){
-            throw std::runtime_error("codec find error");
-        }
-    }catch(std::exception &e){
-        std::cerr<<e.what()<<std::endl;
+static std::string bench_output(const char *in_file, const char *suffix)
+{
+    const char *base = strrchr(in_file, '/');
+    return std::string(bench_cfg.out_dir) + "/bench_" + (base ? base + 1 : in_file) + suffix;
+}
 
-    }
-    
+static int64_t file_size(const char *path)
+{
+    struct stat st;
+    return stat(path, &st) < 0 ? 0 : st.st_size;
+}
 
+static int bench_remux(const char *in_file, BenchResult *r)
+{
+    std::string out = bench_output(in_file, ".mkv");
+    int ret = remux_streams(in_file, out.c_str(), RemuxConfig());
+    r->bytes = file_size(in_file);
+    unlink(out.c_str());
+    return ret;
 }
 
+/* decode_to_raw(): decode plus the raw video and audio writers. */
+static int bench_raw(const char *in_file, BenchResult *r)
+{
+    std::string video = bench_output(in_file, ".yuv"), audio = bench_output(in_file, ".pcm");
+    int ret = decode_to_raw(in_file, video.c_str(), audio.c_str(), &decoder_cfg, DecodeRange(),
+                            &r->frames);
+    r->bytes = file_size(video.c_str()) + file_size(audio.c_str());
+    unlink(video.c_str());
+    unlink(audio.c_str());
+    return ret;
+}
 
-void testYUV(){
-    std::string filename("/home/liu/project/ffmpeglib/output.mp4");
-    std::ifstream infile(filename,std::ios::binary);
-    std::ofstream outfile;
-    int yuv_size = 1920*1080*3/2;
-    unsigned char *buffer = new unsigned char[yuv_size];
-    for(int i=0;i<10;++i){
-        std::string outname = std::to_string(i)+".yuv";
-        outfile.open(outname,std::ios::binary);
-        infile.read((char*)buffer,yuv_size);
-        outfile.write((char*)buffer,yuv_size);
-        outfile.close();
+static void bench_json_string(FILE *out, const char *s)
+{
+    fputc('"', out);
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\')
+            fputc('\\', out);
+        if ((unsigned char)*s >= 0x20)
+            fputc(*s, out);
     }
-    delete[] buffer;
+    fputc('"', out);
+}
 
+/* What a bench child sends back through its pipe. */
+struct BenchChildResult {
+    BenchResult r;
+    uint64_t pool_misses;
+};
 
-}
+/* Run one path over in_file in a forked child, so that ru (peak RSS, CPU
+ * time, page faults) comes from wait4() for that run alone rather than
+ * from whatever this process ran before it. The child's peak starts at
+ * what the parent had resident when it forked, the same for every run.
+ * Stage timers recorded in the child do not reach this process' metrics. */
+static int bench_run_child(int (*run)(const char *, BenchResult *), const char *in_file,
+                           BenchResult *r, uint64_t *pool_misses, struct rusage *ru)
+{
+    BenchChildResult c;
+    int fds[2], status;
+    ssize_t n;
+    pid_t pid;
 
+    memset(ru, 0, sizeof(*ru));
+    if (pipe(fds) < 0)
+        return AVERROR(errno);
+    fflush(NULL);
+    {
+        /* the metrics thread may hold it when we fork, and the child's
+         * threads register under it */
+        std::lock_guard<std::mutex> lock(metrics_registry.mutex);
+        pid = fork();
+    }
+    if (pid < 0) {
+        int err = AVERROR(errno);
+        ::close(fds[0]);
+        ::close(fds[1]);
+        return err;
+    }
+    if (!pid) {
+        ::close(fds[0]);
+        uint64_t misses = frame_pool.stats.misses + packet_pool.stats.misses;
+        c.r.ret = run(in_file, &c.r);
+        c.pool_misses = frame_pool.stats.misses + packet_pool.stats.misses - misses;
+        fflush(NULL);
+        _exit(write(fds[1], &c, sizeof(c)) == sizeof(c) ? 0 : 1);
+    }
 
+    ::close(fds[1]);
+    while ((n = read(fds[0], &c, sizeof(c))) < 0 && errno == EINTR)
+        ;
+    ::close(fds[0]);
+    while (wait4(pid, &status, 0, ru) < 0) {
+        if (errno != EINTR)
+            return AVERROR(errno);
+    }
+    if (n != sizeof(c) || !WIFEXITED(status) || WEXITSTATUS(status)) {
+        fprintf(stderr, "Benchmark child for %s exited abnormally\n", in_file);
+        return AVERROR_EXTERNAL;
+    }
+    *r = c.r;
+    *pool_misses = c.pool_misses;
+    return r->ret;
+}
 
-void testDemuxer(){
-    const char* inputFileUrl = "GK88_mpeg4.mp4";
+static int run_bench(const char *corpus, const BenchConfig &cfg)
+{
+    static const struct {
+        const char *name;
+        int (*run)(const char *, BenchResult *);
+    } paths[] = {
+        { "demux",  bench_demux  },
+        { "decode", bench_decode },
+        { "remux",  bench_remux  },
+        { "raw",    bench_raw    },
+    };
+    std::ifstream list(corpus);
+    std::vector<std::string> files;
+    std::string line;
+    char host[256] = "unknown";
+    FILE *out = stdout;
+    int failed = 0;
+
+    if (!list.is_open()) {
+        fprintf(stderr, "Could not open corpus list %s\n", corpus);
+        return AVERROR(ENOENT);
+    }
+    while (std::getline(list, line))
+        if (!line.empty() && line[0] != '#')
+            files.push_back(line);
+    if (cfg.json_path && !(out = fopen(cfg.json_path, "a"))) {
+        fprintf(stderr, "Could not open %s\n", cfg.json_path);
+        return AVERROR(errno);
+    }
+    gethostname(host, sizeof(host) - 1);
 
-	//解封装
-	AVFormatContext* inputContext = nullptr;
-	avformat_open_input(&inputContext, inputFileUrl, NULL, NULL);
-	avformat_find_stream_info(inputContext, NULL);
-
-	//打印视频封装信息
-	av_dump_format(inputContext, 0, inputFileUrl,0);
-
-	//分离音频流和视频流
-	AVStream* audioInputStream = nullptr;
-	AVStream* videoInputStream = nullptr;
-
-	for (int i = 0; i < inputContext->nb_streams; i++)
-	{
-		if (inputContext->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_AUDIO)
-			audioInputStream = inputContext->streams[i];
-		else if (inputContext->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_VIDEO)
-			videoInputStream = inputContext->streams[i];
-		else continue;
-	}
-
-	//重封装
-	const char* outputFileUrl = "test_output.mp4";
-	AVFormatContext* outputContext = nullptr;
-	//根据输出文件后缀推测封装格式
-	avformat_alloc_output_context2(&outputContext, NULL, NULL, outputFileUrl);
-	//添加音频流和视频流
-	AVStream* videoOutputStream = avformat_new_stream(outputContext, NULL);
-	//AVStream* audioOutputStream = avformat_new_stream(outputContext, NULL);
-	//打开IO流
-	avio_open(&outputContext->pb, outputFileUrl, AVIO_FLAG_WRITE);
-	//将输入视频流的封装配置复制至输出视频流
-	videoOutputStream->time_base = videoInputStream->time_base;
-	avcodec_parameters_copy(videoOutputStream->codecpar, videoInputStream->codecpar);
-	// //将输入音频流的封装配置复制至输出音频流
-	// audioOutputStream->time_base = audioInputStream->time_base;
-	// avcodec_parameters_copy(audioOutputStream->codecpar, audioInputStream->codecpar);
-	//写入文件头信息
-	avformat_write_header(outputContext, NULL);
-	av_dump_format(outputContext, 0, outputFileUrl, 1);
-
-	//读取输入流
-	AVPacket packet;
-    int frame_num = 0;
-    bool hasKey = false;
-	for (;;)
-	{
-		int result = av_read_frame(inputContext, &packet);
-		if (result != 0) break;
-        if(++frame_num<100) continue;
-        if(frame_num >= 10000) break;
-        if(!hasKey){
-            if(!(packet.flags&AV_PKT_FLAG_KEY)){
+    for (const std::string &file : files) {
+        for (const auto &path : paths) {
+            if (!strstr(cfg.paths, path.name))
                 continue;
-            }else{
-                hasKey = true;
-            }
-        }
-        
 
+            BenchResult r;
+            struct rusage ru;
+            uint64_t pool_misses = 0;
+            auto t0 = std::chrono::steady_clock::now();
+
+            r.ret = bench_run_child(path.run, file.c_str(), &r, &pool_misses, &ru);
 
-		if (packet.stream_index == videoOutputStream->index)
-		{
-			std::cout << "视频:";
-		}
-		// else if (packet.stream_index == audioOutputStream->index) {
-		// 	std::cout << "音频:";
-		// }
-		std::cout << packet.pts << " : " << packet.dts << " :" << packet.size <<std::endl;
+            double wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+            double cpu = ru.ru_utime.tv_sec + ru.ru_stime.tv_sec +
+                         (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e6;
+            failed += r.ret < 0;
 
-		av_interleaved_write_frame(outputContext, &packet);
-	}
-    std::cout<<"frame sum :"<<frame_num<<std::endl;
-	av_write_trailer(outputContext);
-	avformat_close_input(&inputContext);
-	avio_closep(&outputContext->pb);
-	avformat_free_context(outputContext);
-	outputContext = nullptr;
+            /* frame/packet pool misses, the allocations the pools could not
+             * serve from recycled entries. The children inherit the decode
+             * and I/O settings from the command line, so each line records
+             * the configuration it was measured with. */
+            fprintf(out, "{\"tag\": ");
+            bench_json_string(out, cfg.tag);
+            fprintf(out, ", \"host\": ");
+            bench_json_string(out, host);
+            fprintf(out, ", \"cores\": %d, \"input\": ", av_cpu_count());
+            bench_json_string(out, file.c_str());
+            fprintf(out, ", \"path\": \"%s\", \"ok\": %s, \"frames\": %lld, \"bytes\": %lld, "
+                    "\"wall_s\": %.4f, \"cpu_s\": %.4f, \"fps\": %.2f, \"mb_per_s\": %.2f, "
+                    "\"cpu_s_per_frame\": %.6f, \"peak_rss_kb\": %ld, \"pool_misses\": %llu, "
+                    "\"minor_faults\": %ld, \"pipeline\": %s, \"zero_copy\": %s, "
+                    "\"block_writer\": %s, \"mmap\": %s}\n",
+                    path.name, r.ret < 0 ? "false" : "true",
+                    (long long)r.frames, (long long)r.bytes, wall, cpu,
+                    wall > 0 ? r.frames / wall : 0, wall > 0 ? r.bytes / wall / 1e6 : 0,
+                    r.frames ? cpu / r.frames : 0, ru.ru_maxrss,
+                    (unsigned long long)pool_misses, ru.ru_minflt,
+                    decode_pipeline_cfg.enabled ? "true" : "false",
+                    video_zero_copy ? "true" : "false",
+                    raw_writer_cfg.enabled ? "true" : "false",
+                    input_cfg.use_mmap ? "true" : "false");
+            fflush(out);
+        }
+    }
+    if (out != stdout)
+        fclose(out);
+    return failed;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [--batch manifest [--jobs n] [--cores n]]\n"
+                    "       [--remux-cache dir] [--mem-budget MB]\n"
+                    "       [--frames all|key|every=N] [--pipeline] [--raw-zero-copy]\n"
+                    "       [--block-writer [--direct-io] [--block-writer-mb MB]]\n"
+                    "       [--mmap-input] [--prefetch [--prefetch-mb MB] [--prefetch-connections n]]\n"
+                    "       [--probesize bytes] [--analyzeduration us] [--fpsprobesize n] [--probe-cache]\n"
+                    "       [--hwaccel cuda|vaapi|qsv [--hwaccel-device dev]] [--encoder name]\n"
+                    "       [--vf filters] [--af filters] [--filter-threads n] [--filter-thread-type slice|none]\n"
+                    "       [--fanout input [--fanout-raw out.yuv] [--fanout-thumbs pattern.ppm]\n"
+                    "        [--fanout-encode out.mp4] [--fanout-policy raw|thumbs|encode=block|drop|coalesce]]\n"
+                    "       [--metrics file.json|-] [--metrics-interval seconds] [--frame-log]\n"
+                    "       [--bench corpus.txt [--bench-json out.jsonl] [--bench-tag tag]\n"
+                    "        [--bench-paths demux,decode,remux,raw] [--bench-dir dir]]\n"
+                    "       [--live url out.yuv [--live-latency-ms ms] [--live-duration seconds]]\n"
+                    "       [--raw-split in.yuv pattern [--raw-split-start seconds] [--raw-split-frames n]\n"
+                    "        [--raw-split-threads n]] [--no-raw-index]\n", prog);
 }
 
 int main (int argc, char **argv)
 {
+    const char *manifest = NULL, *corpus = NULL, *live_url = NULL, *live_out = NULL;
+    const char *fanout_in = NULL, *split_in = NULL, *split_pattern = NULL;
+    int ret = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--batch") && i + 1 < argc) {
+            manifest = argv[++i];
+        } else if (!strcmp(argv[i], "--jobs") && i + 1 < argc) {
+            batch_cfg.jobs = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--cores") && i + 1 < argc) {
+            batch_cfg.core_budget = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--hwaccel") && i + 1 < argc) {
+            decoder_cfg.hw_device_type = av_hwdevice_find_type_by_name(argv[++i]);
+            if (decoder_cfg.hw_device_type == AV_HWDEVICE_TYPE_NONE) {
+                fprintf(stderr, "Unknown hardware device type %s\n", argv[i]);
+                return 1;
+            }
+        } else if (!strcmp(argv[i], "--hwaccel-device") && i + 1 < argc) {
+            decoder_cfg.hw_device = argv[++i];
+        } else if (!strcmp(argv[i], "--fanout") && i + 1 < argc) {
+            fanout_in = argv[++i];
+        } else if (!strcmp(argv[i], "--fanout-raw") && i + 1 < argc) {
+            fanout_cfg.raw_out = argv[++i];
+        } else if (!strcmp(argv[i], "--fanout-thumbs") && i + 1 < argc) {
+            fanout_cfg.thumb_pattern = argv[++i];
+        } else if (!strcmp(argv[i], "--fanout-encode") && i + 1 < argc) {
+            fanout_cfg.encode_out = argv[++i];
+        } else if (!strcmp(argv[i], "--fanout-policy") && i + 1 < argc) {
+            const char *eq = strchr(argv[++i], '=');
+            std::string output(argv[i], eq ? eq - argv[i] : strlen(argv[i]));
+            FrameFanout::Policy *policy = output == "raw" ? &fanout_cfg.raw_policy :
+                                          output == "thumbs" ? &fanout_cfg.thumb_policy :
+                                          output == "encode" ? &fanout_cfg.encode_policy : NULL;
+            if (!eq || !policy || parse_fanout_policy(eq + 1, policy) < 0) {
+                usage(argv[0]);
+                return 1;
+            }
+        } else if (!strcmp(argv[i], "--vf") && i + 1 < argc) {
+            filter_cfg.video = argv[++i];
+        } else if (!strcmp(argv[i], "--af") && i + 1 < argc) {
+            filter_cfg.audio = argv[++i];
+        } else if (!strcmp(argv[i], "--filter-threads") && i + 1 < argc) {
+            filter_cfg.nb_threads = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--filter-thread-type") && i + 1 < argc) {
+            i++;
+            filter_cfg.thread_type = !strcmp(argv[i], "none") ? 0 : AVFILTER_THREAD_SLICE;
+        } else if (!strcmp(argv[i], "--encoder") && i + 1 < argc) {
+            encoder_cfg.encoder = argv[++i];
+        } else if (!strcmp(argv[i], "--frames") && i + 1 < argc) {
+            if (parse_frame_select(argv[++i], &frame_select_cfg) < 0) {
+                usage(argv[0]);
+                return 1;
+            }
+        } else if (!strcmp(argv[i], "--pipeline")) {
+            decode_pipeline_cfg.enabled = true;
+        } else if (!strcmp(argv[i], "--raw-zero-copy")) {
+            video_zero_copy = true;
+        } else if (!strcmp(argv[i], "--block-writer")) {
+            raw_writer_cfg.enabled = true;
+        } else if (!strcmp(argv[i], "--direct-io")) {
+            raw_writer_cfg.direct_io = true;
+        } else if (!strcmp(argv[i], "--block-writer-mb") && i + 1 < argc) {
+            raw_writer_cfg.buffer_size = (size_t)FFMAX(atoi(argv[++i]), 1) << 20;
+        } else if (!strcmp(argv[i], "--mmap-input")) {
+            input_cfg.use_mmap = true;
+        } else if (!strcmp(argv[i], "--prefetch")) {
+            prefetch_cfg.enabled = true;
+        } else if (!strcmp(argv[i], "--prefetch-mb") && i + 1 < argc) {
+            prefetch_cfg.buffer_mb = FFMAX(atoi(argv[++i]), 1);
+        } else if (!strcmp(argv[i], "--prefetch-connections") && i + 1 < argc) {
+            prefetch_cfg.connections = FFMAX(atoi(argv[++i]), 1);
+        } else if (!strcmp(argv[i], "--probesize") && i + 1 < argc) {
+            input_cfg.probesize = atoll(argv[++i]);
+        } else if (!strcmp(argv[i], "--analyzeduration") && i + 1 < argc) {
+            input_cfg.analyzeduration = atoll(argv[++i]);
+        } else if (!strcmp(argv[i], "--fpsprobesize") && i + 1 < argc) {
+            input_cfg.fpsprobesize = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--probe-cache")) {
+            input_cfg.probe_cache = true;
+        } else if (!strcmp(argv[i], "--mem-budget") && i + 1 < argc) {
+            memory_cfg.limit = (int64_t)(atof(argv[++i]) * (1 << 20));
+        } else if (!strcmp(argv[i], "--remux-cache") && i + 1 < argc) {
+            remux_cache_cfg.dir = argv[++i];
+        } else if (!strcmp(argv[i], "--metrics") && i + 1 < argc) {
+            metrics_cfg.enabled = true;
+            i++;
+            metrics_cfg.json_path = strcmp(argv[i], "-") ? argv[i] : NULL;
+        } else if (!strcmp(argv[i], "--metrics-interval") && i + 1 < argc) {
+            metrics_cfg.interval = atof(argv[++i]);
+        } else if (!strcmp(argv[i], "--frame-log")) {
+            metrics_cfg.frame_log = true;
+        } else if (!strcmp(argv[i], "--live") && i + 2 < argc) {
+            live_url = argv[++i];
+            live_out = argv[++i];
+        } else if (!strcmp(argv[i], "--live-latency-ms") && i + 1 < argc) {
+            live_cfg.max_latency = atoll(argv[++i]) * 1000;
+        } else if (!strcmp(argv[i], "--live-duration") && i + 1 < argc) {
+            live_cfg.duration = (int64_t)(atof(argv[++i]) * AV_TIME_BASE);
+        } else if (!strcmp(argv[i], "--raw-split") && i + 2 < argc) {
+            split_in = argv[++i];
+            split_pattern = argv[++i];
+        } else if (!strcmp(argv[i], "--raw-split-start") && i + 1 < argc) {
+            raw_split_cfg.start_time = (int64_t)(atof(argv[++i]) * AV_TIME_BASE);
+        } else if (!strcmp(argv[i], "--raw-split-frames") && i + 1 < argc) {
+            raw_split_cfg.frame_count = atoll(argv[++i]);
+        } else if (!strcmp(argv[i], "--raw-split-threads") && i + 1 < argc) {
+            raw_split_cfg.threads = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--no-raw-index")) {
+            raw_index_cfg.enabled = false;
+        } else if (!strcmp(argv[i], "--bench") && i + 1 < argc) {
+            corpus = argv[++i];
+        } else if (!strcmp(argv[i], "--bench-json") && i + 1 < argc) {
+            bench_cfg.json_path = argv[++i];
+        } else if (!strcmp(argv[i], "--bench-tag") && i + 1 < argc) {
+            bench_cfg.tag = argv[++i];
+        } else if (!strcmp(argv[i], "--bench-paths") && i + 1 < argc) {
+            bench_cfg.paths = argv[++i];
+        } else if (!strcmp(argv[i], "--bench-dir") && i + 1 < argc) {
+            bench_cfg.out_dir = argv[++i];
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    metrics_start();
+    if (manifest || corpus || live_url || fanout_in || split_in) {
+        if (split_in)
+            ret = split_raw_frames(split_in, split_pattern, raw_split_cfg) < 0;
+        else if (fanout_in)
+            ret = fanout_decode(fanout_in, fanout_cfg) < 0;
+        else if (manifest)
+            ret = run_batch(manifest, batch_cfg) != 0;
+        else if (corpus)
+            ret = run_bench(corpus, bench_cfg) != 0;
+        else
+            ret = live_ingest(live_url, live_out, live_cfg) < 0;
+        metrics_finish();
+        return ret;
+    }
+
     //testYUV();
     //demuxer_decode();
     //encode_video();
     testDemuxer();
+    //trim_clip("GK88_mpeg4.mp4", "test_clip.mp4", 10 * AV_TIME_BASE, 20 * AV_TIME_BASE);
+    //abr_transcode("test_video.1080p.mp4", { { "ladder_720p.mp4", 0, 720, 3000000 },
+    //                                         { "ladder_360p.mp4", 0, 360, 800000 } }, encoder_cfg);
+    //parallel_segment_remux("GK88_mpeg4.mp4", "GK88_segment", "GK88_joined.ts", SegmentRemuxConfig());
+    metrics_finish();
     return 0;
 }